@@ -1,11 +1,194 @@
 #include "common.hpp"
-#include <ctime>
+#include <cstring>
+#include <fstream>
+#include <vector>
+#ifdef _WIN32
+#include <windows.h>
+#include <lmcons.h>
+#else
+#include <cstdlib>
+#include <cerrno>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
 
-std::string curr_time() { 
-	std::time_t sys_time = std::time(nullptr);
-	tm local_time; 
-	localtime_s(&local_time, &sys_time);
-	char buffer[80];
-	strftime(buffer, 80, "[%c]", &local_time);
-	return std::string(buffer) + " ";
+#ifdef _WIN32
+const char path_separator = '\\';
+
+std::string app_data_path() {
+	DWORD username_length = UNLEN + 1;
+	char username[UNLEN + 1];
+	GetUserNameA(username, &username_length);
+	std::string appdata_path("C:\\Users\\" + std::string(username) + "\\AppData\\Local\\logitech-unify-mqtt");
+	if (CreateDirectoryA(appdata_path.c_str(), NULL) || ERROR_ALREADY_EXISTS == GetLastError()) {
+		return appdata_path;
+	}
+	return "";
+}
+
+void create_default_config(const std::string& config_path) {
+	HANDLE config_file = CreateFileA(config_path.c_str(), GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL, OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (GetLastError() != ERROR_ALREADY_EXISTS) {
+		WritePrivateProfileStringA("MQTT", "address", "", config_path.c_str());
+		WritePrivateProfileStringA("MQTT", "username", "", config_path.c_str());
+		WritePrivateProfileStringA("MQTT", "password", "", config_path.c_str());
+		WritePrivateProfileStringA("MQTT", "discovery-prefix","homeassistant", config_path.c_str());
+		WritePrivateProfileStringA("MQTT", "publishes-per-second", "20", config_path.c_str());
+		WritePrivateProfileStringA("Powersave", "window", "500", config_path.c_str());
+		WritePrivateProfileStringA("Log", "level", "info", config_path.c_str());
+		WritePrivateProfileStringA("Log", "max-size-kb", "1024", config_path.c_str());
+		WritePrivateProfileStringA("Battery", "poll-interval", "600", config_path.c_str());
+		WritePrivateProfileStringA("Battery", "requests-per-second", "2", config_path.c_str());
+		WritePrivateProfileStringA("Flap", "penalty", "1000", config_path.c_str());
+		WritePrivateProfileStringA("Flap", "suppress-limit", "3000", config_path.c_str());
+		WritePrivateProfileStringA("Flap", "reuse-limit", "1500", config_path.c_str());
+		WritePrivateProfileStringA("Flap", "half-life", "30", config_path.c_str());
+		WritePrivateProfileStringA("Diagnostics", "interval", "60", config_path.c_str());
+		WritePrivateProfileStringA("Usage", "interval", "3600", config_path.c_str());
+		WritePrivateProfileStringA("Usage", "days", "7", config_path.c_str());
+		WritePrivateProfileStringA("Local", "socket", "", config_path.c_str());
+	}
+	CloseHandle(config_file);
+}
+
+std::string host_name() {
+	char name[MAX_COMPUTERNAME_LENGTH + 1];
+	DWORD name_length = sizeof(name);
+	if (!GetComputerNameA(name, &name_length)) {
+		return "";
+	}
+	return std::string(name, name_length);
+}
+
+std::string read_config_value(const std::string& config_path, const std::string& section, const std::string& key) {
+	std::vector<char> config_buffer(64);
+	GetPrivateProfileStringA(section.c_str(), key.c_str(), NULL, config_buffer.data(), config_buffer.capacity(), config_path.c_str());
+	return std::string(config_buffer.data());
+}
+
+std::vector<std::pair<std::string, std::string>> read_config_section(const std::string& config_path, const std::string& section) {
+	// key=value pairs separated by nuls, ending with two
+	std::vector<char> section_buffer(32767);
+	GetPrivateProfileSectionA(section.c_str(), section_buffer.data(), (DWORD)section_buffer.size(), config_path.c_str());
+	std::vector<std::pair<std::string, std::string>> values;
+	for (const char* entry = section_buffer.data(); *entry != 0; entry += std::strlen(entry) + 1) {
+		const char* equals = std::strchr(entry, '=');
+		if (equals != nullptr) {
+			values.emplace_back(std::string(entry, equals), std::string(equals + 1));
+		}
+	}
+	return values;
+}
+#else
+const char path_separator = '/';
+
+std::string app_data_path() {
+	// $LOGITECH_UNIFY_MQTT_DIR, then $XDG_CONFIG_HOME, then ~/.config
+	std::string appdata_path;
+	if (const char* dir = std::getenv("LOGITECH_UNIFY_MQTT_DIR")) {
+		appdata_path = dir;
+	}
+	else if (const char* config_home = std::getenv("XDG_CONFIG_HOME")) {
+		appdata_path = std::string(config_home) + "/logitech-unify-mqtt";
+	}
+	else if (const char* home = std::getenv("HOME")) {
+		appdata_path = std::string(home) + "/.config/logitech-unify-mqtt";
+	}
+	else {
+		return "";
+	}
+	if (mkdir(appdata_path.c_str(), 0700) == 0 || errno == EEXIST) {
+		return appdata_path;
+	}
+	return "";
+}
+
+std::string host_name() {
+	char name[256];
+	if (gethostname(name, sizeof(name)) != 0) {
+		return "";
+	}
+	name[sizeof(name) - 1] = 0;
+	return name;
+}
+
+void create_default_config(const std::string& config_path) {
+	if (std::ifstream(config_path).good()) {
+		return;
+	}
+	std::ofstream config_file(config_path);
+	config_file << "[MQTT]\n"
+		<< "address=\n"
+		<< "username=\n"
+		<< "password=\n"
+		<< "discovery-prefix=homeassistant\n"
+		<< "publishes-per-second=20\n"
+		<< "[Powersave]\n"
+		<< "window=500\n"
+		<< "[Log]\n"
+		<< "level=info\n"
+		<< "max-size-kb=1024\n"
+		<< "[Battery]\n"
+		<< "poll-interval=600\n"
+		<< "requests-per-second=2\n"
+		<< "[Flap]\n"
+		<< "penalty=1000\n"
+		<< "suppress-limit=3000\n"
+		<< "reuse-limit=1500\n"
+		<< "half-life=30\n"
+		<< "[Diagnostics]\n"
+		<< "interval=60\n"
+		<< "[Usage]\n"
+		<< "interval=3600\n"
+		<< "days=7\n"
+		<< "[Local]\n"
+		<< "socket=\n";
+}
+
+std::string read_config_value(const std::string& config_path, const std::string& section, const std::string& key) {
+	std::ifstream config_file(config_path);
+	std::string line;
+	std::string current_section;
+	while (std::getline(config_file, line)) {
+		if (!line.empty() && line.back() == '\r') {
+			line.pop_back();
+		}
+		if (line.empty() || line[0] == ';' || line[0] == '#') {
+			continue;
+		}
+		if (line[0] == '[') {
+			current_section = line.substr(1, line.find(']') - 1);
+			continue;
+		}
+		size_t equals = line.find('=');
+		if (current_section == section && equals != std::string::npos && line.compare(0, equals, key) == 0 && equals == key.size()) {
+			return line.substr(equals + 1);
+		}
+	}
+	return "";
+}
+
+std::vector<std::pair<std::string, std::string>> read_config_section(const std::string& config_path, const std::string& section) {
+	std::ifstream config_file(config_path);
+	std::string line;
+	std::string current_section;
+	std::vector<std::pair<std::string, std::string>> values;
+	while (std::getline(config_file, line)) {
+		if (!line.empty() && line.back() == '\r') {
+			line.pop_back();
+		}
+		if (line.empty() || line[0] == ';' || line[0] == '#') {
+			continue;
+		}
+		if (line[0] == '[') {
+			current_section = line.substr(1, line.find(']') - 1);
+			continue;
+		}
+		size_t equals = line.find('=');
+		if (current_section == section && equals != std::string::npos) {
+			values.emplace_back(line.substr(0, equals), line.substr(equals + 1));
+		}
+	}
+	return values;
 }
+#endif
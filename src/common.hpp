@@ -1,7 +1,23 @@
 #pragma once
+#ifdef _WIN32
 // magically fix static linking
 #pragma comment(lib, "crypt32")
 #pragma comment(lib, "ws2_32.lib")
+#endif
 #include <thread>
 #include <string>
-std::string curr_time();
+#include <utility>
+#include <vector>
+// Per user directory holding config.ini and debug.log, created if it doesn't exist
+// returns "" if it can't be created
+std::string app_data_path();
+// Path separator for the current platform
+extern const char path_separator;
+// Writes the default config.ini if it doesn't exist yet
+void create_default_config(const std::string& config_path);
+// Name of this computer, "" if it can't be read
+std::string host_name();
+// Reads a value from an ini file, returns "" if the key is missing
+std::string read_config_value(const std::string& config_path, const std::string& section, const std::string& key);
+// Reads every key and value of a section of an ini file, in the order they appear
+std::vector<std::pair<std::string, std::string>> read_config_section(const std::string& config_path, const std::string& section);
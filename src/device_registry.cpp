@@ -0,0 +1,48 @@
+#include "device_registry.hpp"
+#include <algorithm>
+
+DeviceData* DeviceRegistry::find(unsigned int receiver_serial, unsigned char slot) {
+	for (auto& device : devices) {
+		if (device.receiver_serial == receiver_serial && device.slot == slot) {
+			return &device;
+		}
+	}
+	return nullptr;
+}
+
+DeviceData& DeviceRegistry::get(unsigned int receiver_serial, unsigned char slot, bool* added) {
+	DeviceData* device = find(receiver_serial, slot);
+	if (added != nullptr) {
+		*added = device == nullptr;
+	}
+	if (device != nullptr) {
+		return *device;
+	}
+	DeviceData new_device;
+	new_device.receiver_serial = receiver_serial;
+	new_device.slot = slot;
+	// keep devices of a receiver together and ordered by slot
+	auto position = std::upper_bound(devices.begin(), devices.end(), new_device, [](DeviceData const& a, DeviceData const& b) {
+		return a.receiver_serial < b.receiver_serial || (a.receiver_serial == b.receiver_serial && a.slot < b.slot);
+		});
+	return *devices.insert(position, new_device);
+}
+
+std::vector<DeviceData*> DeviceRegistry::receiver_devices(unsigned int receiver_serial) {
+	std::vector<DeviceData*> receiver_devices;
+	for (auto& device : devices) {
+		if (device.receiver_serial == receiver_serial) {
+			receiver_devices.push_back(&device);
+		}
+	}
+	return receiver_devices;
+}
+
+bool DeviceRegistry::remove(unsigned int receiver_serial, unsigned char slot) {
+	DeviceData* device = find(receiver_serial, slot);
+	if (device == nullptr) {
+		return false;
+	}
+	devices.erase(devices.begin() + (device - devices.data()));
+	return true;
+}
@@ -0,0 +1,133 @@
+#pragma once
+#include <string>
+#include <string_view>
+#include <vector>
+#include <chrono>
+
+enum DeviceStatus {
+	CONNECTED,
+	DISCONNECTED,
+	POWERSAVE,
+	// published instead of the status while the device is flapping, never stored as a device's status
+	UNSTABLE
+};
+
+// published as the power_state payload, views so publishing a status never allocates
+constexpr std::string_view device_status_names[] = { "connected", "disconnected", "powersave", "unstable" };
+
+constexpr std::string_view device_status_name(DeviceStatus status) {
+	return device_status_names[status];
+}
+
+struct DeviceData {
+	// serial of the receiver the device is paired to
+	unsigned int receiver_serial = 0;
+	// 1 indexed pairing slot on the receiver
+	unsigned char slot = 0;
+	DeviceStatus status = DISCONNECTED;
+	std::string name = "";
+	// from the last connection notification, selects the powersave window
+	unsigned short wireless_pid = 0;
+	// a connect is held until connect_deadline,
+	// a disconnect before then means the device went into powersave
+	bool connect_pending = false;
+	std::chrono::steady_clock::time_point connect_deadline;
+	// the startup ping is in flight, a connection notification before its reply is newer and wins
+	bool probe_pending = false;
+	// status has been published at least once
+	bool status_published = false;
+	// when status last changed, kept across restarts by the state cache
+	std::chrono::system_clock::time_point last_transition;
+	// HID++ 2.0 battery feature, looked up once per pairing:
+	// unified battery is tried first, then battery status, 0 once neither is there
+	bool features_resolved = false;
+	unsigned short battery_probe = 0;
+	unsigned short battery_feature = 0;
+	unsigned char battery_index = 0;
+	// percent, -1 until it has been read
+	int battery_level = -1;
+	bool battery_charging = false;
+	// a feature lookup or battery query is in flight
+	bool battery_query_pending = false;
+	std::chrono::steady_clock::time_point next_battery_poll;
+	// grows while the device doesn't answer, a connect resets it
+	std::chrono::seconds battery_backoff{ 0 };
+	// when the report behind the next status was read and decoded, for the latency metrics
+	std::chrono::steady_clock::time_point event_read_time;
+	std::chrono::steady_clock::time_point event_decode_time;
+	// every status change adds to the penalty and it halves every flap half-life,
+	// past the suppress limit the device is unstable until it decays to the reuse limit
+	double flap_penalty = 0;
+	std::chrono::steady_clock::time_point flap_updated;
+	bool unstable = false;
+	// when the penalty reaches the reuse limit if nothing else changes
+	std::chrono::steady_clock::time_point flap_reuse_time;
+	// status changes that weren't published since the device last became unstable
+	unsigned int suppressed_events = 0;
+	// the publish budget ran out, the latest status or battery is published once there is a token
+	bool status_publish_pending = false;
+	bool battery_publish_pending = false;
+
+	// what is published, status keeps tracking the device while it is unstable
+	DeviceStatus published_status() const { return unstable ? UNSTABLE : status; }
+
+	// a different model in the slot, everything read from the old one is gone
+	void forget_pairing() {
+		name = "";
+		features_resolved = false;
+		battery_probe = 0;
+		battery_feature = 0;
+		battery_index = 0;
+		battery_level = -1;
+		battery_charging = false;
+	}
+};
+
+// Every device of every receiver in one flat list, keyed by (receiver serial, slot)
+// a receiver has at most 6 slots, so a linear search beats any tree or hash here
+class DeviceRegistry {
+	std::vector<DeviceData> devices;
+
+public:
+	// a receiver can pair with at most 6 devices
+	static const unsigned char max_slot = 6;
+
+	// returns nullptr if the device isn't known
+	DeviceData* find(unsigned int receiver_serial, unsigned char slot);
+	// returns the device, adding it if it isn't known yet
+	// adding a device invalidates pointers returned earlier
+	DeviceData& get(unsigned int receiver_serial, unsigned char slot, bool* added = nullptr);
+	// returns false if the device isn't known, invalidates pointers returned earlier
+	bool remove(unsigned int receiver_serial, unsigned char slot);
+	// devices paired to one receiver, ordered by slot
+	std::vector<DeviceData*> receiver_devices(unsigned int receiver_serial);
+	std::vector<DeviceData>& all() { return devices; }
+};
+
+// What readers on other threads see of a device, plain data so it can be copied out of a SeqLock
+struct DeviceSnapshot {
+	unsigned int receiver_serial;
+	unsigned char slot;
+	DeviceStatus status;
+	// percent, -1 until it has been read
+	int battery_level;
+	bool battery_charging;
+	// null terminated, pairing names are at most 14 characters
+	char name[16];
+	// system clock ticks of the last status change
+	long long last_transition;
+	// status changes not published since the device last became unstable
+	unsigned int suppressed_events;
+};
+
+// Every device at one point in time, published by the driver thread whenever something a reader shows changed
+struct StateSnapshot {
+	// enough for 8 receivers, devices past that are left out
+	static const unsigned int max_devices = 8 * DeviceRegistry::max_slot;
+	// counts up with every snapshot, readers can tell whether anything changed since they last looked
+	unsigned long long version;
+	// the startup stages are done, before that devices may still show what was cached
+	bool ready;
+	unsigned int count;
+	DeviceSnapshot devices[max_devices];
+};
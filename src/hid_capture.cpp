@@ -0,0 +1,103 @@
+#include "hid_capture.hpp"
+#include <cerrno>
+#include <cstring>
+
+static const unsigned char capture_magic[8] = { 'L', 'U', 'M', 'Q', 'C', 'A', 'P', 1 };
+static const unsigned char capture_responder = 0x01;
+static const unsigned char capture_written = 0x02;
+
+bool read_capture(const std::string& path, std::vector<CaptureRecord>& records) {
+	std::FILE* file = std::fopen(path.c_str(), "rb");
+	if (file == nullptr) {
+		return false;
+	}
+	unsigned char magic[sizeof(capture_magic)];
+	bool valid = std::fread(magic, 1, sizeof(magic), file) == sizeof(magic) && std::memcmp(magic, capture_magic, sizeof(magic)) == 0;
+	unsigned char header[11];
+	while (valid && std::fread(header, 1, sizeof(header), file) == sizeof(header)) {
+		CaptureRecord record{};
+		for (int i = 7; i >= 0; --i) {
+			record.time_us = (record.time_us << 8) | header[i];
+		}
+		record.report.receiver = header[8];
+		record.report.channel = header[9] & capture_responder ? RESPONDER_CHANNEL : RECEIVER_CHANNEL;
+		record.written = (header[9] & capture_written) != 0;
+		record.report.size = header[10];
+		// a truncated last record is dropped
+		if (record.report.size > max_report_size || std::fread(record.report.data, 1, record.report.size, file) != record.report.size) {
+			break;
+		}
+		records.push_back(record);
+	}
+	std::fclose(file);
+	return valid;
+}
+
+CaptureTransport::CaptureTransport(HIDTransport* transport, const std::string& path, Logger& debug_log) : transport(transport), start(std::chrono::steady_clock::now()) {
+	file = std::fopen(path.c_str(), "wb");
+	if (file == nullptr) {
+		debug_log.log(LOG_OPEN_FAILED, path, errno);
+		return;
+	}
+	std::fwrite(capture_magic, 1, sizeof(capture_magic), file);
+}
+
+CaptureTransport::~CaptureTransport() {
+	delete transport;
+	if (file != nullptr) {
+		std::fclose(file);
+	}
+}
+
+void CaptureTransport::record(const HIDReport& report, bool written) {
+	if (file == nullptr) {
+		return;
+	}
+	std::uint64_t time_us = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count();
+	unsigned char header[11];
+	for (int i = 0; i < 8; ++i) {
+		header[i] = (unsigned char)(time_us >> (8 * i));
+	}
+	header[8] = (unsigned char)report.receiver;
+	header[9] = (report.channel == RESPONDER_CHANNEL ? capture_responder : 0) | (written ? capture_written : 0);
+	header[10] = (unsigned char)report.size;
+	std::fwrite(header, 1, sizeof(header), file);
+	std::fwrite(report.data, 1, report.size, file);
+}
+
+bool CaptureTransport::open_receivers(HIDDevicePath const& primary, HIDDevicePath const& responder, std::vector<unsigned int>& opened) {
+	return transport->open_receivers(primary, responder, opened);
+}
+
+void CaptureTransport::close_receiver(unsigned int receiver) {
+	transport->close_receiver(receiver);
+}
+
+void CaptureTransport::close_all() {
+	transport->close_all();
+	if (file != nullptr) {
+		std::fflush(file);
+	}
+}
+
+HIDReadResult CaptureTransport::read(HIDReport& report, int timeout_ms) {
+	HIDReadResult result = transport->read(report, timeout_ms);
+	if (result == HID_REPORT) {
+		record(report, false);
+	}
+	return result;
+}
+
+bool CaptureTransport::write(unsigned int receiver, const unsigned char* data, unsigned int size) {
+	HIDReport report;
+	report.receiver = receiver;
+	report.channel = data[0] == 0x10 ? RECEIVER_CHANNEL : RESPONDER_CHANNEL;
+	report.size = size < max_report_size ? size : max_report_size;
+	std::memcpy(report.data, data, report.size);
+	record(report, true);
+	return transport->write(receiver, data, size);
+}
+
+void CaptureTransport::wake() {
+	transport->wake();
+}
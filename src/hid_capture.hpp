@@ -0,0 +1,40 @@
+#pragma once
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#include <vector>
+#include "hid_transport.hpp"
+
+// Capture file: an 8 byte magic ("LUMQCAP" and a version byte) followed by records of
+//   8 bytes microseconds since the capture started, little endian
+//   1 byte receiver id
+//   1 byte flags, bit 0 set for the responder channel, bit 1 set for reports written to the receiver
+//   1 byte report size, then the report
+struct CaptureRecord {
+	std::uint64_t time_us;
+	bool written;
+	HIDReport report;
+};
+
+// reads every record of a capture, returns false if the file can't be read or isn't a capture
+bool read_capture(const std::string& path, std::vector<CaptureRecord>& records);
+
+// Records every report read from and written to another transport
+class CaptureTransport : public HIDTransport {
+	HIDTransport* transport;
+	std::FILE* file;
+	std::chrono::steady_clock::time_point start;
+	void record(const HIDReport& report, bool written);
+
+public:
+	// takes ownership of transport
+	CaptureTransport(HIDTransport* transport, const std::string& path, Logger& debug_log);
+	~CaptureTransport();
+	bool open_receivers(HIDDevicePath const& primary, HIDDevicePath const& responder, std::vector<unsigned int>& opened) override;
+	void close_receiver(unsigned int receiver) override;
+	void close_all() override;
+	HIDReadResult read(HIDReport& report, int timeout_ms) override;
+	bool write(unsigned int receiver, const unsigned char* data, unsigned int size) override;
+	void wake() override;
+};
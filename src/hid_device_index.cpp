@@ -0,0 +1,36 @@
+#include "hid_device_index.hpp"
+
+unsigned long long HIDDeviceIndex::key(HIDDevicePath const& ids) {
+	return ((unsigned long long)ids.vid << 32) | ((unsigned long long)ids.pid << 16) | (ids.mi << 8) | ids.col;
+}
+
+void HIDDeviceIndex::add(HIDDevicePath const& ids, std::string const& device_path) {
+	std::lock_guard<std::mutex> lock(index_mutex);
+	auto range = paths.equal_range(key(ids));
+	for (auto it = range.first; it != range.second; ++it) {
+		if (it->second == device_path) {
+			return;
+		}
+	}
+	paths.emplace(key(ids), device_path);
+}
+
+void HIDDeviceIndex::remove(std::string const& device_path) {
+	std::lock_guard<std::mutex> lock(index_mutex);
+	for (auto it = paths.begin(); it != paths.end(); ++it) {
+		if (it->second == device_path) {
+			paths.erase(it);
+			return;
+		}
+	}
+}
+
+std::vector<std::string> HIDDeviceIndex::find_all(HIDDevicePath const& ids) {
+	std::lock_guard<std::mutex> lock(index_mutex);
+	std::vector<std::string> matches;
+	auto range = paths.equal_range(key(ids));
+	for (auto it = range.first; it != range.second; ++it) {
+		matches.push_back(it->second);
+	}
+	return matches;
+}
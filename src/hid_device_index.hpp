@@ -0,0 +1,23 @@
+#pragma once
+#include <map>
+#include <mutex>
+#include <string>
+#include <vector>
+#include "hid_transport.hpp"
+
+// Cache of the HID interfaces that are plugged in, keyed by vid/pid/mi/col
+// it is filled by one enumeration at startup, then kept up to date by hotplug events,
+// so finding the receiver again after it is replugged is a lookup instead of an enumeration
+class HIDDeviceIndex {
+	std::mutex index_mutex;
+	// several receivers of the same model share a key
+	std::multimap<unsigned long long, std::string> paths;
+
+	static unsigned long long key(HIDDevicePath const& ids);
+
+public:
+	void add(HIDDevicePath const& ids, std::string const& device_path);
+	void remove(std::string const& device_path);
+	// every interface matching ids, one per plugged in device of that model
+	std::vector<std::string> find_all(HIDDevicePath const& ids);
+};
@@ -0,0 +1,102 @@
+#pragma once
+#include "logger.hpp"
+#include <vector>
+
+// The receiver exposes HID++ through two collections on interface 2:
+// col01 carries short (7 byte) reports, col02 carries long (20 byte) reports.
+// On Windows they are separate device interfaces,
+// on Linux both arrive on the same hidraw node and are told apart by the report id
+enum HIDChannel {
+	RECEIVER_CHANNEL,
+	RESPONDER_CHANNEL
+};
+
+enum HIDReadResult {
+	HID_REPORT,
+	HID_TIMEOUT,
+	HID_WOKEN,
+	// a hid interface was added or removed
+	HID_HOTPLUG,
+	// report.receiver was unplugged or failed, it has to be closed
+	HID_DEVICE_LOST
+};
+
+struct HIDDevicePath {
+	unsigned short vid;
+	unsigned short pid;
+	unsigned char mi;
+	unsigned char col;
+};
+
+struct HIDReport {
+	// id of the receiver the report came from, assigned by open_receivers
+	unsigned int receiver = 0;
+	HIDChannel channel = RECEIVER_CHANNEL;
+	unsigned int size = 0;
+	unsigned char data[20] = {};
+};
+
+// Largest report the receiver sends
+const unsigned int max_report_size = 20;
+
+// Reports collected by one wait, handed out one per read call before waiting again,
+// so a burst costs one wakeup instead of one per report
+class HIDReportBatch {
+public:
+	// as many as a hidraw node buffers
+	static const unsigned int capacity = 64;
+
+private:
+	HIDReport reports[capacity];
+	unsigned int head = 0;
+	unsigned int count = 0;
+
+public:
+	bool empty() const { return count == 0; }
+	bool full() const { return count == capacity; }
+	// the slot the next report is read into, push keeps it
+	HIDReport& next_slot() { return reports[(head + count) % capacity]; }
+	void push() { ++count; }
+	bool pop(HIDReport& report) {
+		if (count == 0) {
+			return false;
+		}
+		report = reports[head];
+		head = (head + 1) % capacity;
+		--count;
+		return true;
+	}
+	// a closed receiver's reports must not be handed out, its id may be reused
+	void drop_receiver(unsigned int receiver) {
+		unsigned int kept = 0;
+		for (unsigned int i = 0; i < count; ++i) {
+			HIDReport& report = reports[(head + i) % capacity];
+			if (report.receiver != receiver) {
+				reports[(head + kept++) % capacity] = report;
+			}
+		}
+		count = kept;
+	}
+};
+
+// Every receiver is serviced by one transport and one thread,
+// read waits on all open receivers at once
+class HIDTransport {
+public:
+	virtual ~HIDTransport() {}
+	// opens every plugged in receiver that isn't open yet and appends their ids to opened,
+	// returns false if a receiver was found but couldn't be opened
+	virtual bool open_receivers(HIDDevicePath const& primary, HIDDevicePath const& responder, std::vector<unsigned int>& opened) = 0;
+	virtual void close_receiver(unsigned int receiver) = 0;
+	virtual void close_all() = 0;
+	// waits for the next report from any open receiver,
+	// a negative timeout waits until a report arrives, wake is called or a hid interface is added or removed
+	virtual HIDReadResult read(HIDReport& report, int timeout_ms) = 0;
+	// short reports are written to the receiver collection, long reports to the responder
+	virtual bool write(unsigned int receiver, const unsigned char* data, unsigned int size) = 0;
+	// interrupts read from another thread
+	virtual void wake() = 0;
+};
+
+// Creates the transport for the current platform
+HIDTransport* create_hid_transport(Logger& debug_log);
@@ -0,0 +1,257 @@
+#include "hid_transport_linux.hpp"
+#include <filesystem>
+#include <cstdio>
+#include <fstream>
+#include <cstdlib>
+#include <cstring>
+#include <cerrno>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <linux/netlink.h>
+
+HIDTransport* create_hid_transport(Logger& debug_log) {
+	return new LinuxHIDTransport(debug_log);
+}
+
+LinuxHIDTransport::LinuxHIDTransport(Logger& debug_log) : debug_log(debug_log) {
+	wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	epoll_event event{};
+	event.events = EPOLLIN;
+	event.data.u32 = wake_tag;
+	if (wake_fd < 0 || epoll_fd < 0 || epoll_ctl(epoll_fd, EPOLL_CTL_ADD, wake_fd, &event) != 0) {
+		debug_log.log(LOG_EPOLL_FAILED, errno);
+	}
+	// subscribe to kernel uevents before enumerating so no hotplug event is missed
+	uevent_fd = socket(AF_NETLINK, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, NETLINK_KOBJECT_UEVENT);
+	sockaddr_nl address{};
+	address.nl_family = AF_NETLINK;
+	address.nl_groups = 1;
+	event.data.u32 = uevent_tag;
+	if (uevent_fd < 0 || bind(uevent_fd, (sockaddr*)&address, sizeof(address)) != 0 || epoll_ctl(epoll_fd, EPOLL_CTL_ADD, uevent_fd, &event) != 0) {
+		debug_log.log(LOG_HOTPLUG_SUBSCRIBE_FAILED, errno);
+	}
+	enumerate_hidraw_nodes();
+}
+
+LinuxHIDTransport::~LinuxHIDTransport() {
+	close_all();
+	::close(epoll_fd);
+	::close(uevent_fd);
+	::close(wake_fd);
+}
+
+bool LinuxHIDTransport::read_hidraw_ids(std::string const& hidraw_name, HIDDevicePath& ids) {
+	std::filesystem::path sys_path = std::filesystem::path("/sys/class/hidraw") / hidraw_name / "device";
+	// HID_ID is bus:vendor:product
+	std::ifstream uevent(sys_path / "uevent");
+	std::string line;
+	unsigned int bus = 0, vid = 0, pid = 0;
+	while (std::getline(uevent, line)) {
+		if (line.rfind("HID_ID=", 0) == 0) {
+			std::sscanf(line.c_str(), "HID_ID=%x:%x:%x", &bus, &vid, &pid);
+			break;
+		}
+	}
+	// the parent of the hid device is the usb interface, named like 1-2:1.2
+	std::error_code error;
+	std::filesystem::path hid_device = std::filesystem::canonical(sys_path, error);
+	std::string usb_interface = hid_device.parent_path().filename().string();
+	size_t dot = usb_interface.rfind('.');
+	if (vid == 0 || dot == std::string::npos) {
+		return false;
+	}
+	ids.vid = vid;
+	ids.pid = pid;
+	ids.mi = std::strtoul(usb_interface.c_str() + dot + 1, NULL, 10);
+	// hidraw doesn't split collections
+	ids.col = 0;
+	return true;
+}
+
+void LinuxHIDTransport::enumerate_hidraw_nodes() {
+	std::error_code error;
+	for (const auto& entry : std::filesystem::directory_iterator("/sys/class/hidraw", error)) {
+		HIDDevicePath ids;
+		std::string hidraw_name = entry.path().filename().string();
+		if (read_hidraw_ids(hidraw_name, ids)) {
+			device_index.add(ids, "/dev/" + hidraw_name);
+		}
+	}
+}
+
+bool LinuxHIDTransport::process_uevents() {
+	bool changed = false;
+	// each datagram is "action@devpath" followed by null separated KEY=value pairs
+	char buffer[8192];
+	ssize_t size;
+	while ((size = recv(uevent_fd, buffer, sizeof(buffer) - 1, 0)) > 0) {
+		buffer[size] = 0;
+		std::string action, subsystem, devname;
+		for (ssize_t i = 0; i < size; i += std::strlen(buffer + i) + 1) {
+			std::string field(buffer + i);
+			if (field.rfind("ACTION=", 0) == 0) {
+				action = field.substr(7);
+			}
+			else if (field.rfind("SUBSYSTEM=", 0) == 0) {
+				subsystem = field.substr(10);
+			}
+			else if (field.rfind("DEVNAME=", 0) == 0) {
+				devname = field.substr(8);
+			}
+		}
+		if (subsystem != "hidraw" || devname == "") {
+			continue;
+		}
+		// DEVNAME is relative to /dev
+		if (action == "add") {
+			HIDDevicePath ids;
+			if (read_hidraw_ids(devname, ids)) {
+				device_index.add(ids, "/dev/" + devname);
+				changed = true;
+			}
+		}
+		else if (action == "remove") {
+			device_index.remove("/dev/" + devname);
+			changed = true;
+		}
+	}
+	return changed;
+}
+
+bool LinuxHIDTransport::open_receivers(HIDDevicePath const& primary, [[maybe_unused]] HIDDevicePath const& responder, std::vector<unsigned int>& opened) {
+	bool all_opened = true;
+	// both collections share one hidraw node
+	HIDDevicePath ids = primary;
+	ids.col = 0;
+	for (const auto& path : device_index.find_all(ids)) {
+		bool already_open = false;
+		unsigned int free_id = receivers.size();
+		for (unsigned int i = 0; i < receivers.size(); ++i) {
+			if (receivers[i].fd >= 0 && receivers[i].path == path) {
+				already_open = true;
+			}
+			if (receivers[i].fd < 0 && free_id == receivers.size()) {
+				free_id = i;
+			}
+		}
+		if (already_open) {
+			continue;
+		}
+		int fd = ::open(path.c_str(), O_RDWR | O_NONBLOCK | O_CLOEXEC);
+		if (fd < 0) {
+			debug_log.log(LOG_OPEN_FAILED, path, errno);
+			all_opened = false;
+			continue;
+		}
+		if (free_id == receivers.size()) {
+			receivers.emplace_back();
+		}
+		receivers[free_id].path = path;
+		receivers[free_id].fd = fd;
+		epoll_event event{};
+		event.events = EPOLLIN;
+		event.data.u32 = free_id;
+		epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &event);
+		opened.push_back(free_id);
+	}
+	return all_opened;
+}
+
+void LinuxHIDTransport::close_receiver(unsigned int receiver) {
+	if (receiver < receivers.size() && receivers[receiver].fd >= 0) {
+		epoll_ctl(epoll_fd, EPOLL_CTL_DEL, receivers[receiver].fd, NULL);
+		::close(receivers[receiver].fd);
+		receivers[receiver].fd = -1;
+		receivers[receiver].path = "";
+		batch.drop_receiver(receiver);
+	}
+}
+
+void LinuxHIDTransport::close_all() {
+	for (unsigned int i = 0; i < receivers.size(); ++i) {
+		close_receiver(i);
+	}
+}
+
+bool LinuxHIDTransport::drain_wake() {
+	uint64_t count;
+	return ::read(wake_fd, &count, sizeof(count)) == sizeof(count);
+}
+
+bool LinuxHIDTransport::drain_receiver(unsigned int receiver) {
+	while (!batch.full()) {
+		HIDReport& report = batch.next_slot();
+		ssize_t bytes_read = ::read(receivers[receiver].fd, report.data, max_report_size);
+		if (bytes_read > 0) {
+			report.receiver = receiver;
+			report.size = bytes_read;
+			report.channel = report.data[0] == 0x10 ? RECEIVER_CHANNEL : RESPONDER_CHANNEL;
+			batch.push();
+			continue;
+		}
+		if (bytes_read < 0 && (errno == EAGAIN || errno == EINTR)) {
+			return true;
+		}
+		// ENODEV when the receiver is unplugged
+		if (bytes_read < 0 && errno != ENODEV) {
+			debug_log.log(LOG_READ_FAILED, errno);
+		}
+		return false;
+	}
+	return true;
+}
+
+HIDReadResult LinuxHIDTransport::read(HIDReport& report, int timeout_ms) {
+	while (true) {
+		// what the last wait collected is handed out before waiting again
+		if (batch.pop(report)) {
+			return HID_REPORT;
+		}
+		if (pending_wake) {
+			pending_wake = false;
+			return HID_WOKEN;
+		}
+		if (pending_hotplug) {
+			pending_hotplug = false;
+			return HID_HOTPLUG;
+		}
+		// level triggered, so receivers that don't fit in the batch are returned by the next call
+		epoll_event events[8];
+		int count = epoll_wait(epoll_fd, events, 8, timeout_ms);
+		if (count == 0) {
+			return HID_TIMEOUT;
+		}
+		for (int i = 0; i < count; ++i) {
+			unsigned int tag = events[i].data.u32;
+			if (tag == wake_tag) {
+				pending_wake |= drain_wake();
+				continue;
+			}
+			if (tag == uevent_tag) {
+				pending_hotplug |= process_uevents();
+				continue;
+			}
+			// a failed receiver is reported once its reports are handed out, it stays ready until it is closed
+			if (!batch.empty() && (events[i].events & (EPOLLHUP | EPOLLERR))) {
+				continue;
+			}
+			if ((events[i].events & (EPOLLHUP | EPOLLERR)) || (!drain_receiver(tag) && batch.empty())) {
+				report.receiver = tag;
+				return HID_DEVICE_LOST;
+			}
+		}
+	}
+}
+
+bool LinuxHIDTransport::write(unsigned int receiver, const unsigned char* data, unsigned int size) {
+	return receiver < receivers.size() && ::write(receivers[receiver].fd, data, size) == (ssize_t)size;
+}
+
+void LinuxHIDTransport::wake() {
+	uint64_t count = 1;
+	::write(wake_fd, &count, sizeof(count));
+}
@@ -0,0 +1,48 @@
+#pragma once
+#include <string>
+#include <vector>
+#include "hid_transport.hpp"
+#include "hid_device_index.hpp"
+
+// hidraw backend, a single epoll set holds every open hidraw node,
+// a kernel uevent netlink socket for hotplug and an eventfd used by wake
+// every node that is ready is drained into a batch after one epoll_wait, before its buffer can overflow
+class LinuxHIDTransport : public HIDTransport {
+	struct Receiver {
+		std::string path = "";
+		int fd = -1;
+	};
+
+	// epoll tags for the fds that aren't receivers
+	static const unsigned int wake_tag = 0xffffffff;
+	static const unsigned int uevent_tag = 0xfffffffe;
+
+	Logger& debug_log;
+	HIDDeviceIndex device_index;
+	// indexed by receiver id
+	std::vector<Receiver> receivers;
+	int wake_fd = -1;
+	int uevent_fd = -1;
+	int epoll_fd = -1;
+	bool pending_hotplug = false;
+	bool pending_wake = false;
+	HIDReportBatch batch;
+
+	bool read_hidraw_ids(std::string const& hidraw_name, HIDDevicePath& ids);
+	void enumerate_hidraw_nodes();
+	// returns true if a hidraw node was added or removed
+	bool process_uevents();
+	bool drain_wake();
+	// reads until the node would block or the batch is full, returns false if the receiver failed
+	bool drain_receiver(unsigned int receiver);
+
+public:
+	LinuxHIDTransport(Logger& debug_log);
+	~LinuxHIDTransport();
+	bool open_receivers(HIDDevicePath const& primary, HIDDevicePath const& responder, std::vector<unsigned int>& opened) override;
+	void close_receiver(unsigned int receiver) override;
+	void close_all() override;
+	HIDReadResult read(HIDReport& report, int timeout_ms) override;
+	bool write(unsigned int receiver, const unsigned char* data, unsigned int size) override;
+	void wake() override;
+};
@@ -0,0 +1,445 @@
+#include "hid_transport_sim.hpp"
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include "hidpp.hpp"
+
+SimulatedHIDTransport::SimulatedHIDTransport(SimulationOptions const& options, Logger& debug_log) : options(options), debug_log(debug_log), random(options.seed) {
+	if (options.replay_path != "") {
+		if (!read_capture(options.replay_path, capture)) {
+			debug_log.log(LOG_OPEN_FAILED, options.replay_path, errno);
+		}
+		for (const CaptureRecord& record : capture) {
+			if (record.report.receiver >= open.size()) {
+				open.resize(record.report.receiver + 1);
+				buffered.resize(record.report.receiver + 1);
+			}
+		}
+		input.resize(open.size() * input_buffer_size);
+		return;
+	}
+	open.resize(options.receivers);
+	buffered.resize(options.receivers);
+	input.resize(options.receivers * input_buffer_size);
+	for (unsigned int receiver = 0; receiver < options.receivers; ++receiver) {
+		for (unsigned char slot = 1; slot <= DeviceRegistry::max_slot; ++slot) {
+			// some are already connected when the driver starts, only the startup ping finds those
+			DeviceStatus status = std::bernoulli_distribution(0.5)(random) ? CONNECTED : DISCONNECTED;
+			devices.push_back(VirtualDevice{ receiver, slot, (unsigned short)(0x4000 + slot), status, {} });
+		}
+	}
+}
+
+void SimulatedHIDTransport::push_report(std::chrono::steady_clock::time_point due, HIDReport const& report) {
+	Pending event{ due, next_order++, PENDING_REPORT, 0, report };
+	pending.push(event);
+	++pending_reports;
+}
+
+void SimulatedHIDTransport::schedule_device(unsigned int device, std::chrono::steady_clock::time_point after) {
+	if (options.events_per_second <= 0) {
+		return;
+	}
+	std::exponential_distribution<double> interval(options.events_per_second);
+	auto delay = std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<double>(interval(random)));
+	Pending event{ after + event_gap + delay, next_order++, PENDING_DEVICE_EVENT, device, {} };
+	pending.push(event);
+}
+
+void SimulatedHIDTransport::schedule_malformed(unsigned int receiver, std::chrono::steady_clock::time_point after) {
+	std::exponential_distribution<double> interval(options.malformed_per_second);
+	auto delay = std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<double>(interval(random)));
+	Pending event{ after + delay, next_order++, PENDING_MALFORMED, receiver, {} };
+	pending.push(event);
+}
+
+HIDReport SimulatedHIDTransport::malformed_report(unsigned int receiver) {
+	HIDReport report;
+	report.receiver = receiver;
+	report.channel = std::bernoulli_distribution(0.5)(random) ? RECEIVER_CHANNEL : RESPONDER_CHANNEL;
+	std::uniform_int_distribution<int> byte(0, 0xff);
+	for (unsigned char& value : report.data) {
+		value = (unsigned char)byte(random);
+	}
+	const unsigned char report_ids[] = { HIDPP_SHORT, HIDPP_LONG, 0x20, report.data[0] };
+	report.data[0] = report_ids[std::uniform_int_distribution<int>(0, 3)(random)];
+	// 0 or anything past the last slot, short of the receiver itself
+	int device_index = std::uniform_int_distribution<int>(0, 0xfe - DeviceRegistry::max_slot)(random);
+	report.data[1] = (unsigned char)(device_index == 0 ? 0 : device_index + DeviceRegistry::max_slot);
+	const unsigned char sub_ids[] = { HIDPP_DEVICE_CONNECTION, HIDPP_ERROR_MESSAGE, hidpp20_error_feature_index, HIDPP_GET_LONG_REGISTER, report.data[2] };
+	report.data[2] = sub_ids[std::uniform_int_distribution<int>(0, 4)(random)];
+	if (report.data[2] == HIDPP_GET_LONG_REGISTER) {
+		// a name reply with whatever length, often more than the report holds
+		report.data[3] = HIDPP_REGISTER_PAIRING_INFORMATION;
+		report.data[4] = HIDPP_PAIRING_DEVICE_NAME | (report.data[4] & 0x0f);
+	}
+	unsigned int full_size = hidpp_report_size(report.data[0]) != 0 ? hidpp_report_size(report.data[0]) : max_report_size;
+	// a quarter is cut short
+	report.size = std::bernoulli_distribution(0.25)(random) ? std::uniform_int_distribution<unsigned int>(0, full_size - 1)(random) : full_size;
+	return report;
+}
+
+HIDReport SimulatedHIDTransport::connection_report(VirtualDevice const& device, bool link_established) {
+	HIDReport report;
+	report.receiver = device.receiver;
+	report.channel = RECEIVER_CHANNEL;
+	report.size = HIDPPShortReport::size;
+	const unsigned char bytes[] = { HIDPP_SHORT, device.slot, HIDPP_DEVICE_CONNECTION, 0x04,
+		(unsigned char)(0x01 | (link_established ? 0 : HIDPP_LINK_NOT_ESTABLISHED)),
+		(unsigned char)(device.wireless_pid & 0xff), (unsigned char)(device.wireless_pid >> 8) };
+	std::memcpy(report.data, bytes, sizeof(bytes));
+	return report;
+}
+
+void SimulatedHIDTransport::run_device_event(unsigned int index, std::chrono::steady_clock::time_point now) {
+	if (devices[index].status != CONNECTED) {
+		change_device(index, CONNECTED, now);
+	}
+	else {
+		change_device(index, std::bernoulli_distribution(0.5)(random) ? DISCONNECTED : POWERSAVE, now);
+	}
+	schedule_device(index, now);
+}
+
+void SimulatedHIDTransport::change_device(unsigned int index, DeviceStatus status, std::chrono::steady_clock::time_point now) {
+	VirtualDevice& device = devices[index];
+	if (status == CONNECTED) {
+		push_report(now, connection_report(device, true));
+		++counters.connects;
+	}
+	else if (status == DISCONNECTED) {
+		push_report(now, connection_report(device, false));
+		++counters.disconnects;
+	}
+	else {
+		// a device going into powersave connects, then disconnects shortly after
+		push_report(now, connection_report(device, true));
+		push_report(now + powersave_delay, connection_report(device, false));
+		++counters.powersaves;
+	}
+	device.status = status;
+	device.settled = now + event_gap;
+}
+
+void SimulatedHIDTransport::reply(unsigned int receiver, const unsigned char* request) {
+	HIDReport report;
+	report.receiver = receiver;
+	unsigned char* data = report.data;
+	unsigned char sub_id = request[2];
+	unsigned char address = request[3];
+	unsigned char page = request[4];
+	unsigned char slot = (page & 0x0f) + 1;
+	bool handled = false;
+	if (request[1] == hidpp_receiver_index && sub_id == HIDPP_SET_REGISTER && address == HIDPP_REGISTER_NOTIFICATIONS) {
+		report.channel = RECEIVER_CHANNEL;
+		report.size = HIDPPShortReport::size;
+		std::memcpy(data, request, 4);
+		handled = true;
+	}
+	else if (request[1] == hidpp_receiver_index && sub_id == HIDPP_GET_LONG_REGISTER && address == HIDPP_REGISTER_PAIRING_INFORMATION) {
+		report.channel = RESPONDER_CHANNEL;
+		report.size = HIDPPLongReport::size;
+		std::memcpy(data, request, 5);
+		data[0] = HIDPP_LONG;
+		if (page == HIDPP_PAIRING_RECEIVER_INFO) {
+			unsigned int serial = first_serial + receiver;
+			data[5] = (unsigned char)(serial >> 24);
+			data[6] = (unsigned char)(serial >> 16);
+			data[7] = (unsigned char)(serial >> 8);
+			data[8] = (unsigned char)serial;
+			handled = true;
+		}
+		else if ((page & 0xf0) == HIDPP_PAIRING_DEVICE_INFO && slot <= DeviceRegistry::max_slot) {
+			unsigned short wireless_pid = (unsigned short)(0x4000 + slot);
+			data[7] = (unsigned char)(wireless_pid >> 8);
+			data[8] = (unsigned char)wireless_pid;
+			data[11] = 0x01;
+			handled = true;
+		}
+		else if ((page & 0xf0) == HIDPP_PAIRING_DEVICE_NAME && slot <= DeviceRegistry::max_slot) {
+			char name[15];
+			int length = std::snprintf(name, sizeof(name), "Virtual %u", (unsigned int)slot);
+			data[5] = (unsigned char)length;
+			std::memcpy(data + 6, name, length);
+			handled = true;
+		}
+	}
+	else if (request[1] >= 1 && request[1] <= DeviceRegistry::max_slot && sub_id < HIDPP_DEVICE_DISCONNECTION && !devices.empty()) {
+		handled = reply_feature(receiver, request, report);
+	}
+	if (!handled) {
+		// answered like a receiver that doesn't know the request
+		report.channel = RECEIVER_CHANNEL;
+		report.size = HIDPPShortReport::size;
+		std::memset(data, 0, sizeof(report.data));
+		const unsigned char error[] = { HIDPP_SHORT, request[1], HIDPP_ERROR_MESSAGE, sub_id, address, 0x02, 0x00 };
+		std::memcpy(data, error, sizeof(error));
+	}
+	push_report(std::chrono::steady_clock::now() + reply_latency, report);
+}
+
+bool SimulatedHIDTransport::reply_feature(unsigned int receiver, const unsigned char* request, HIDReport& report) {
+	const VirtualDevice& device = devices[receiver * DeviceRegistry::max_slot + request[1] - 1];
+	unsigned char* data = report.data;
+	std::memset(data, 0, sizeof(report.data));
+	if (device.status != CONNECTED) {
+		// the receiver answers for a device that is asleep
+		report.channel = RECEIVER_CHANNEL;
+		report.size = HIDPPShortReport::size;
+		const unsigned char error[] = { HIDPP_SHORT, request[1], HIDPP_ERROR_MESSAGE, request[2], request[3], hidpp_error_unreachable, 0x00 };
+		std::memcpy(data, error, sizeof(error));
+		return true;
+	}
+	unsigned short feature = battery_feature(device.slot);
+	unsigned char feature_index = battery_feature_index(device.slot);
+	unsigned char function = request[3] >> 4;
+	report.channel = RESPONDER_CHANNEL;
+	report.size = HIDPPLongReport::size;
+	std::memcpy(data, request, 4);
+	data[0] = HIDPP_LONG;
+	if (request[2] == hidpp20_root_index && function == HIDPP_ROOT_PING) {
+		// HID++ 4.2, the ping data is echoed
+		data[4] = 0x04;
+		data[5] = 0x02;
+		data[6] = request[6];
+		return true;
+	}
+	if (request[2] == hidpp20_root_index && function == HIDPP_ROOT_GET_FEATURE) {
+		unsigned short requested = (request[4] << 8) | request[5];
+		data[4] = feature != 0 && requested == feature ? feature_index : 0;
+		return true;
+	}
+	if (feature != 0 && request[2] == feature_index) {
+		unsigned char level = battery_level(device.slot);
+		if (feature == HIDPP_FEATURE_UNIFIED_BATTERY && function == hidpp20_unified_battery_function) {
+			data[4] = level;
+			// good, discharging
+			data[5] = 0x04;
+			return true;
+		}
+		if (feature == HIDPP_FEATURE_BATTERY_STATUS && function == hidpp20_battery_status_function) {
+			data[4] = level;
+			return true;
+		}
+	}
+	return false;
+}
+
+bool SimulatedHIDTransport::open_receivers([[maybe_unused]] HIDDevicePath const& primary, [[maybe_unused]] HIDDevicePath const& responder, std::vector<unsigned int>& opened) {
+	for (unsigned int receiver = 0; receiver < open.size(); ++receiver) {
+		if (!open[receiver]) {
+			open[receiver] = true;
+			opened.push_back(receiver);
+		}
+	}
+	if (started) {
+		return true;
+	}
+	started = true;
+	// the simulated time starts once the driver is listening
+	std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+	for (const CaptureRecord& record : capture) {
+		if (record.written) {
+			continue;
+		}
+		auto offset = std::chrono::microseconds(options.replay_speed > 0 ? (long long)(record.time_us / options.replay_speed) : 0);
+		push_report(now + offset, record.report);
+	}
+	for (unsigned int device = 0; device < devices.size(); ++device) {
+		schedule_device(device, now);
+	}
+	if (options.malformed_per_second > 0) {
+		// after startup, so nothing is mistaken for a reply the driver waits on
+		for (unsigned int receiver = 0; receiver < options.receivers; ++receiver) {
+			schedule_malformed(receiver, now + event_gap);
+		}
+	}
+	return true;
+}
+
+void SimulatedHIDTransport::close_receiver(unsigned int receiver) {
+	if (receiver < open.size()) {
+		open[receiver] = false;
+		buffered[receiver] = 0;
+		// keep the other receivers' reports in order
+		unsigned int kept = 0;
+		for (unsigned int i = 0; i < input_count; ++i) {
+			HIDReport const& report = input[(input_head + i) % input.size()];
+			if (report.receiver != receiver) {
+				input[(input_head + kept++) % input.size()] = report;
+			}
+		}
+		input_count = kept;
+	}
+}
+
+void SimulatedHIDTransport::close_all() {
+	for (unsigned int receiver = 0; receiver < open.size(); ++receiver) {
+		open[receiver] = false;
+		buffered[receiver] = 0;
+	}
+	input_head = 0;
+	input_count = 0;
+}
+
+HIDReadResult SimulatedHIDTransport::read(HIDReport& report, int timeout_ms) {
+	std::chrono::steady_clock::time_point deadline = timeout_ms < 0 ? std::chrono::steady_clock::time_point::max() : std::chrono::steady_clock::now() + std::chrono::milliseconds(timeout_ms);
+	while (true) {
+		std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+		{
+			std::lock_guard<std::mutex> lock(wake_mutex);
+			injecting.swap(injected);
+		}
+		for (Injected const& injection : injecting) {
+			if (injection.is_report) {
+				push_report(now, injection.report);
+			}
+			else if (injection.device < devices.size()) {
+				change_device(injection.device, injection.status, now);
+			}
+		}
+		injecting.clear();
+		// everything that is due goes into the receivers' input buffers, as the kernel would queue it
+		while (!pending.empty() && pending.top().due <= now) {
+			Pending event = pending.top();
+			pending.pop();
+			if (event.kind == PENDING_DEVICE_EVENT) {
+				if (!quiescing) {
+					run_device_event(event.device, now);
+				}
+				continue;
+			}
+			if (event.kind == PENDING_MALFORMED) {
+				if (quiescing) {
+					continue;
+				}
+				push_report(now, malformed_report(event.device));
+				++counters.malformed;
+				schedule_malformed(event.device, now);
+				continue;
+			}
+			--pending_reports;
+			unsigned int receiver = event.report.receiver;
+			if (receiver >= open.size() || !open[receiver]) {
+				continue;
+			}
+			if (buffered[receiver] == input_buffer_size) {
+				++counters.dropped;
+				continue;
+			}
+			input[(input_head + input_count++) % input.size()] = event.report;
+			++buffered[receiver];
+		}
+		if (input_count > 0) {
+			report = input[input_head];
+			input_head = (input_head + 1) % input.size();
+			--input_count;
+			--buffered[report.receiver];
+			++counters.reports;
+			return HID_REPORT;
+		}
+		++counters.waits;
+		std::chrono::steady_clock::time_point next = pending.empty() ? deadline : std::min(deadline, pending.top().due);
+		std::unique_lock<std::mutex> lock(wake_mutex);
+		if (pending_reports == 0 && injected.empty()) {
+			++idle_waits;
+			idle_condition.notify_all();
+		}
+		if (next == std::chrono::steady_clock::time_point::max()) {
+			wake_condition.wait(lock, [this] { return woken || !injected.empty(); });
+		}
+		else {
+			wake_condition.wait_until(lock, next, [this] { return woken || !injected.empty(); });
+		}
+		if (woken) {
+			woken = false;
+			return HID_WOKEN;
+		}
+		if (std::chrono::steady_clock::now() >= deadline) {
+			return HID_TIMEOUT;
+		}
+	}
+}
+
+bool SimulatedHIDTransport::write(unsigned int receiver, const unsigned char* data, unsigned int size) {
+	if (receiver >= open.size() || !open[receiver] || size < HIDPPShortReport::size) {
+		return false;
+	}
+	// a replay already holds the replies
+	if (capture.empty()) {
+		reply(receiver, data);
+	}
+	return true;
+}
+
+std::chrono::steady_clock::time_point SimulatedHIDTransport::quiesce() {
+	quiescing = true;
+	// reports already due, like the disconnect ending a powersave, are still delivered
+	std::chrono::steady_clock::time_point settled = std::chrono::steady_clock::now();
+	for (const VirtualDevice& device : devices) {
+		settled = std::max(settled, device.settled);
+	}
+	return settled;
+}
+
+unsigned long long SimulatedHIDTransport::inject_report(HIDReport const& report) {
+	std::lock_guard<std::mutex> lock(wake_mutex);
+	injected.push_back(Injected{ true, 0, CONNECTED, report });
+	wake_condition.notify_one();
+	return idle_waits;
+}
+
+unsigned long long SimulatedHIDTransport::inject_status(unsigned int receiver, unsigned char slot, DeviceStatus status) {
+	std::lock_guard<std::mutex> lock(wake_mutex);
+	if (receiver < options.receivers && slot >= 1 && slot <= DeviceRegistry::max_slot) {
+		injected.push_back(Injected{ false, receiver * DeviceRegistry::max_slot + slot - 1, status, {} });
+		wake_condition.notify_one();
+	}
+	return idle_waits;
+}
+
+bool SimulatedHIDTransport::wait_idle(unsigned long long idle, std::chrono::milliseconds timeout) {
+	std::unique_lock<std::mutex> lock(wake_mutex);
+	return idle_condition.wait_for(lock, timeout, [this, idle] { return idle_waits > idle; });
+}
+
+void SimulatedHIDTransport::wake() {
+	{
+		std::lock_guard<std::mutex> lock(wake_mutex);
+		woken = true;
+	}
+	wake_condition.notify_one();
+}
+
+bool SimulatedHIDTransport::expected_status(unsigned int receiver_serial, unsigned char slot, DeviceStatus& status) {
+	if (devices.empty() || receiver_serial < first_serial || receiver_serial - first_serial >= open.size() || slot < 1 || slot > DeviceRegistry::max_slot) {
+		return false;
+	}
+	const VirtualDevice& device = devices[(receiver_serial - first_serial) * DeviceRegistry::max_slot + slot - 1];
+	if (std::chrono::steady_clock::now() < device.settled) {
+		return false;
+	}
+	status = device.status;
+	return true;
+}
+
+unsigned short SimulatedHIDTransport::battery_feature(unsigned char slot) {
+	// a mix of new devices, old devices and devices without a battery
+	switch (slot % 3) {
+		case 1:
+			return HIDPP_FEATURE_UNIFIED_BATTERY;
+		case 2:
+			return HIDPP_FEATURE_BATTERY_STATUS;
+		default:
+			return 0;
+	}
+}
+
+bool SimulatedHIDTransport::expected_battery(unsigned int receiver_serial, unsigned char slot, int& level) {
+	if (devices.empty() || receiver_serial < first_serial || receiver_serial - first_serial >= open.size() || battery_feature(slot) == 0) {
+		return false;
+	}
+	level = battery_level(slot);
+	return true;
+}
@@ -0,0 +1,166 @@
+#pragma once
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <queue>
+#include <random>
+#include <string>
+#include <vector>
+#include "hid_transport.hpp"
+#include "hid_capture.hpp"
+#include "device_registry.hpp"
+
+struct SimulationOptions {
+	// replays a capture instead of reading real receivers
+	std::string replay_path = "";
+	// 2 replays twice as fast, 0 as fast as possible
+	double replay_speed = 1;
+	// virtual receivers with 6 paired devices each, 0 to not generate any
+	unsigned int receivers = 0;
+	// average status changes per device per second, 0 leaves them to inject_status
+	double events_per_second = 1;
+	// average malformed reports per receiver per second, they must not change any device
+	double malformed_per_second = 0;
+	unsigned int seed = 1;
+
+	bool enabled() const { return replay_path != "" || receivers > 0; }
+};
+
+struct SimulationStats {
+	unsigned long long reports;
+	unsigned long long connects;
+	unsigned long long disconnects;
+	unsigned long long powersaves;
+	unsigned long long malformed;
+	// due while the receiver's input buffer was full, like reports the kernel drops when nobody reads
+	unsigned long long dropped;
+	// times read had to wait for a report, a burst that is read in one go only waits once
+	unsigned long long waits;
+};
+
+// Stands in for real receivers without any hardware, either by replaying a capture
+// or by answering HID++ requests like a receiver and generating connects, disconnects
+// and powersaves for every virtual device from a seeded random generator,
+// optionally mixed with truncated and garbage reports the driver has to ignore
+class SimulatedHIDTransport : public HIDTransport {
+	enum PendingKind {
+		PENDING_REPORT,
+		// a virtual device changes state
+		PENDING_DEVICE_EVENT,
+		// a malformed report is generated for a receiver
+		PENDING_MALFORMED
+	};
+
+	struct Pending {
+		std::chrono::steady_clock::time_point due;
+		// keeps reports that are due at the same time in order
+		unsigned long long order;
+		PendingKind kind;
+		// the virtual device or the receiver
+		unsigned int device;
+		HIDReport report;
+		bool operator>(const Pending& other) const {
+			return due != other.due ? due > other.due : order > other.order;
+		}
+	};
+
+	// handed over from another thread, read takes it in like a report that just became due
+	struct Injected {
+		bool is_report;
+		unsigned int device;
+		DeviceStatus status;
+		HIDReport report;
+	};
+
+	struct VirtualDevice {
+		unsigned int receiver;
+		unsigned char slot;
+		unsigned short wireless_pid;
+		DeviceStatus status;
+		// the driver has seen every report of the last event by then
+		std::chrono::steady_clock::time_point settled;
+	};
+
+	// a powersave disconnect follows its connect this much later
+	static constexpr std::chrono::milliseconds powersave_delay{ 400 };
+	// at least this long between two events of a device, longer than any powersave window
+	static constexpr std::chrono::milliseconds event_gap{ 1500 };
+	static constexpr std::chrono::milliseconds reply_latency{ 2 };
+	// reports a receiver holds that haven't been read, as many as a hidraw node buffers
+	static const unsigned int input_buffer_size = HIDReportBatch::capacity;
+	static const unsigned int first_serial = 0x51500000;
+
+	SimulationOptions options;
+	Logger& debug_log;
+	std::priority_queue<Pending, std::vector<Pending>, std::greater<Pending>> pending;
+	unsigned long long next_order = 0;
+	std::vector<CaptureRecord> capture;
+	std::vector<bool> open;
+	// reports that are due and not read yet, in order, and how many of them each receiver has
+	// a ring sized for every receiver's buffer being full, so reading doesn't allocate
+	std::vector<HIDReport> input;
+	unsigned int input_head = 0;
+	unsigned int input_count = 0;
+	std::vector<unsigned int> buffered;
+	std::vector<VirtualDevice> devices;
+	bool started = false;
+	// no new device events or malformed reports once the run is ending
+	bool quiescing = false;
+	std::mt19937 random;
+	SimulationStats counters{};
+
+	std::mutex wake_mutex;
+	std::condition_variable wake_condition;
+	bool woken = false;
+	// guarded by wake_mutex, read swaps it with injecting so taking it in doesn't allocate
+	std::vector<Injected> injected;
+	std::vector<Injected> injecting;
+	// reports in pending, read is idle once they and the input buffers are all handed out
+	unsigned int pending_reports = 0;
+	// guarded by wake_mutex, counts the times read waited while idle
+	unsigned long long idle_waits = 0;
+	std::condition_variable idle_condition;
+
+	void push_report(std::chrono::steady_clock::time_point due, HIDReport const& report);
+	void schedule_device(unsigned int device, std::chrono::steady_clock::time_point after);
+	void run_device_event(unsigned int device, std::chrono::steady_clock::time_point now);
+	// sends the reports of device going to status and schedules when it has settled
+	void change_device(unsigned int device, DeviceStatus status, std::chrono::steady_clock::time_point now);
+	void schedule_malformed(unsigned int receiver, std::chrono::steady_clock::time_point after);
+	// garbage addressed to a device index nothing is paired at, so no request or device can pick it up
+	HIDReport malformed_report(unsigned int receiver);
+	HIDReport connection_report(VirtualDevice const& device, bool link_established);
+	void reply(unsigned int receiver, const unsigned char* request);
+	// HID++ 2.0 requests to a virtual device, returns false if the device doesn't know the request
+	bool reply_feature(unsigned int receiver, const unsigned char* request, HIDReport& report);
+	static unsigned short battery_feature(unsigned char slot);
+	static unsigned char battery_feature_index(unsigned char slot) { return 3 + slot % 3; }
+	static unsigned char battery_level(unsigned char slot) { return (unsigned char)(100 - 10 * slot); }
+
+public:
+	SimulatedHIDTransport(SimulationOptions const& options, Logger& debug_log);
+	bool open_receivers(HIDDevicePath const& primary, HIDDevicePath const& responder, std::vector<unsigned int>& opened) override;
+	void close_receiver(unsigned int receiver) override;
+	void close_all() override;
+	HIDReadResult read(HIDReport& report, int timeout_ms) override;
+	bool write(unsigned int receiver, const unsigned char* data, unsigned int size) override;
+	void wake() override;
+
+	SimulationStats stats() const { return counters; }
+	// stops generating events, returns when every virtual device will have settled
+	// so a run can wait for that and check all of them
+	std::chrono::steady_clock::time_point quiesce();
+	unsigned int device_count() const { return (unsigned int)devices.size(); }
+	// the status a virtual device should have, false for replays and devices that haven't settled yet
+	bool expected_status(unsigned int receiver_serial, unsigned char slot, DeviceStatus& status);
+	// false for devices without a battery
+	bool expected_battery(unsigned int receiver_serial, unsigned char slot, int& level);
+
+	// safe to call from any thread, read takes them in next, both return what to pass to wait_idle
+	// a report as if a receiver sent it, whatever it holds
+	unsigned long long inject_report(HIDReport const& report);
+	// a virtual device connects, disconnects or goes into powersave now, ignored if there is no such device
+	unsigned long long inject_status(unsigned int receiver, unsigned char slot, DeviceStatus status);
+	// waits until the driver has read everything injected before idle, and every reply to it, false on timeout
+	bool wait_idle(unsigned long long idle, std::chrono::milliseconds timeout);
+};
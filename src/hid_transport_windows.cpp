@@ -0,0 +1,374 @@
+#include "hid_transport_windows.hpp"
+#include <cstdlib>
+#include <cctype>
+#include <hidsdi.h>
+#include <setupapi.h>
+#pragma comment(lib, "cfgmgr32.lib")
+
+// Input report length of each collection, ReadFile fails if the buffer is any smaller
+const unsigned int report_sizes[2] = { 7, 20 };
+
+HIDTransport* create_hid_transport(Logger& debug_log) {
+	return new WindowsHIDTransport(debug_log);
+}
+
+WindowsHIDTransport::WindowsHIDTransport(Logger& debug_log) : debug_log(debug_log) {
+	HidD_GetHidGuid(&hid_guid);
+	wake_event = CreateEventA(NULL, FALSE, FALSE, NULL);
+	hotplug_event = CreateEventA(NULL, FALSE, FALSE, NULL);
+	write_event = CreateEventA(NULL, TRUE, FALSE, NULL);
+	// register for notifications before enumerating so no arrival is missed
+	CM_NOTIFY_FILTER filter{};
+	filter.cbSize = sizeof(filter);
+	filter.FilterType = CM_NOTIFY_FILTER_TYPE_DEVICEINTERFACE;
+	filter.u.DeviceInterface.ClassGuid = hid_guid;
+	CONFIGRET rc = CM_Register_Notification(&filter, this, on_hotplug, &hotplug_notification);
+	if (rc != CR_SUCCESS) {
+		debug_log.log(LOG_HOTPLUG_SUBSCRIBE_FAILED, rc);
+	}
+	enumerate_hid_interfaces();
+}
+
+WindowsHIDTransport::~WindowsHIDTransport() {
+	// waits for any running callback to finish
+	if (hotplug_notification != NULL) {
+		CM_Unregister_Notification(hotplug_notification);
+	}
+	close_all();
+	for (auto& receiver : receivers) {
+		for (auto& channel_reads : receiver->reads) {
+			for (auto& read : channel_reads) {
+				CloseHandle(read.overlapped.hEvent);
+			}
+		}
+	}
+	CloseHandle(write_event);
+	CloseHandle(hotplug_event);
+	CloseHandle(wake_event);
+}
+
+bool WindowsHIDTransport::parse_hid_path(std::string& device_path, HIDDevicePath& ids) {
+	// paths look like \\?\hid#vid_046d&pid_c52b&mi_02&col01#...
+	// arrival notifications can be upper case, so normalize before parsing and comparing
+	for (auto& c : device_path) {
+		c = std::tolower((unsigned char)c);
+	}
+	size_t vid = device_path.find("vid_");
+	size_t pid = device_path.find("pid_");
+	if (vid == std::string::npos || pid == std::string::npos) {
+		return false;
+	}
+	size_t mi = device_path.find("&mi_");
+	size_t col = device_path.find("&col");
+	ids.vid = (unsigned short)std::strtoul(device_path.c_str() + vid + 4, NULL, 16);
+	ids.pid = (unsigned short)std::strtoul(device_path.c_str() + pid + 4, NULL, 16);
+	ids.mi = mi == std::string::npos ? 0 : (unsigned char)std::strtoul(device_path.c_str() + mi + 4, NULL, 16);
+	ids.col = col == std::string::npos ? 0 : (unsigned char)std::strtoul(device_path.c_str() + col + 4, NULL, 16);
+	return true;
+}
+
+std::string WindowsHIDTransport::parent_key(std::string const& device_path) {
+	// \\?\hid#vid_046d&pid_c52b&mi_02&col01#8&1f1a2b3c&0&0000#{guid}
+	// becomes \\?\hid#vid_046d&pid_c52b&mi_02#8&1f1a2b3c&0
+	size_t col = device_path.find("&col");
+	size_t instance = device_path.find('#', col);
+	size_t instance_end = device_path.find('#', instance + 1);
+	if (col == std::string::npos || instance == std::string::npos || instance_end == std::string::npos) {
+		return device_path;
+	}
+	size_t last_part = device_path.rfind('&', instance_end);
+	return device_path.substr(0, col) + device_path.substr(instance, last_part - instance);
+}
+
+void WindowsHIDTransport::enumerate_hid_interfaces() {
+	HDEVINFO info = SetupDiGetClassDevsW(&hid_guid, NULL, NULL, DIGCF_PRESENT | DIGCF_DEVICEINTERFACE);
+	SP_DEVICE_INTERFACE_DATA device_data;
+	device_data.cbSize = sizeof(SP_DEVICE_INTERFACE_DATA);
+	std::string device_path;
+	// SetupDiEnumDeviceInterfaces returns false when i is greater than the number of devices
+	for (int i = 0; SetupDiEnumDeviceInterfaces(info, NULL, &hid_guid, i, &device_data); ++i) {
+		// Get required size
+		DWORD required_size;
+		SetupDiGetDeviceInterfaceDetailA(info, &device_data, NULL, 0, &required_size, NULL);
+		// allocate enough space for the device path
+		PSP_DEVICE_INTERFACE_DETAIL_DATA_A device_detail_data = (PSP_DEVICE_INTERFACE_DETAIL_DATA_A)malloc(required_size);
+		// check for null malloc
+		if (device_detail_data == NULL) {
+			debug_log.log(LOG_OUT_OF_MEMORY);
+			exit(1);
+		}
+		else {
+			device_detail_data->cbSize = sizeof(SP_DEVICE_INTERFACE_DETAIL_DATA);
+			// get the device path
+			SetupDiGetDeviceInterfaceDetailA(info, &device_data, device_detail_data, required_size, NULL, NULL);
+			device_path = device_detail_data->DevicePath;
+			// free the device data so it can be alloced again if needed
+			free(device_detail_data);
+			HIDDevicePath ids;
+			if (parse_hid_path(device_path, ids)) {
+				device_index.add(ids, device_path);
+			}
+		}
+	}
+	SetupDiDestroyDeviceInfoList(info);
+}
+
+DWORD CALLBACK WindowsHIDTransport::on_hotplug(HCMNOTIFICATION notification, PVOID context, CM_NOTIFY_ACTION action, PCM_NOTIFY_EVENT_DATA event_data, DWORD event_data_size) {
+	// runs on a thread pool thread
+	WindowsHIDTransport* transport = (WindowsHIDTransport*)context;
+	if (action != CM_NOTIFY_ACTION_DEVICEINTERFACEARRIVAL && action != CM_NOTIFY_ACTION_DEVICEINTERFACEREMOVAL) {
+		return ERROR_SUCCESS;
+	}
+	// interface paths are plain ascii
+	std::string device_path;
+	for (const WCHAR* c = event_data->u.DeviceInterface.SymbolicLink; *c != 0; ++c) {
+		device_path += (char)*c;
+	}
+	HIDDevicePath ids;
+	if (!parse_hid_path(device_path, ids)) {
+		return ERROR_SUCCESS;
+	}
+	if (action == CM_NOTIFY_ACTION_DEVICEINTERFACEARRIVAL) {
+		transport->device_index.add(ids, device_path);
+	}
+	else {
+		transport->device_index.remove(device_path);
+	}
+	SetEvent(transport->hotplug_event);
+	return ERROR_SUCCESS;
+}
+
+bool WindowsHIDTransport::open_receivers(HIDDevicePath const& primary, HIDDevicePath const& responder, std::vector<unsigned int>& opened) {
+	bool all_opened = true;
+	std::vector<std::string> responder_paths = device_index.find_all(responder);
+	for (const auto& primary_path : device_index.find_all(primary)) {
+		bool already_open = false;
+		unsigned int free_id = receivers.size();
+		for (unsigned int i = 0; i < receivers.size(); ++i) {
+			if (receivers[i]->open && receivers[i]->primary_path == primary_path) {
+				already_open = true;
+			}
+			if (!receivers[i]->open && free_id == receivers.size()) {
+				free_id = i;
+			}
+		}
+		if (already_open) {
+			continue;
+		}
+		std::string responder_path = "";
+		for (const auto& path : responder_paths) {
+			if (parent_key(path) == parent_key(primary_path)) {
+				responder_path = path;
+			}
+		}
+		// col02 may not have arrived yet, the next hotplug event retries
+		if (responder_path == "") {
+			continue;
+		}
+		if (free_id == receivers.size()) {
+			receivers.push_back(std::make_unique<Receiver>());
+			for (int i = 0; i < 2; ++i) {
+				for (auto& read : receivers[free_id]->reads[i]) {
+					read.overlapped.hEvent = CreateEventA(NULL, TRUE, FALSE, NULL);
+					read.report.channel = (HIDChannel)i;
+					read.report.receiver = free_id;
+				}
+			}
+		}
+		Receiver& receiver = *receivers[free_id];
+		receiver.primary_path = primary_path;
+		receiver.responder_path = responder_path;
+		if (!open_receiver(receiver)) {
+			all_opened = false;
+			continue;
+		}
+		opened.push_back(free_id);
+	}
+	return all_opened;
+}
+
+bool WindowsHIDTransport::open_receiver(Receiver& receiver) {
+	const std::string* paths[2] = { &receiver.primary_path, &receiver.responder_path };
+	HANDLE handles[2];
+	for (int i = 0; i < 2; ++i) {
+		handles[i] = CreateFileA(paths[i]->c_str(), GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL, OPEN_EXISTING, FILE_FLAG_OVERLAPPED, NULL);
+		if (handles[i] == INVALID_HANDLE_VALUE) {
+			debug_log.log(LOG_OPEN_FAILED, *paths[i], GetLastError());
+			if (i == 1) {
+				CloseHandle(handles[0]);
+			}
+			return false;
+		}
+		// a burst while every read is still being handed out is kept by the driver instead of dropped
+		if (!HidD_SetNumInputBuffers(handles[i], input_buffers)) {
+			debug_log.log(LOG_INPUT_BUFFERS_FAILED, *paths[i], GetLastError());
+		}
+	}
+	for (int i = 0; i < 2; ++i) {
+		for (auto& read : receiver.reads[i]) {
+			read.handle = handles[i];
+		}
+		receiver.oldest[i] = 0;
+	}
+	receiver.open = true;
+	return true;
+}
+
+void WindowsHIDTransport::close_receiver(unsigned int receiver) {
+	if (receiver >= receivers.size() || !receivers[receiver]->open) {
+		return;
+	}
+	for (auto& channel_reads : receivers[receiver]->reads) {
+		for (auto& read : channel_reads) {
+			if (read.pending) {
+				DWORD bytes_read;
+				CancelIoEx(read.handle, &read.overlapped);
+				GetOverlappedResult(read.handle, &read.overlapped, &bytes_read, TRUE);
+				read.pending = false;
+			}
+		}
+		// every read of a collection shares its handle
+		CloseHandle(channel_reads[0].handle);
+		for (auto& read : channel_reads) {
+			read.handle = INVALID_HANDLE_VALUE;
+		}
+	}
+	receivers[receiver]->open = false;
+	batch.drop_receiver(receiver);
+	if (lost_receiver == (int)receiver) {
+		lost_receiver = -1;
+	}
+}
+
+void WindowsHIDTransport::close_all() {
+	for (unsigned int i = 0; i < receivers.size(); ++i) {
+		close_receiver(i);
+	}
+}
+
+bool WindowsHIDTransport::start_read(PendingRead& read) {
+	if (read.pending) {
+		return true;
+	}
+	ResetEvent(read.overlapped.hEvent);
+	// the event is signaled even if ReadFile completes immediately,
+	// so both cases are collected by GetOverlappedResult
+	if (!ReadFile(read.handle, read.report.data, report_sizes[read.report.channel], NULL, &read.overlapped) && GetLastError() != ERROR_IO_PENDING) {
+		return false;
+	}
+	read.pending = true;
+	return true;
+}
+
+bool WindowsHIDTransport::collect_reads(Receiver& receiver, HIDChannel channel) {
+	while (!batch.full()) {
+		PendingRead& read = receiver.reads[channel][receiver.oldest[channel]];
+		if (!read.pending || !HasOverlappedIoCompleted(&read.overlapped)) {
+			return true;
+		}
+		read.pending = false;
+		DWORD bytes_read;
+		if (!GetOverlappedResult(read.handle, &read.overlapped, &bytes_read, FALSE)) {
+			DWORD error = GetLastError();
+			// not connected and aborted are handled error cases
+			if (!(error == ERROR_DEVICE_NOT_CONNECTED || error == ERROR_OPERATION_ABORTED)) {
+				debug_log.log(LOG_READ_FAILED, error);
+			}
+			return false;
+		}
+		HIDReport& report = batch.next_slot();
+		report = read.report;
+		report.size = bytes_read;
+		batch.push();
+		// queued again behind the reads that are still waiting
+		receiver.oldest[channel] = (receiver.oldest[channel] + 1) % reads_per_channel;
+		if (!start_read(read)) {
+			return false;
+		}
+	}
+	return true;
+}
+
+HIDReadResult WindowsHIDTransport::read(HIDReport& report, int timeout_ms) {
+	// what the last wait collected is handed out before waiting again
+	if (batch.pop(report)) {
+		return HID_REPORT;
+	}
+	if (lost_receiver >= 0) {
+		report.receiver = lost_receiver;
+		lost_receiver = -1;
+		return HID_DEVICE_LOST;
+	}
+	// wake and hotplug come first, followed by the oldest read of both collections of every open receiver
+	HANDLE events[MAXIMUM_WAIT_OBJECTS] = { wake_event, hotplug_event };
+	DWORD event_count = 2;
+	for (unsigned int i = 0; i < receivers.size() && event_count + 2 <= MAXIMUM_WAIT_OBJECTS; ++i) {
+		Receiver& receiver = *receivers[i];
+		if (!receiver.open) {
+			continue;
+		}
+		for (int channel = 0; channel < 2; ++channel) {
+			// issued oldest first, so they complete in the order of the ring
+			for (unsigned int n = 0; n < reads_per_channel; ++n) {
+				if (!start_read(receiver.reads[channel][(receiver.oldest[channel] + n) % reads_per_channel])) {
+					report.receiver = i;
+					return HID_DEVICE_LOST;
+				}
+			}
+			events[event_count++] = receiver.reads[channel][receiver.oldest[channel]].overlapped.hEvent;
+		}
+	}
+	DWORD result = WaitForMultipleObjects(event_count, events, FALSE, timeout_ms < 0 ? INFINITE : timeout_ms);
+	if (result == WAIT_TIMEOUT) {
+		return HID_TIMEOUT;
+	}
+	if (result == WAIT_OBJECT_0) {
+		return HID_WOKEN;
+	}
+	if (result == WAIT_OBJECT_0 + 1) {
+		return HID_HOTPLUG;
+	}
+	if (result < WAIT_OBJECT_0 + 2 || result >= WAIT_OBJECT_0 + event_count) {
+		debug_log.log(LOG_WAIT_FAILED, GetLastError());
+		return HID_TIMEOUT;
+	}
+	// every read that has completed by now is collected, not just the one that woke the wait
+	for (unsigned int i = 0; i < receivers.size(); ++i) {
+		if (!receivers[i]->open) {
+			continue;
+		}
+		for (int channel = 0; channel < 2; ++channel) {
+			if (!collect_reads(*receivers[i], (HIDChannel)channel) && lost_receiver < 0) {
+				lost_receiver = i;
+			}
+		}
+	}
+	if (batch.pop(report)) {
+		return HID_REPORT;
+	}
+	if (lost_receiver >= 0) {
+		report.receiver = lost_receiver;
+		lost_receiver = -1;
+		return HID_DEVICE_LOST;
+	}
+	return HID_TIMEOUT;
+}
+
+bool WindowsHIDTransport::write(unsigned int receiver, const unsigned char* data, unsigned int size) {
+	if (receiver >= receivers.size() || !receivers[receiver]->open) {
+		return false;
+	}
+	HANDLE handle = receivers[receiver]->reads[data[0] == 0x10 ? RECEIVER_CHANNEL : RESPONDER_CHANNEL][0].handle;
+	OVERLAPPED overlapped{};
+	overlapped.hEvent = write_event;
+	ResetEvent(write_event);
+	DWORD bytes_written;
+	if (!WriteFile(handle, data, size, NULL, &overlapped) && GetLastError() != ERROR_IO_PENDING) {
+		return false;
+	}
+	return GetOverlappedResult(handle, &overlapped, &bytes_written, TRUE) && bytes_written == size;
+}
+
+void WindowsHIDTransport::wake() {
+	SetEvent(wake_event);
+}
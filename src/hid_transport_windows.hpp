@@ -0,0 +1,70 @@
+#pragma once
+#include <memory>
+#include <string>
+#include <vector>
+#include <windows.h>
+#include <cfgmgr32.h>
+#include "hid_transport.hpp"
+#include "hid_device_index.hpp"
+
+// Overlapped ReadFile on both collections, WaitForMultipleObjects also waits on an event used by wake
+// HID interface arrival and removal notifications keep device_index up to date
+// several reads stay queued on every collection, so reports aren't left to the driver's input buffers
+// while the driver thread is busy, a wakeup collects every read that has completed by then
+class WindowsHIDTransport : public HIDTransport {
+	struct PendingRead {
+		HANDLE handle = INVALID_HANDLE_VALUE;
+		OVERLAPPED overlapped{};
+		HIDReport report;
+		bool pending = false;
+	};
+
+	// reads on one handle complete in the order they were issued
+	static const unsigned int reads_per_channel = 4;
+	// reports the HID class driver keeps for a handle that has no read waiting, 32 by default
+	static const ULONG input_buffers = 128;
+
+	struct Receiver {
+		std::string primary_path = "";
+		std::string responder_path = "";
+		// indexed by HIDChannel, then in a ring starting at the oldest read
+		PendingRead reads[2][reads_per_channel];
+		unsigned int oldest[2] = {};
+		bool open = false;
+	};
+
+	Logger& debug_log;
+	GUID hid_guid;
+	HIDDeviceIndex device_index;
+	HCMNOTIFICATION hotplug_notification = NULL;
+	// indexed by receiver id, OVERLAPPED has to stay at the same address while a read is pending
+	std::vector<std::unique_ptr<Receiver>> receivers;
+	HANDLE wake_event;
+	HANDLE hotplug_event;
+	HANDLE write_event;
+	HIDReportBatch batch;
+	// failed while the batch still held reports, reported once they are handed out, -1 if none
+	int lost_receiver = -1;
+
+	static DWORD CALLBACK on_hotplug(HCMNOTIFICATION notification, PVOID context, CM_NOTIFY_ACTION action, PCM_NOTIFY_EVENT_DATA event_data, DWORD event_data_size);
+	// parses vid/pid/mi/col out of a device interface path
+	static bool parse_hid_path(std::string& device_path, HIDDevicePath& ids);
+	// both collections of one receiver share everything in their path except the col and the last instance id part
+	static std::string parent_key(std::string const& device_path);
+	void enumerate_hid_interfaces();
+	bool open_receiver(Receiver& receiver);
+	bool start_read(PendingRead& read);
+	// moves the completed reads of a collection into the batch in order and queues them again,
+	// returns false if a read failed
+	bool collect_reads(Receiver& receiver, HIDChannel channel);
+
+public:
+	WindowsHIDTransport(Logger& debug_log);
+	~WindowsHIDTransport();
+	bool open_receivers(HIDDevicePath const& primary, HIDDevicePath const& responder, std::vector<unsigned int>& opened) override;
+	void close_receiver(unsigned int receiver) override;
+	void close_all() override;
+	HIDReadResult read(HIDReport& report, int timeout_ms) override;
+	bool write(unsigned int receiver, const unsigned char* data, unsigned int size) override;
+	void wake() override;
+};
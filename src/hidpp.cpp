@@ -0,0 +1,132 @@
+#include "hidpp.hpp"
+
+static unsigned long long make_key(unsigned char device_index, unsigned char sub_id, unsigned char address, unsigned int param) {
+	return ((unsigned long long)device_index << 32) | ((unsigned long long)sub_id << 24) | ((unsigned long long)address << 16) | param;
+}
+
+HIDPPMessage hidpp_decode(const unsigned char* data, unsigned int size) {
+	HIDPPMessage message{};
+	message.kind = HIDPP_UNKNOWN;
+	if (size == 0 || hidpp_report_size(data[0]) == 0 || size < hidpp_report_size(data[0])) {
+		return message;
+	}
+	message.report_id = data[0];
+	message.device_index = data[1];
+	unsigned char sub_id = data[2];
+	switch (sub_id) {
+		case HIDPP_DEVICE_CONNECTION:
+			if (message.report_id != HIDPP_SHORT) {
+				break;
+			}
+			message.kind = HIDPP_CONNECTION;
+			message.connection.protocol = data[3];
+			message.connection.device_type = data[4] & HIDPP_DEVICE_TYPE_MASK;
+			message.connection.link_established = (data[4] & HIDPP_LINK_NOT_ESTABLISHED) == 0;
+			message.connection.encrypted = (data[4] & HIDPP_LINK_ENCRYPTED) != 0;
+			// wireless pid is little endian
+			message.connection.wireless_pid = data[5] | (data[6] << 8);
+			break;
+		case HIDPP_SET_REGISTER:
+		case HIDPP_GET_REGISTER:
+		case HIDPP_SET_LONG_REGISTER:
+		case HIDPP_GET_LONG_REGISTER:
+			message.kind = HIDPP_REGISTER_REPLY;
+			message.key = hidpp_request_key(data);
+			message.register_reply.sub_id = sub_id;
+			message.register_reply.address = data[3];
+			message.register_reply.value = data + 4;
+			message.register_reply.value_size = message.report_id == HIDPP_SHORT ? 3 : 16;
+			if (sub_id == HIDPP_GET_LONG_REGISTER && data[3] == HIDPP_REGISTER_PAIRING_INFORMATION && message.report_id != HIDPP_SHORT) {
+				if ((data[4] & 0xf0) == HIDPP_PAIRING_DEVICE_NAME) {
+					message.kind = HIDPP_NAME_REPLY;
+					unsigned char length = data[5];
+					// the name can't run past the end of the report
+					if (length > sizeof(message.name.name) - 1) {
+						length = sizeof(message.name.name) - 1;
+					}
+					message.name.slot = (data[4] & 0x0f) + 1;
+					unsigned char copied = 0;
+					// the name ends at a nul, anything but printable ascii would break the JSON it goes into
+					while (copied < length && data[6 + copied] != 0) {
+						unsigned char c = data[6 + copied];
+						message.name.name[copied++] = c >= 0x20 && c < 0x7f ? (char)c : '?';
+					}
+					message.name.length = copied;
+					message.name.name[copied] = 0;
+				}
+				else if ((data[4] & 0xf0) == HIDPP_PAIRING_DEVICE_INFO) {
+					message.kind = HIDPP_DEVICE_INFO_REPLY;
+					message.device_info.slot = (data[4] & 0x0f) + 1;
+					// big endian here, unlike in the connection notification
+					message.device_info.wireless_pid = (data[7] << 8) | data[8];
+					message.device_info.device_type = data[11] & HIDPP_DEVICE_TYPE_MASK;
+				}
+				else if (data[4] == HIDPP_PAIRING_RECEIVER_INFO) {
+					message.kind = HIDPP_RECEIVER_INFO_REPLY;
+					message.receiver_info.serial = (data[5] << 24) | (data[6] << 16) | (data[7] << 8) | data[8];
+				}
+			}
+			break;
+		case HIDPP_ERROR_MESSAGE:
+			message.kind = HIDPP_ERROR_REPLY;
+			message.key = make_key(message.device_index, data[3], data[4], hidpp_any_param);
+			message.error.sub_id = data[3];
+			message.error.address = data[4];
+			message.error.error_code = data[5];
+			break;
+		case hidpp20_error_feature_index:
+			message.kind = HIDPP20_ERROR_REPLY;
+			message.key = make_key(message.device_index, data[3], data[4], hidpp_any_param);
+			message.error.sub_id = data[3];
+			message.error.address = data[4];
+			message.error.error_code = data[5];
+			break;
+		default:
+			// sub ids from 0x40 up belong to HID++ 1.0, feature indexes are below that
+			if (sub_id >= 0x40) {
+				break;
+			}
+			message.kind = HIDPP20_MESSAGE;
+			// software id 0 marks a notification rather than a reply
+			message.key = (data[3] & 0x0f) == 0 ? 0 : hidpp_request_key(data);
+			message.feature.feature_index = sub_id;
+			message.feature.function = data[3] >> 4;
+			message.feature.software_id = data[3] & 0x0f;
+			message.feature.params = data + 4;
+			message.feature.params_size = hidpp_report_size(message.report_id) - 4;
+			break;
+	}
+	return message;
+}
+
+unsigned long long hidpp_request_key(const unsigned char* request) {
+	bool pairing_register = request[2] >= HIDPP_SET_REGISTER && request[2] <= HIDPP_GET_LONG_REGISTER && request[3] == HIDPP_REGISTER_PAIRING_INFORMATION;
+	return make_key(request[1], request[2], request[3], pairing_register ? request[4] : 0);
+}
+
+bool hidpp20_decode_battery(HIDPPFeature feature, HIDPP20Message const& message, HIDPPBattery& battery) {
+	if (message.params_size < 3) {
+		return false;
+	}
+	// replies carry the function that was called, events function 0
+	bool event = message.software_id == 0;
+	if (feature == HIDPP_FEATURE_BATTERY_STATUS && (event || message.function == hidpp20_battery_status_function)) {
+		// level 0 means the device can't tell, status 1-3 are recharging, almost full and full
+		if (message.params[0] == 0 || message.params[0] > 100) {
+			return false;
+		}
+		battery.level = message.params[0];
+		battery.charging = message.params[2] >= 1 && message.params[2] <= 3;
+		return true;
+	}
+	if (feature == HIDPP_FEATURE_UNIFIED_BATTERY && (event ? message.function == 0 : message.function == hidpp20_unified_battery_function)) {
+		// state of charge, level flags, then charging status where 1 and 2 are charging
+		if (message.params[0] > 100) {
+			return false;
+		}
+		battery.level = message.params[0];
+		battery.charging = message.params[2] == 1 || message.params[2] == 2;
+		return true;
+	}
+	return false;
+}
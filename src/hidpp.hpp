@@ -0,0 +1,286 @@
+#pragma once
+#include <cstddef>
+
+// HID++ 1.0 and 2.0 reports as used by Unifying receivers
+// https://lekensteyn.nl/files/logitech/logitech_hidpp10_specification_for_Unifying_Receivers.pdf
+// Everything here works on fixed size buffers, nothing allocates
+
+enum HIDPPReportId : unsigned char {
+	HIDPP_SHORT = 0x10,
+	HIDPP_LONG = 0x11,
+	HIDPP_VERY_LONG = 0x12
+};
+
+template <unsigned int Size>
+struct HIDPPReport {
+	static const unsigned int size = Size;
+	unsigned char bytes[Size];
+};
+typedef HIDPPReport<7> HIDPPShortReport;
+typedef HIDPPReport<20> HIDPPLongReport;
+typedef HIDPPReport<64> HIDPPVeryLongReport;
+
+constexpr unsigned int hidpp_report_size(unsigned char report_id) {
+	return report_id == HIDPP_SHORT ? HIDPPShortReport::size
+		: report_id == HIDPP_LONG ? HIDPPLongReport::size
+		: report_id == HIDPP_VERY_LONG ? HIDPPVeryLongReport::size
+		: 0;
+}
+
+// Device index of the receiver itself
+const unsigned char hidpp_receiver_index = 0xff;
+
+// HID++ 1.0 sub ids
+enum HIDPPSubId : unsigned char {
+	HIDPP_DEVICE_DISCONNECTION = 0x40,
+	HIDPP_DEVICE_CONNECTION = 0x41,
+	HIDPP_SET_REGISTER = 0x80,
+	HIDPP_GET_REGISTER = 0x81,
+	HIDPP_SET_LONG_REGISTER = 0x82,
+	HIDPP_GET_LONG_REGISTER = 0x83,
+	HIDPP_ERROR_MESSAGE = 0x8f
+};
+
+// HID++ 1.0 receiver registers
+enum HIDPPRegister : unsigned char {
+	HIDPP_REGISTER_NOTIFICATIONS = 0x00,
+	HIDPP_REGISTER_CONNECTION_STATE = 0x02,
+	HIDPP_REGISTER_PAIRING_INFORMATION = 0xb5
+};
+
+// First parameter of the pairing information register
+enum HIDPPPairingInformation : unsigned char {
+	HIDPP_PAIRING_RECEIVER_INFO = 0x03,
+	// ored with the 0 indexed slot
+	HIDPP_PAIRING_DEVICE_INFO = 0x20,
+	HIDPP_PAIRING_DEVICE_NAME = 0x40
+};
+
+// Bits of the device info byte in a connection notification
+enum HIDPPDeviceInfo : unsigned char {
+	HIDPP_DEVICE_TYPE_MASK = 0x0f,
+	HIDPP_LINK_ENCRYPTED = 0x20,
+	HIDPP_LINK_NOT_ESTABLISHED = 0x40
+};
+
+// HID++ 1.0 error the receiver answers with for a paired device that is asleep or out of range
+const unsigned char hidpp_error_unreachable = 0x09;
+// HID++ 1.0 error a HID++ 1.0 device answers a HID++ 2.0 request with
+const unsigned char hidpp_error_invalid_sub_id = 0x01;
+
+// Marks a HID++ 2.0 error reply in the feature index byte
+const unsigned char hidpp20_error_feature_index = 0xff;
+
+// HID++ 2.0 feature ids, a device maps the ones it supports to feature indexes
+enum HIDPPFeature : unsigned short {
+	HIDPP_FEATURE_ROOT = 0x0000,
+	HIDPP_FEATURE_BATTERY_STATUS = 0x1000,
+	HIDPP_FEATURE_UNIFIED_BATTERY = 0x1004
+};
+
+// IRoot is always at feature index 0
+const unsigned char hidpp20_root_index = 0x00;
+
+enum HIDPPRootFunction : unsigned char {
+	// feature id -> feature index, 0 if the device doesn't have the feature
+	HIDPP_ROOT_GET_FEATURE = 0,
+	HIDPP_ROOT_PING = 1
+};
+
+// BATTERY_STATUS: get level status, UNIFIED_BATTERY: get status
+// both report changes with event 0
+const unsigned char hidpp20_battery_status_function = 0;
+const unsigned char hidpp20_unified_battery_function = 1;
+
+// Software id of the requests sent by this driver,
+// replies echo it and notifications have 0 there
+const unsigned char hidpp20_software_id = 0x0a;
+
+struct HIDPPName {
+	unsigned char code;
+	const char* name;
+};
+
+constexpr HIDPPName hidpp_sub_id_names[] = {
+	{ HIDPP_DEVICE_DISCONNECTION, "device disconnection" },
+	{ HIDPP_DEVICE_CONNECTION, "device connection" },
+	{ HIDPP_SET_REGISTER, "set register" },
+	{ HIDPP_GET_REGISTER, "get register" },
+	{ HIDPP_SET_LONG_REGISTER, "set long register" },
+	{ HIDPP_GET_LONG_REGISTER, "get long register" },
+	{ HIDPP_ERROR_MESSAGE, "error" }
+};
+
+constexpr HIDPPName hidpp_register_names[] = {
+	{ HIDPP_REGISTER_NOTIFICATIONS, "notifications" },
+	{ HIDPP_REGISTER_CONNECTION_STATE, "connection state" },
+	{ HIDPP_REGISTER_PAIRING_INFORMATION, "pairing information" }
+};
+
+constexpr HIDPPName hidpp_device_type_names[] = {
+	{ 0x00, "unknown" },
+	{ 0x01, "keyboard" },
+	{ 0x02, "mouse" },
+	{ 0x03, "numpad" },
+	{ 0x04, "presenter" },
+	{ 0x08, "trackball" },
+	{ 0x09, "touchpad" }
+};
+
+constexpr HIDPPName hidpp_error_names[] = {
+	{ 0x00, "success" },
+	{ 0x01, "invalid sub id" },
+	{ 0x02, "invalid address" },
+	{ 0x03, "invalid value" },
+	{ 0x04, "connect fail" },
+	{ 0x05, "too many devices" },
+	{ 0x06, "already exists" },
+	{ 0x07, "busy" },
+	{ 0x08, "unknown device" },
+	{ 0x09, "resource error" },
+	{ 0x0a, "request unavailable" },
+	{ 0x0b, "invalid parameter" },
+	{ 0x0c, "wrong pin code" }
+};
+
+template <size_t Count>
+constexpr const char* hidpp_name(const HIDPPName (&table)[Count], unsigned char code) {
+	for (size_t i = 0; i < Count; ++i) {
+		if (table[i].code == code) {
+			return table[i].name;
+		}
+	}
+	return "unknown";
+}
+
+// HID++ 1.0 register access on a short report, the reply echoes the sub id and register
+constexpr HIDPPShortReport hidpp_register_request(unsigned char device_index, HIDPPSubId sub_id, HIDPPRegister address, unsigned char p0 = 0, unsigned char p1 = 0, unsigned char p2 = 0) {
+	return HIDPPShortReport{ { HIDPP_SHORT, device_index, sub_id, address, p0, p1, p2 } };
+}
+
+// HID++ 2.0 feature call on a short report,
+// the function is in the high nibble and the software id in the low nibble of the 4th byte
+constexpr HIDPPShortReport hidpp20_request(unsigned char device_index, unsigned char feature_index, unsigned char function, unsigned char software_id, unsigned char p0 = 0, unsigned char p1 = 0, unsigned char p2 = 0) {
+	return HIDPPShortReport{ { HIDPP_SHORT, device_index, feature_index, (unsigned char)((function << 4) | (software_id & 0x0f)), p0, p1, p2 } };
+}
+
+// IRoot getFeature for feature on a paired device
+constexpr HIDPPShortReport hidpp20_get_feature_request(unsigned char device_index, HIDPPFeature feature) {
+	return hidpp20_request(device_index, hidpp20_root_index, HIDPP_ROOT_GET_FEATURE, hidpp20_software_id, (unsigned char)(feature >> 8), (unsigned char)feature);
+}
+
+// IRoot ping, the reply carries the protocol version and echoes data
+// HID++ 1.0 devices answer with an invalid sub id error, the receiver answers for devices that can't be reached
+constexpr HIDPPShortReport hidpp20_ping_request(unsigned char device_index, unsigned char data) {
+	return hidpp20_request(device_index, hidpp20_root_index, HIDPP_ROOT_PING, hidpp20_software_id, 0, 0, data);
+}
+
+enum HIDPPMessageKind {
+	HIDPP_UNKNOWN,
+	// 0x41 wireless device connection notification
+	HIDPP_CONNECTION,
+	// reply to a HID++ 1.0 register read or write
+	HIDPP_REGISTER_REPLY,
+	// pairing information register: device name
+	HIDPP_NAME_REPLY,
+	// pairing information register: device info
+	HIDPP_DEVICE_INFO_REPLY,
+	// pairing information register: receiver info
+	HIDPP_RECEIVER_INFO_REPLY,
+	// HID++ 1.0 error (0x8f)
+	HIDPP_ERROR_REPLY,
+	// reply or notification from a HID++ 2.0 feature
+	HIDPP20_MESSAGE,
+	// HID++ 2.0 error (feature index 0xff)
+	HIDPP20_ERROR_REPLY
+};
+
+struct HIDPPConnection {
+	unsigned char protocol;
+	unsigned char device_type;
+	bool link_established;
+	bool encrypted;
+	unsigned short wireless_pid;
+};
+
+struct HIDPPRegisterReply {
+	unsigned char sub_id;
+	unsigned char address;
+	// 3 bytes for short registers, 16 for long registers
+	const unsigned char* value;
+	unsigned char value_size;
+};
+
+struct HIDPPNameReply {
+	// 1 indexed
+	unsigned char slot;
+	unsigned char length;
+	// null terminated, the length is clamped to what fits in a long report
+	char name[15];
+};
+
+struct HIDPPDeviceInfoReply {
+	// 1 indexed
+	unsigned char slot;
+	unsigned short wireless_pid;
+	unsigned char device_type;
+};
+
+struct HIDPPReceiverInfo {
+	unsigned int serial;
+};
+
+struct HIDPPError {
+	// sub id or feature index of the request that failed
+	unsigned char sub_id;
+	// register or function/software id byte of the request that failed
+	unsigned char address;
+	unsigned char error_code;
+};
+
+struct HIDPP20Message {
+	unsigned char feature_index;
+	unsigned char function;
+	unsigned char software_id;
+	const unsigned char* params;
+	unsigned char params_size;
+};
+
+// A decoded report, the fields for kind are valid
+// pointers point into the buffer that was decoded
+struct HIDPPMessage {
+	HIDPPMessageKind kind;
+	unsigned char report_id;
+	unsigned char device_index;
+	// matches hidpp_request_key of the request this replies to, 0 for notifications
+	unsigned long long key;
+	union {
+		HIDPPConnection connection;
+		HIDPPRegisterReply register_reply;
+		HIDPPNameReply name;
+		HIDPPDeviceInfoReply device_info;
+		HIDPPReceiverInfo receiver_info;
+		HIDPPError error;
+		HIDPP20Message feature;
+	};
+};
+
+// Decodes one report, anything malformed or unrecognized decodes as HIDPP_UNKNOWN
+HIDPPMessage hidpp_decode(const unsigned char* data, unsigned int size);
+
+struct HIDPPBattery {
+	// percent
+	unsigned char level;
+	bool charging;
+};
+
+// Reads the battery out of a battery feature reply or event,
+// returns false if the message isn't one or the device doesn't know its level
+bool hidpp20_decode_battery(HIDPPFeature feature, HIDPP20Message const& message, HIDPPBattery& battery);
+
+// Identifies the request a reply or error belongs to:
+// device index, sub id or feature index, register or function/software id, and for
+// the pairing information register the first parameter
+// errors don't echo the parameter, so their key has it set to hidpp_any_param
+const unsigned int hidpp_any_param = 0x100;
+unsigned long long hidpp_request_key(const unsigned char* request);
@@ -0,0 +1,116 @@
+#include "hidpp_requests.hpp"
+
+int HIDPPRequestQueue::reserve(HIDPPRequest const& request) {
+	for (unsigned int i = 0; i < max_in_flight; ++i) {
+		if (!in_use[i]) {
+			requests[i] = request;
+			in_use[i] = true;
+			order[i] = next_order++;
+			++in_flight;
+			return (int)i;
+		}
+	}
+	return -1;
+}
+
+void HIDPPRequestQueue::release(int slot) {
+	if (slot >= 0 && in_use[slot]) {
+		in_use[slot] = false;
+		--in_flight;
+	}
+}
+
+bool HIDPPRequestQueue::wait(HIDPPShortReport const& report, HIDPPRequest const& request, int timeout_ms) {
+	if (waiting_count == max_waiting) {
+		return false;
+	}
+	waiting[(waiting_head + waiting_count) % max_waiting] = Waiting{ report, request, timeout_ms };
+	++waiting_count;
+	return true;
+}
+
+bool HIDPPRequestQueue::next_waiting(Waiting& request) {
+	if (waiting_count == 0 || in_flight == max_in_flight) {
+		return false;
+	}
+	request = waiting[waiting_head];
+	waiting_head = (waiting_head + 1) % max_waiting;
+	--waiting_count;
+	return true;
+}
+
+bool HIDPPRequestQueue::match(HIDPPMessage const& reply, HIDPPRequest& request) {
+	if (reply.key == 0) {
+		return false;
+	}
+	// errors have the parameter bits set to hidpp_any_param, so compare without them
+	const unsigned long long param_mask = 0x1ff;
+	bool any_param = (reply.key & param_mask) == hidpp_any_param;
+	int found = -1;
+	for (unsigned int i = 0; i < max_in_flight; ++i) {
+		if (!in_use[i]) {
+			continue;
+		}
+		bool matches = any_param ? (requests[i].key & ~param_mask) == (reply.key & ~param_mask) : requests[i].key == reply.key;
+		if (matches && (found < 0 || order[i] < order[found])) {
+			found = i;
+		}
+	}
+	if (found < 0) {
+		return false;
+	}
+	request = requests[found];
+	release(found);
+	return true;
+}
+
+bool HIDPPRequestQueue::expire(std::chrono::steady_clock::time_point now, HIDPPRequest& request) {
+	for (unsigned int i = 0; i < max_in_flight; ++i) {
+		if (in_use[i] && requests[i].deadline <= now) {
+			request = requests[i];
+			release(i);
+			return true;
+		}
+	}
+	return false;
+}
+
+int HIDPPRequestQueue::next_timeout_ms(std::chrono::steady_clock::time_point now) const {
+	int timeout_ms = -1;
+	for (unsigned int i = 0; i < max_in_flight; ++i) {
+		if (!in_use[i]) {
+			continue;
+		}
+		auto remaining = std::chrono::ceil<std::chrono::milliseconds>(requests[i].deadline - now).count();
+		if (remaining < 0) {
+			remaining = 0;
+		}
+		if (timeout_ms < 0 || remaining < timeout_ms) {
+			timeout_ms = (int)remaining;
+		}
+	}
+	return timeout_ms;
+}
+
+void HIDPPRequestQueue::clear() {
+	for (unsigned int i = 0; i < max_in_flight; ++i) {
+		in_use[i] = false;
+	}
+	in_flight = 0;
+	waiting_head = 0;
+	waiting_count = 0;
+}
+
+bool HIDPPRequestQueue::pending(unsigned long long key) const {
+	for (unsigned int i = 0; i < max_in_flight; ++i) {
+		if (in_use[i] && requests[i].key == key) {
+			return true;
+		}
+	}
+	for (unsigned int i = 0; i < waiting_count; ++i) {
+		if (waiting[(waiting_head + i) % max_waiting].request.key == key) {
+			return true;
+		}
+	}
+	return false;
+}
@@ -0,0 +1,69 @@
+#pragma once
+#include <chrono>
+#include "hidpp.hpp"
+
+// A HID++ request waiting for its reply
+struct HIDPPRequest {
+	unsigned int receiver;
+	// what the request was for, chosen by the caller
+	unsigned int tag;
+	unsigned char slot;
+	unsigned long long key;
+	std::chrono::steady_clock::time_point deadline;
+};
+
+// Keeps track of the HID++ requests in flight on one receiver and matches replies to them,
+// so several requests can be outstanding at once and a missing reply only costs its deadline
+// requests past max_in_flight wait their turn and are written as replies and timeouts free a slot,
+// so a burst of requests is spread out instead of dropped
+// fixed capacity, nothing allocates
+class HIDPPRequestQueue {
+public:
+	// the receiver answers in the order requests arrive, more outstanding would only wait in its buffer
+	static const unsigned int max_in_flight = 8;
+	// enough for everything a receiver sends while opening, a name, a ping and a battery query for every slot
+	static const unsigned int max_waiting = 32;
+
+	// a request that hasn't been written yet, its deadline starts once it is
+	struct Waiting {
+		HIDPPShortReport report;
+		HIDPPRequest request;
+		int timeout_ms;
+	};
+
+private:
+	HIDPPRequest requests[max_in_flight];
+	bool in_use[max_in_flight] = {};
+	// increases with every reserve, used to find the oldest request
+	unsigned long long order[max_in_flight] = {};
+	unsigned long long next_order = 0;
+	unsigned int in_flight = 0;
+	// oldest first
+	Waiting waiting[max_waiting];
+	unsigned int waiting_head = 0;
+	unsigned int waiting_count = 0;
+
+public:
+	// whether a new request has to wait, also while older ones are waiting so the order is kept
+	bool busy() const { return in_flight == max_in_flight || waiting_count > 0; }
+	// takes a slot before the request is written, so a reply can never arrive untracked
+	// returns the slot, -1 if every slot is taken
+	int reserve(HIDPPRequest const& request);
+	// gives the slot back when its request couldn't be written
+	void release(int slot);
+	// returns false if max_waiting requests are waiting already
+	bool wait(HIDPPShortReport const& report, HIDPPRequest const& request, int timeout_ms);
+	// takes the oldest waiting request once a slot is free
+	bool next_waiting(Waiting& request);
+	// finds and removes the request reply belongs to,
+	// errors don't carry every parameter, so they match the oldest request they could belong to
+	bool match(HIDPPMessage const& reply, HIDPPRequest& request);
+	// removes one request that is past its deadline
+	bool expire(std::chrono::steady_clock::time_point now, HIDPPRequest& request);
+	// milliseconds until the next deadline, -1 if nothing is in flight
+	int next_timeout_ms(std::chrono::steady_clock::time_point now) const;
+	// drops every request, for a receiver that was closed
+	void clear();
+	// whether a request with key is still waiting to be written or for its reply
+	bool pending(unsigned long long key) const;
+};
@@ -0,0 +1,412 @@
+#include "local_socket_sink.hpp"
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#ifndef _WIN32
+#include <cerrno>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#endif
+
+LocalSocketSink::LocalSocketSink(const std::string& path, const SeqLock<StateSnapshot>& state, Logger& debug_log) : path(path), state(state), debug_log(debug_log) {
+	// moving subscribers around never allocates
+	subscribers.reserve(max_subscribers);
+}
+
+LocalSocketSink::~LocalSocketSink() {
+	stop();
+}
+
+bool LocalSocketSink::start() {
+	if (!open_listener()) {
+		close_listener();
+		return false;
+	}
+	stopping = false;
+	thread = std::thread(&LocalSocketSink::sink_loop, this);
+	return true;
+}
+
+void LocalSocketSink::stop() {
+	if (!thread.joinable()) {
+		return;
+	}
+	stopping = true;
+	wake();
+	thread.join();
+	for (Subscriber& subscriber : subscribers) {
+		close_subscriber(subscriber);
+	}
+	subscribers.clear();
+	close_listener();
+}
+
+void LocalSocketSink::device_event(DeviceEvent const& event) {
+	QueuedEvent* entry = queue.write_slot();
+	if (entry == nullptr) {
+		dropped.fetch_add(1, std::memory_order_relaxed);
+		return;
+	}
+	entry->kind = event.kind;
+	entry->receiver_serial = event.receiver_serial;
+	entry->slot = event.slot;
+	entry->status = event.status;
+	entry->battery_level = event.battery_level;
+	entry->battery_charging = event.battery_charging;
+	size_t length = std::min(event.name.size(), sizeof(entry->name) - 1);
+	std::memcpy(entry->name, event.name.data(), length);
+	entry->name[length] = 0;
+	entry->time_ms = std::chrono::duration_cast<std::chrono::milliseconds>(event.last_transition.time_since_epoch()).count();
+	entry->suppressed_events = event.suppressed_events;
+	queue.push();
+	wake();
+}
+
+void LocalSocketSink::state_published() {
+	QueuedEvent* entry = queue.write_slot();
+	if (entry == nullptr) {
+		dropped.fetch_add(1, std::memory_order_relaxed);
+		return;
+	}
+	entry->kind = state_event;
+	queue.push();
+	wake();
+}
+
+// device names come from the receiver, quotes and control characters can't break the line
+static void json_escape(const char* text, char* escaped, size_t size) {
+	size_t length = 0;
+	for (; *text != 0 && length + 7 < size; ++text) {
+		unsigned char c = (unsigned char)*text;
+		if (c == '"' || c == '\\') {
+			escaped[length++] = '\\';
+			escaped[length++] = c;
+		}
+		else if (c < 0x20) {
+			length += std::snprintf(escaped + length, size - length, "\\u%04x", c);
+		}
+		else {
+			escaped[length++] = c;
+		}
+	}
+	escaped[length] = 0;
+}
+
+void LocalSocketSink::append(Subscriber& subscriber, QueuedEvent const& event, const char* kind) {
+	if (subscriber.lagging) {
+		return;
+	}
+	char name[sizeof(event.name) * 6 + 1];
+	json_escape(event.name, name, sizeof(name));
+	char battery[12] = "null";
+	if (event.battery_level >= 0) {
+		std::snprintf(battery, sizeof(battery), "%d", event.battery_level);
+	}
+	std::string_view status = device_status_name(event.status);
+	char line[max_line];
+	int length = std::snprintf(line, sizeof(line), "{\"event\":\"%s\",\"receiver\":\"%08x\",\"slot\":%u,\"name\":\"%s\",\"status\":\"%.*s\",\"battery\":%s,\"charging\":%s,\"time\":%lld,\"suppressed\":%u}\n",
+		kind, event.receiver_serial, (unsigned int)event.slot, name, (int)status.size(), status.data(), battery, event.battery_charging ? "true" : "false", event.time_ms, event.suppressed_events);
+	if (length <= 0 || (size_t)length >= sizeof(line)) {
+		return;
+	}
+	// what was already written makes room first
+	if (subscriber.buffer.size() + length > max_buffered && subscriber.written > 0) {
+		subscriber.buffer.erase(0, subscriber.written);
+		subscriber.written = 0;
+	}
+	if (subscriber.buffer.size() + length > max_buffered) {
+		subscriber.lagging = true;
+		debug_log.log(LOG_LOCAL_SUBSCRIBER_LAGGING);
+		return;
+	}
+	subscriber.buffer.append(line, length);
+}
+
+void LocalSocketSink::append_state(Subscriber& subscriber) {
+	StateSnapshot snapshot = state.read();
+	for (unsigned int i = 0; i < snapshot.count; ++i) {
+		DeviceSnapshot const& device = snapshot.devices[i];
+		QueuedEvent event{ state_event, device.receiver_serial, device.slot, device.status, device.battery_level, device.battery_charging, {}, 0, 0 };
+		std::memcpy(event.name, device.name, sizeof(event.name));
+		event.time_ms = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::duration(device.last_transition)).count();
+		event.suppressed_events = device.suppressed_events;
+		append(subscriber, event, "state");
+	}
+}
+
+bool LocalSocketSink::flush(Subscriber& subscriber) {
+	while (true) {
+		while (subscriber.written < subscriber.buffer.size()) {
+			long sent = write_subscriber(subscriber, subscriber.buffer.data() + subscriber.written, subscriber.buffer.size() - subscriber.written);
+			if (sent < 0) {
+				return false;
+			}
+			if (sent == 0) {
+				// the rest is written once the subscriber reads
+				return true;
+			}
+			subscriber.written += sent;
+		}
+		subscriber.buffer.clear();
+		subscriber.written = 0;
+		if (!subscriber.lagging) {
+			return subscriber_alive(subscriber);
+		}
+		// caught up with what was buffered, the state lines replace everything it skipped
+		subscriber.lagging = false;
+		append_state(subscriber);
+	}
+}
+
+void LocalSocketSink::sink_loop() {
+	unsigned long long logged_dropped = 0;
+	while (!stopping) {
+		wait();
+		accept_subscribers();
+		unsigned long long now_dropped = dropped.load(std::memory_order_relaxed);
+		if (now_dropped != logged_dropped) {
+			debug_log.log(LOG_LOCAL_QUEUE_FULL, now_dropped - logged_dropped);
+			logged_dropped = now_dropped;
+			// nobody saw the dropped changes
+			for (Subscriber& subscriber : subscribers) {
+				subscriber.lagging = true;
+			}
+		}
+		while (QueuedEvent* event = queue.read_slot()) {
+			for (Subscriber& subscriber : subscribers) {
+				if (event->kind != state_event) {
+					append(subscriber, *event, event->kind == EVENT_STATUS ? "status" : "battery");
+				}
+				else if (subscriber.fresh) {
+					// a change read before it joined can be missing from the state it got,
+					// it isn't from this one
+					subscriber.fresh = false;
+					append_state(subscriber);
+				}
+			}
+			queue.pop();
+		}
+		for (size_t i = 0; i < subscribers.size();) {
+			if (flush(subscribers[i])) {
+				++i;
+				continue;
+			}
+			close_subscriber(subscribers[i]);
+			subscribers.erase(subscribers.begin() + i);
+			debug_log.log(LOG_LOCAL_SUBSCRIBER_CLOSED, subscribers.size());
+		}
+	}
+}
+
+void LocalSocketSink::add_subscriber(Subscriber&& subscriber) {
+	subscriber.buffer.reserve(max_buffered);
+	subscribers.push_back(std::move(subscriber));
+	append_state(subscribers.back());
+	debug_log.log(LOG_LOCAL_SUBSCRIBER, subscribers.size());
+}
+
+#ifdef _WIN32
+HANDLE LocalSocketSink::create_instance() {
+	// byte mode without waiting, so neither a slow subscriber nor a missing one holds up the thread
+	return CreateNamedPipeA(path.c_str(), PIPE_ACCESS_DUPLEX, PIPE_TYPE_BYTE | PIPE_READMODE_BYTE | PIPE_NOWAIT | PIPE_REJECT_REMOTE_CLIENTS,
+		PIPE_UNLIMITED_INSTANCES, max_buffered, 0, 0, NULL);
+}
+
+bool LocalSocketSink::open_listener() {
+	wake_event = CreateEventA(NULL, FALSE, FALSE, NULL);
+	listener = create_instance();
+	if (wake_event == NULL || listener == INVALID_HANDLE_VALUE) {
+		debug_log.log(LOG_LOCAL_SOCKET_FAILED, path, GetLastError());
+		return false;
+	}
+	return true;
+}
+
+void LocalSocketSink::close_listener() {
+	if (listener != INVALID_HANDLE_VALUE) {
+		CloseHandle(listener);
+		listener = INVALID_HANDLE_VALUE;
+	}
+	if (wake_event != NULL) {
+		CloseHandle(wake_event);
+		wake_event = NULL;
+	}
+}
+
+void LocalSocketSink::wait() {
+	// a pipe can't be waited on without overlapped io, new subscribers and full pipes are checked on this interval
+	WaitForSingleObject(wake_event, accept_interval_ms);
+}
+
+void LocalSocketSink::wake() {
+	SetEvent(wake_event);
+}
+
+void LocalSocketSink::accept_subscribers() {
+	while (listener != INVALID_HANDLE_VALUE) {
+		// without waiting this never blocks, it only says whether a client is there
+		if (ConnectNamedPipe(listener, NULL)) {
+			return;
+		}
+		DWORD error = GetLastError();
+		if (error == ERROR_PIPE_LISTENING) {
+			return;
+		}
+		if (error != ERROR_PIPE_CONNECTED) {
+			// the client already left, the instance can take the next one
+			DisconnectNamedPipe(listener);
+			return;
+		}
+		HANDLE pipe = listener;
+		listener = create_instance();
+		if (subscribers.size() == max_subscribers) {
+			DisconnectNamedPipe(pipe);
+			CloseHandle(pipe);
+			debug_log.log(LOG_LOCAL_SUBSCRIBERS_FULL, max_subscribers);
+			continue;
+		}
+		Subscriber subscriber;
+		subscriber.pipe = pipe;
+		add_subscriber(std::move(subscriber));
+	}
+}
+
+long LocalSocketSink::write_subscriber(Subscriber& subscriber, const char* data, size_t size) {
+	DWORD written = 0;
+	if (!WriteFile(subscriber.pipe, data, (DWORD)size, &written, NULL)) {
+		return -1;
+	}
+	return (long)written;
+}
+
+bool LocalSocketSink::subscriber_alive(Subscriber& subscriber) {
+	// fails once the client closed its end
+	return PeekNamedPipe(subscriber.pipe, NULL, 0, NULL, NULL, NULL) != 0;
+}
+
+void LocalSocketSink::close_subscriber(Subscriber& subscriber) {
+	if (subscriber.pipe != INVALID_HANDLE_VALUE) {
+		DisconnectNamedPipe(subscriber.pipe);
+		CloseHandle(subscriber.pipe);
+		subscriber.pipe = INVALID_HANDLE_VALUE;
+	}
+}
+#else
+bool LocalSocketSink::open_listener() {
+	sockaddr_un address{};
+	address.sun_family = AF_UNIX;
+	if (path.size() >= sizeof(address.sun_path)) {
+		debug_log.log(LOG_LOCAL_SOCKET_FAILED, path, ENAMETOOLONG);
+		return false;
+	}
+	std::memcpy(address.sun_path, path.c_str(), path.size() + 1);
+	wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	listener = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (wake_fd < 0 || listener < 0) {
+		debug_log.log(LOG_LOCAL_SOCKET_FAILED, path, errno);
+		return false;
+	}
+	// a socket left behind by a driver that didn't exit cleanly, anything else at the path is left alone
+	struct stat existing;
+	if (lstat(path.c_str(), &existing) == 0 && S_ISSOCK(existing.st_mode)) {
+		unlink(path.c_str());
+	}
+	if (bind(listener, (sockaddr*)&address, sizeof(address)) != 0 || chmod(path.c_str(), 0660) != 0 || listen(listener, max_subscribers) != 0) {
+		debug_log.log(LOG_LOCAL_SOCKET_FAILED, path, errno);
+		return false;
+	}
+	return true;
+}
+
+void LocalSocketSink::close_listener() {
+	if (listener >= 0) {
+		::close(listener);
+		listener = -1;
+		struct stat existing;
+		if (lstat(path.c_str(), &existing) == 0 && S_ISSOCK(existing.st_mode)) {
+			unlink(path.c_str());
+		}
+	}
+	if (wake_fd >= 0) {
+		::close(wake_fd);
+		wake_fd = -1;
+	}
+}
+
+void LocalSocketSink::wait() {
+	pollfd fds[max_subscribers + 2];
+	nfds_t count = 0;
+	fds[count++] = pollfd{ wake_fd, POLLIN, 0 };
+	fds[count++] = pollfd{ listener, POLLIN, 0 };
+	for (const Subscriber& subscriber : subscribers) {
+		// readable also means it closed its end, but input is only read once the output is written,
+		// a subscriber that sent something and doesn't read would wake every pass
+		short events = subscriber.written < subscriber.buffer.size() ? POLLOUT : POLLIN;
+		fds[count++] = pollfd{ subscriber.fd, events, 0 };
+	}
+	if (poll(fds, count, -1) > 0 && (fds[0].revents & POLLIN)) {
+		eventfd_t value;
+		eventfd_read(wake_fd, &value);
+	}
+}
+
+void LocalSocketSink::wake() {
+	eventfd_write(wake_fd, 1);
+}
+
+void LocalSocketSink::accept_subscribers() {
+	while (true) {
+		int fd = accept4(listener, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+		if (fd < 0) {
+			return;
+		}
+		if (subscribers.size() == max_subscribers) {
+			::close(fd);
+			debug_log.log(LOG_LOCAL_SUBSCRIBERS_FULL, max_subscribers);
+			continue;
+		}
+		Subscriber subscriber;
+		subscriber.fd = fd;
+		add_subscriber(std::move(subscriber));
+	}
+}
+
+long LocalSocketSink::write_subscriber(Subscriber& subscriber, const char* data, size_t size) {
+	while (true) {
+		ssize_t sent = send(subscriber.fd, data, size, MSG_DONTWAIT | MSG_NOSIGNAL);
+		if (sent >= 0) {
+			return (long)sent;
+		}
+		if (errno == EAGAIN || errno == EWOULDBLOCK) {
+			return 0;
+		}
+		if (errno != EINTR) {
+			return -1;
+		}
+	}
+}
+
+bool LocalSocketSink::subscriber_alive(Subscriber& subscriber) {
+	// subscribers only listen, whatever they send is thrown away, end of file means they left
+	char discard[256];
+	// bounded, so a subscriber that keeps sending can't hold up the others
+	for (int i = 0; i < 16; ++i) {
+		ssize_t received = recv(subscriber.fd, discard, sizeof(discard), MSG_DONTWAIT);
+		if (received <= 0) {
+			return received < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR);
+		}
+	}
+	return true;
+}
+
+void LocalSocketSink::close_subscriber(Subscriber& subscriber) {
+	if (subscriber.fd >= 0) {
+		::close(subscriber.fd);
+		subscriber.fd = -1;
+	}
+}
+#endif
@@ -0,0 +1,109 @@
+#pragma once
+#include <atomic>
+#include <string>
+#include <thread>
+#include <vector>
+#ifdef _WIN32
+#include <windows.h>
+#endif
+#include "output_sink.hpp"
+#include "spsc_queue.hpp"
+#include "seqlock.hpp"
+#include "logger.hpp"
+
+// Streams device changes as newline delimited JSON to local subscribers,
+// a UNIX domain socket on Linux and a named pipe on Windows
+//
+// A subscriber first gets one state line per device, then a status or battery line per change:
+// {"event":"status","receiver":"51500000","slot":1,"name":"M720","status":"connected","battery":80,"charging":false,"time":1700000000000,"suppressed":0}
+// time is when the status last changed, in unix milliseconds,
+// suppressed counts the status changes held back since the device last became unstable
+//
+// device_event only copies into a ring, the sink's own thread formats and writes,
+// every subscriber has a bounded buffer and is written without blocking,
+// a subscriber that falls behind by more than the buffer skips ahead to a fresh set of state lines
+class LocalSocketSink : public OutputSink {
+	struct QueuedEvent {
+		// EVENT_STATUS, EVENT_BATTERY, or state_event for a published snapshot
+		int kind;
+		unsigned int receiver_serial;
+		unsigned char slot;
+		DeviceStatus status;
+		int battery_level;
+		bool battery_charging;
+		char name[16];
+		long long time_ms;
+		unsigned int suppressed_events;
+	};
+	static constexpr int state_event = -1;
+
+	struct Subscriber {
+#ifdef _WIN32
+		HANDLE pipe = INVALID_HANDLE_VALUE;
+#else
+		int fd = -1;
+#endif
+		// formatted and not written yet, never grows past max_buffered
+		std::string buffer;
+		size_t written = 0;
+		// joined since the last snapshot, the next one is sent again in case it missed a change
+		bool fresh = true;
+		// fell behind, events are skipped until the buffer is written and state lines are sent again
+		bool lagging = false;
+	};
+
+	static constexpr size_t max_line = 256;
+	static constexpr size_t max_buffered = 64 * 1024;
+	// an empty buffer takes a full set of state lines, so a lagging subscriber can always catch up
+	static_assert(max_buffered >= StateSnapshot::max_devices * max_line, "the state lines don't fit in the buffer");
+	static constexpr unsigned int max_subscribers = 16;
+
+	std::string path;
+	const SeqLock<StateSnapshot>& state;
+	Logger& debug_log;
+	SPSCQueue<QueuedEvent, 256> queue;
+	std::vector<Subscriber> subscribers;
+	std::thread thread;
+	std::atomic<bool> stopping = false;
+	// the ring was full, only written by the driver thread
+	std::atomic<unsigned long long> dropped = 0;
+#ifdef _WIN32
+	// the pipe instance waiting for the next subscriber
+	HANDLE listener = INVALID_HANDLE_VALUE;
+	HANDLE wake_event = NULL;
+	static const DWORD accept_interval_ms = 100;
+	HANDLE create_instance();
+#else
+	int listener = -1;
+	int wake_fd = -1;
+#endif
+
+	bool open_listener();
+	void close_listener();
+	// waits until an event is queued, a subscriber can be accepted or written to, or stop is called
+	void wait();
+	void wake();
+	void accept_subscribers();
+	void add_subscriber(Subscriber&& subscriber);
+	// bytes written, 0 if it would block, -1 once the subscriber is gone
+	long write_subscriber(Subscriber& subscriber, const char* data, size_t size);
+	bool subscriber_alive(Subscriber& subscriber);
+	// returns false once the subscriber is gone
+	bool flush(Subscriber& subscriber);
+	void close_subscriber(Subscriber& subscriber);
+	void sink_loop();
+	void append_state(Subscriber& subscriber);
+	void append(Subscriber& subscriber, QueuedEvent const& event, const char* kind);
+
+public:
+	LocalSocketSink(const std::string& path, const SeqLock<StateSnapshot>& state, Logger& debug_log);
+	LocalSocketSink(const LocalSocketSink&) = delete;
+	LocalSocketSink& operator=(const LocalSocketSink&) = delete;
+	~LocalSocketSink();
+	// returns false if the socket or pipe couldn't be created
+	bool start();
+	void stop();
+	void device_event(DeviceEvent const& event) override;
+	void state_published() override;
+	unsigned long long dropped_events() const { return dropped.load(std::memory_order_relaxed); }
+};
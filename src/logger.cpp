@@ -0,0 +1,252 @@
+#include "logger.hpp"
+#include <cstdio>
+#include <ctime>
+#include <cstring>
+
+LogLevel parse_log_level(const std::string& level) {
+	if (level == "debug") {
+		return LOG_DEBUG;
+	}
+	if (level == "warning") {
+		return LOG_WARNING;
+	}
+	if (level == "error") {
+		return LOG_ERROR;
+	}
+	return LOG_INFO;
+}
+
+static const char* level_prefix(LogLevel level) {
+	switch (level) {
+		case LOG_DEBUG:
+			return "debug: ";
+		case LOG_WARNING:
+			return "warning: ";
+		case LOG_ERROR:
+			return "error: ";
+		default:
+			return "";
+	}
+}
+
+Logger::Logger() : max_size(1024 * 1024) {
+	entries = new Entry[capacity];
+	for (unsigned int i = 0; i < capacity; ++i) {
+		entries[i].sequence.store(i, std::memory_order_relaxed);
+	}
+}
+
+Logger::~Logger() {
+	close();
+	delete[] entries;
+}
+
+bool Logger::open(const std::string& new_path, LogLevel new_level, size_t new_max_size) {
+	close();
+	path = new_path;
+	file.open(path, std::ios::app | std::ios::binary);
+	if (!file.is_open()) {
+		return false;
+	}
+	file.seekp(0, std::ios::end);
+	file_size = (size_t)file.tellp();
+	set_level(new_level);
+	set_max_size(new_max_size);
+	stopping = false;
+	thread = std::thread(&Logger::writer_loop, this);
+	return true;
+}
+
+void Logger::close() {
+	if (!thread.joinable()) {
+		return;
+	}
+	{
+		std::lock_guard<std::mutex> lock(wake_mutex);
+		stopping = true;
+	}
+	wake.notify_one();
+	thread.join();
+	file.close();
+}
+
+Logger::Entry* Logger::claim() {
+	std::uint64_t position = enqueue_position.load(std::memory_order_relaxed);
+	while (true) {
+		Entry* entry = &entries[position % capacity];
+		std::uint64_t sequence = entry->sequence.load(std::memory_order_acquire);
+		std::int64_t difference = (std::int64_t)sequence - (std::int64_t)position;
+		if (difference == 0) {
+			if (enqueue_position.compare_exchange_weak(position, position + 1, std::memory_order_relaxed)) {
+				return entry;
+			}
+		}
+		else if (difference < 0) {
+			// the writer hasn't caught up, losing a line beats blocking the caller
+			dropped.fetch_add(1, std::memory_order_relaxed);
+			return nullptr;
+		}
+		else {
+			position = enqueue_position.load(std::memory_order_relaxed);
+		}
+	}
+}
+
+void Logger::commit(Entry* entry) {
+	std::uint64_t position = entry->sequence.load(std::memory_order_relaxed);
+	// sequentially consistent with the writer going idle, so either it sees the entry or this sees it idle
+	entry->sequence.store(position + 1, std::memory_order_seq_cst);
+	if (writer_idle.load(std::memory_order_seq_cst) && writer_idle.exchange(false, std::memory_order_seq_cst)) {
+		{
+			// the writer may be between checking its predicate and waiting, the lock waits that out
+			std::lock_guard<std::mutex> lock(wake_mutex);
+		}
+		wake.notify_one();
+	}
+}
+
+void Logger::add_text(Entry* entry, const char* text, size_t size) {
+	for (size_t i = 0; i < size && text[i] && entry->text_size < max_text; ++i) {
+		entry->text[entry->text_size++] = text[i];
+	}
+	entry->text[entry->text_size] = 0;
+	if (entry->text_size < max_text) {
+		++entry->text_size;
+	}
+}
+
+void Logger::format(const Entry& entry, std::string& buffer, std::time_t& cached_second, std::string& cached_time) {
+	// localtime and strftime only run once per second of log entries
+	std::time_t second = std::chrono::system_clock::to_time_t(entry.time);
+	if (second != cached_second) {
+		tm local_time;
+#ifdef _WIN32
+		localtime_s(&local_time, &second);
+#else
+		localtime_r(&second, &local_time);
+#endif
+		char time_buffer[80];
+		strftime(time_buffer, sizeof(time_buffer), "[%c] ", &local_time);
+		cached_time = time_buffer;
+		cached_second = second;
+	}
+	buffer += cached_time;
+	const LogFormat& log_format = log_formats[entry.id];
+	buffer += level_prefix(log_format.level);
+	unsigned int arg = 0;
+	unsigned int text_offset = 0;
+	for (const char* c = log_format.format; *c; ++c) {
+		if (*c != '%' || c[1] == 0) {
+			buffer += *c;
+			continue;
+		}
+		// %[0][width](u|d|x|s)
+		char spec[8] = { '%' };
+		unsigned int spec_size = 1;
+		++c;
+		while (*c >= '0' && *c <= '9' && spec_size < 4) {
+			spec[spec_size++] = *c++;
+		}
+		char conversion = *c;
+		if (conversion == 0) {
+			break;
+		}
+		char formatted[32];
+		if (conversion == 's') {
+			if (text_offset < entry.text_size) {
+				const char* text = entry.text + text_offset;
+				buffer += text;
+				text_offset += (unsigned int)std::strlen(text) + 1;
+			}
+			continue;
+		}
+		long long value = arg < entry.arg_count ? entry.args[arg] : 0;
+		++arg;
+		if (conversion == 'd') {
+			spec[spec_size++] = 'l';
+			spec[spec_size++] = 'l';
+			spec[spec_size++] = 'd';
+			std::snprintf(formatted, sizeof(formatted), spec, value);
+		}
+		else {
+			spec[spec_size++] = 'l';
+			spec[spec_size++] = 'l';
+			spec[spec_size++] = conversion == 'x' ? 'x' : 'u';
+			std::snprintf(formatted, sizeof(formatted), spec, (unsigned long long)value);
+		}
+		buffer += formatted;
+	}
+	buffer += '\n';
+}
+
+bool Logger::queued() const {
+	return entries[dequeue_position % capacity].sequence.load(std::memory_order_seq_cst) == dequeue_position + 1 || dropped.load(std::memory_order_relaxed) > 0;
+}
+
+bool Logger::drain(std::string& buffer) {
+	static thread_local std::time_t cached_second = 0;
+	static thread_local std::string cached_time;
+	bool any = false;
+	while (true) {
+		Entry& entry = entries[dequeue_position % capacity];
+		if (entry.sequence.load(std::memory_order_acquire) != dequeue_position + 1) {
+			break;
+		}
+		format(entry, buffer, cached_second, cached_time);
+		entry.sequence.store(dequeue_position + capacity, std::memory_order_release);
+		++dequeue_position;
+		any = true;
+	}
+	std::uint64_t lost = dropped.exchange(0, std::memory_order_relaxed);
+	if (lost > 0) {
+		Entry entry;
+		entry.time = std::chrono::system_clock::now();
+		entry.id = LOG_DROPPED;
+		entry.arg_count = 1;
+		entry.text_size = 0;
+		entry.args[0] = (std::int64_t)lost;
+		format(entry, buffer, cached_second, cached_time);
+		any = true;
+	}
+	return any;
+}
+
+void Logger::rotate() {
+	file.close();
+	std::string old_path = path + ".1";
+	// rename doesn't replace an existing file on Windows
+	std::remove(old_path.c_str());
+	std::rename(path.c_str(), old_path.c_str());
+	file.open(path, std::ios::app | std::ios::binary);
+	file_size = 0;
+}
+
+void Logger::writer_loop() {
+	std::string buffer;
+	buffer.reserve(64 * 1024);
+	while (true) {
+		bool stop;
+		writer_idle.store(true, std::memory_order_seq_cst);
+		if (queued()) {
+			writer_idle.store(false, std::memory_order_relaxed);
+		}
+		{
+			// sleeps until the next entry, what was logged meanwhile is written in one batch
+			std::unique_lock<std::mutex> lock(wake_mutex);
+			wake.wait(lock, [this] { return stopping || !writer_idle.load(std::memory_order_relaxed); });
+			stop = stopping;
+		}
+		buffer.clear();
+		if (drain(buffer)) {
+			if (file_size + buffer.size() > max_size.load(std::memory_order_relaxed) && file_size > 0) {
+				rotate();
+			}
+			file.write(buffer.data(), buffer.size());
+			file.flush();
+			file_size += buffer.size();
+		}
+		if (stop) {
+			return;
+		}
+	}
+}
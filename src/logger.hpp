@@ -0,0 +1,260 @@
+#pragma once
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <fstream>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <type_traits>
+
+enum LogLevel : unsigned char {
+	LOG_DEBUG,
+	LOG_INFO,
+	LOG_WARNING,
+	LOG_ERROR
+};
+
+// Every message the driver logs, the text lives in log_formats so an entry only carries the id
+enum LogMessageId : unsigned short {
+	LOG_DROPPED,
+	LOG_EPOLL_FAILED,
+	LOG_HOTPLUG_SUBSCRIBE_FAILED,
+	LOG_OPEN_FAILED,
+	LOG_READ_FAILED,
+	LOG_WAIT_FAILED,
+	LOG_INPUT_BUFFERS_FAILED,
+	LOG_OUT_OF_MEMORY,
+	LOG_STATE_CACHE_MAP_FAILED,
+	LOG_STATE_CACHE_RESET,
+	LOG_JOURNAL_MAP_FAILED,
+	LOG_JOURNAL_RESET,
+	LOG_MQTT_CREATE_FAILED,
+	LOG_MQTT_CONNECT_FAILED,
+	LOG_MQTT_QUEUE_FULL,
+	LOG_MQTT_PUBLISH_FAILED,
+	LOG_MQTT_CONNECTED,
+	LOG_MQTT_DISCONNECTED,
+	LOG_MQTT_SPOOL_MAP_FAILED,
+	LOG_MQTT_SPOOL_RESET,
+	LOG_MQTT_SPOOL_LOADED,
+	LOG_MQTT_SPOOL_FULL,
+	LOG_LOCAL_SOCKET_FAILED,
+	LOG_LOCAL_SUBSCRIBER,
+	LOG_LOCAL_SUBSCRIBER_CLOSED,
+	LOG_LOCAL_SUBSCRIBERS_FULL,
+	LOG_LOCAL_SUBSCRIBER_LAGGING,
+	LOG_LOCAL_QUEUE_FULL,
+	LOG_WRITE_FAILED,
+	LOG_REQUESTS_FULL,
+	LOG_WAITING_ON_RECEIVER,
+	LOG_RECEIVER_OPENED,
+	LOG_SERIAL_FAILED,
+	LOG_NOTIFICATIONS_FAILED,
+	LOG_DEVICE_INFO_FAILED,
+	LOG_DEVICE_NAME_FAILED,
+	LOG_DEVICE_STATUS,
+	LOG_DEVICE_PROBED,
+	LOG_DEVICE_UNSTABLE,
+	LOG_DEVICE_STABLE,
+	LOG_DEVICE_BATTERY,
+	LOG_BATTERY_FEATURE,
+	LOG_BATTERY_UNSUPPORTED,
+	LOG_BATTERY_UNREACHABLE,
+	LOG_POWERSAVE_WINDOW,
+	LOG_STARTUP_STAGE,
+	LOG_STARTUP_STAGE_LATE,
+	LOG_STARTUP_READY,
+	LOG_RELOAD_UNCHANGED,
+	LOG_RELOAD,
+	LOG_SIMULATION_EVENTS,
+	LOG_SIMULATION_MALFORMED,
+	LOG_SIMULATION_INPUT,
+	LOG_SIMULATION_MISMATCH,
+	LOG_SIMULATION_BATTERY_MISMATCH,
+	LOG_SIMULATION_CHECKED,
+	LOG_SIMULATION_UNCHECKED,
+	LOG_SIMULATION_RATE,
+	LOG_SIMULATION_LATENCY
+};
+
+struct LogFormat {
+	LogMessageId id;
+	LogLevel level;
+	// %u %d %x (with an optional 0 padded width) take the integer arguments in order,
+	// %s takes the string arguments in order
+	const char* format;
+};
+
+constexpr LogFormat log_formats[] = {
+	{ LOG_DROPPED, LOG_WARNING, "log queue full, dropped %u entries" },
+	{ LOG_EPOLL_FAILED, LOG_ERROR, "failed to create epoll set: %d" },
+	{ LOG_HOTPLUG_SUBSCRIBE_FAILED, LOG_ERROR, "failed to subscribe to hotplug events: %d" },
+	{ LOG_OPEN_FAILED, LOG_ERROR, "failed to open %s with error: %d" },
+	{ LOG_READ_FAILED, LOG_ERROR, "failed to read receiver with error: %d" },
+	{ LOG_WAIT_FAILED, LOG_ERROR, "failed to wait on receivers with error: %d" },
+	{ LOG_INPUT_BUFFERS_FAILED, LOG_WARNING, "failed to raise the input buffers of %s with error: %d" },
+	{ LOG_OUT_OF_MEMORY, LOG_ERROR, "null malloc" },
+	{ LOG_STATE_CACHE_MAP_FAILED, LOG_WARNING, "failed to map state cache %s" },
+	{ LOG_STATE_CACHE_RESET, LOG_INFO, "state cache has a different version or is damaged, starting empty" },
+	{ LOG_JOURNAL_MAP_FAILED, LOG_WARNING, "failed to map transition journal %s" },
+	{ LOG_JOURNAL_RESET, LOG_INFO, "transition journal %s has a different version or is damaged, starting it empty" },
+	{ LOG_MQTT_CREATE_FAILED, LOG_ERROR, "Failed to create MQTT client: %d" },
+	{ LOG_MQTT_CONNECT_FAILED, LOG_ERROR, "Failed to connect to MQTT server: %d, %u attempts so far" },
+	{ LOG_MQTT_QUEUE_FULL, LOG_WARNING, "MQTT queue full, dropped %u messages, most waiting: %u" },
+	{ LOG_MQTT_PUBLISH_FAILED, LOG_ERROR, "Failed to publish %u MQTT messages: %d" },
+	{ LOG_MQTT_CONNECTED, LOG_INFO, "connected to MQTT server, %u spooled messages left" },
+	{ LOG_MQTT_DISCONNECTED, LOG_WARNING, "lost connection to MQTT server, spooling messages until it is back" },
+	{ LOG_MQTT_SPOOL_MAP_FAILED, LOG_WARNING, "failed to map MQTT spool %s" },
+	{ LOG_MQTT_SPOOL_RESET, LOG_INFO, "MQTT spool has a different version or is damaged, starting empty" },
+	{ LOG_MQTT_SPOOL_LOADED, LOG_INFO, "%u MQTT messages spooled before the restart will be sent" },
+	{ LOG_MQTT_SPOOL_FULL, LOG_WARNING, "MQTT spool full or unavailable, dropped %u messages" },
+	{ LOG_LOCAL_SOCKET_FAILED, LOG_ERROR, "failed to create local socket %s: %d" },
+	{ LOG_LOCAL_SUBSCRIBER, LOG_DEBUG, "local subscriber connected, %u connected" },
+	{ LOG_LOCAL_SUBSCRIBER_CLOSED, LOG_DEBUG, "local subscriber left, %u connected" },
+	{ LOG_LOCAL_SUBSCRIBERS_FULL, LOG_WARNING, "refused a local subscriber, %u are connected already" },
+	{ LOG_LOCAL_SUBSCRIBER_LAGGING, LOG_WARNING, "local subscriber fell behind, it gets the state again once it catches up" },
+	{ LOG_LOCAL_QUEUE_FULL, LOG_WARNING, "local event queue full, dropped %u events" },
+	{ LOG_WRITE_FAILED, LOG_WARNING, "receiver %08x: failed to write the %s request for device %u" },
+	{ LOG_REQUESTS_FULL, LOG_WARNING, "receiver %08x: too many requests waiting, dropped the %s request for device %u" },
+	{ LOG_WAITING_ON_RECEIVER, LOG_INFO, "waiting on receiver" },
+	{ LOG_RECEIVER_OPENED, LOG_INFO, "opened receiver %08x" },
+	{ LOG_SERIAL_FAILED, LOG_WARNING, "failed to get receiver serial" },
+	{ LOG_NOTIFICATIONS_FAILED, LOG_WARNING, "failed to confirm enabled notifications" },
+	{ LOG_DEVICE_INFO_FAILED, LOG_WARNING, "failed to get pairing info for device: %u" },
+	{ LOG_DEVICE_NAME_FAILED, LOG_WARNING, "failed to find name for device: %u" },
+	{ LOG_DEVICE_STATUS, LOG_DEBUG, "receiver %08x device %u is %s" },
+	{ LOG_DEVICE_PROBED, LOG_DEBUG, "receiver %08x device %u answered the startup ping with HID++ %u.%u" },
+	{ LOG_DEVICE_UNSTABLE, LOG_WARNING, "receiver %08x device %u is flapping, it is published as unstable until it settles" },
+	{ LOG_DEVICE_STABLE, LOG_INFO, "receiver %08x device %u settled, %u status changes were held back" },
+	{ LOG_DEVICE_BATTERY, LOG_DEBUG, "receiver %08x device %u battery at %u percent%s" },
+	{ LOG_BATTERY_FEATURE, LOG_INFO, "receiver %08x device %u has battery feature %04x at index %u" },
+	{ LOG_BATTERY_UNSUPPORTED, LOG_INFO, "receiver %08x device %u doesn't report its battery" },
+	{ LOG_BATTERY_UNREACHABLE, LOG_DEBUG, "receiver %08x device %u didn't answer the battery query, retrying in %us" },
+	{ LOG_POWERSAVE_WINDOW, LOG_INFO, "powersave window for %04x: %ums" },
+	{ LOG_STARTUP_STAGE, LOG_DEBUG, "startup stage %s done after %u ms" },
+	{ LOG_STARTUP_STAGE_LATE, LOG_WARNING, "startup stage %s hasn't finished after %u ms" },
+	{ LOG_STARTUP_READY, LOG_INFO, "ready after %u ms, the slowest stage was %s" },
+	{ LOG_RELOAD_UNCHANGED, LOG_INFO, "reloaded config, nothing changed" },
+	{ LOG_RELOAD, LOG_INFO, "reloaded config%s%s" },
+	{ LOG_SIMULATION_EVENTS, LOG_INFO, "simulation delivered %u reports, generated %u connects, %u disconnects, %u powersaves" },
+	{ LOG_SIMULATION_MALFORMED, LOG_INFO, "simulation mixed in %u malformed reports" },
+	{ LOG_SIMULATION_INPUT, LOG_INFO, "simulation dropped %u reports from full input buffers, read waited %u times for %u reports" },
+	{ LOG_SIMULATION_MISMATCH, LOG_WARNING, "receiver %08x device %u is %s, the simulation expected %s" },
+	{ LOG_SIMULATION_BATTERY_MISMATCH, LOG_WARNING, "receiver %08x device %u battery is at %u percent, the simulation didn't report that" },
+	{ LOG_SIMULATION_CHECKED, LOG_INFO, "checked %u settled simulated devices, %u didn't match" },
+	{ LOG_SIMULATION_UNCHECKED, LOG_WARNING, "only %u of %u simulated devices could be checked" },
+	{ LOG_SIMULATION_RATE, LOG_INFO, "simulation ran for %u ms, %u status changes and %u reports per second" },
+	{ LOG_SIMULATION_LATENCY, LOG_INFO, "simulation %s latency p50 %uus p90 %uus p99 %uus" }
+};
+
+constexpr bool log_formats_ordered() {
+	for (size_t i = 0; i < sizeof(log_formats) / sizeof(log_formats[0]); ++i) {
+		if (log_formats[i].id != i) {
+			return false;
+		}
+	}
+	return true;
+}
+static_assert(log_formats_ordered(), "log_formats has to be indexed by LogMessageId");
+
+// Parses debug, info, warning or error, anything else is info
+LogLevel parse_log_level(const std::string& level);
+
+// Logging costs a level check and a few stores into a lock free ring,
+// a background thread formats the entries and writes them in batches
+// the file is rotated to <path>.1 once it grows past the size limit
+// safe to call log from any thread
+class Logger {
+	static const unsigned int max_args = 4;
+	static const unsigned int max_text = 47;
+
+	struct Entry {
+		// Vyukov bounded queue sequence, tells producers and the consumer whose turn the entry is
+		std::atomic<std::uint64_t> sequence;
+		std::chrono::system_clock::time_point time;
+		LogMessageId id;
+		unsigned char arg_count;
+		unsigned char text_size;
+		std::int64_t args[max_args];
+		// string arguments one after another, each null terminated
+		char text[max_text + 1];
+	};
+
+	static const unsigned int capacity = 1024;
+	Entry* entries;
+	alignas(64) std::atomic<std::uint64_t> enqueue_position = 0;
+	alignas(64) std::uint64_t dequeue_position = 0;
+	std::atomic<std::uint64_t> dropped = 0;
+	std::atomic<unsigned char> level = LOG_INFO;
+	std::atomic<size_t> max_size;
+
+	std::string path;
+	std::ofstream file;
+	size_t file_size = 0;
+
+	std::thread thread;
+	std::mutex wake_mutex;
+	std::condition_variable wake;
+	bool stopping = false;
+	// set by the writer once it found the ring empty, the first entry committed after that wakes it
+	// so an idle writer costs nothing and a busy one isn't woken for every entry
+	std::atomic<bool> writer_idle = false;
+
+	Entry* claim();
+	void commit(Entry* entry);
+	static void add_text(Entry* entry, const char* text, size_t size);
+	template <typename T>
+	static void add_arg(Entry* entry, const T& value) {
+		if constexpr (std::is_convertible_v<const T&, const char*>) {
+			const char* text = value;
+			add_text(entry, text, std::char_traits<char>::length(text));
+		}
+		else if constexpr (std::is_same_v<T, std::string> || std::is_same_v<T, std::string_view>) {
+			add_text(entry, value.data(), value.size());
+		}
+		else {
+			static_assert(std::is_integral_v<T> || std::is_enum_v<T>, "log arguments are integers or strings");
+			if (entry->arg_count < max_args) {
+				entry->args[entry->arg_count++] = (std::int64_t)value;
+			}
+		}
+	}
+	void writer_loop();
+	// formats everything queued, returns false if nothing was
+	bool drain(std::string& buffer);
+	bool queued() const;
+	void format(const Entry& entry, std::string& buffer, std::time_t& cached_second, std::string& cached_time);
+	void rotate();
+
+public:
+	Logger();
+	~Logger();
+	// appends to path, entries logged before are written once it is open
+	bool open(const std::string& path, LogLevel level, size_t max_size);
+	// writes everything queued and stops the writer thread
+	void close();
+	void set_level(LogLevel new_level) { level.store(new_level, std::memory_order_relaxed); }
+	void set_max_size(size_t new_max_size) { max_size.store(new_max_size, std::memory_order_relaxed); }
+
+	// integer arguments fill %u %d %x in order, string arguments fill %s in order,
+	// strings are copied, together they are truncated to 47 characters
+	template <typename... Args>
+	void log(LogMessageId id, const Args&... args) {
+		if (log_formats[id].level < level.load(std::memory_order_relaxed)) {
+			return;
+		}
+		Entry* entry = claim();
+		if (entry == nullptr) {
+			return;
+		}
+		entry->time = std::chrono::system_clock::now();
+		entry->id = id;
+		entry->arg_count = 0;
+		entry->text_size = 0;
+		(add_arg(entry, args), ...);
+		commit(entry);
+	}
+};
@@ -1,4 +1,6 @@
 #include "main.hpp"
+#include <algorithm>
+#include <cstring>
 #include <string>
 #include <thread>
 
@@ -18,10 +20,14 @@ LRESULT CALLBACK WndProc(HWND hWnd, UINT uMsg, WPARAM wParam, LPARAM lParam){
 				info.cbSize = sizeof(info);
 				info.fMask = MIIM_ID | MIIM_TYPE | MIIM_DATA;
 				std::string title;
-				for (int i = 0; i < driver->devices_info.size(); ++i) {
-					if (driver->devices_info[i].name != "") {
+				// a copy, the driver thread keeps changing its devices while the menu is open
+				StateSnapshot state = driver->snapshot();
+				for (unsigned int i = 0; i < state.count; ++i) {
+					if (state.devices[i].name[0] != 0) {
 						info.wID = 40000 + i;
-						title = driver->devices_info[i].name + " - " + driver->status_to_string.at(driver->devices_info[i].status);
+						title = state.devices[i].name;
+						title += " - ";
+						title += device_status_name(state.devices[i].status);
 						info.dwTypeData = (LPSTR)title.c_str();
 						info.cch = title.length();
 						InsertMenuItemA(popup, i, TRUE, &info);
@@ -32,16 +38,28 @@ LRESULT CALLBACK WndProc(HWND hWnd, UINT uMsg, WPARAM wParam, LPARAM lParam){
 				return true; 
 			}
 			break;
+		case WM_USER_STATE_CHANGED: {
+			// several changes can be posted before this runs, the latest snapshot covers them all
+			StateSnapshot state = driver->snapshot();
+			unsigned int connected = 0;
+			for (unsigned int i = 0; i < state.count; ++i) {
+				connected += state.devices[i].status == CONNECTED;
+			}
+			std::string tip = "Logitech Unify MQTT - " + std::to_string(connected) + " of " + std::to_string(state.count) + " connected";
+			size_t length = std::min(tip.length(), sizeof(nid.szTip) - 1);
+			std::memcpy(nid.szTip, tip.c_str(), length);
+			nid.szTip[length] = 0;
+			Shell_NotifyIconA(NIM_MODIFY, &nid);
+			break;
+		}
 		case WM_COMMAND:
 			wmId    = LOWORD(wParam);
 			wmEvent = HIWORD(wParam);
 			switch (wmId) {
 				case ID_RELOAD:
-					// driver will exit,
-					// then the thread loop will set quit to false,
-					// then run the driver again
-					driver->quit = true;
-					CancelSynchronousIo(driver_win_thread);
+					// the driver rereads the config and only applies what changed,
+					// receivers, devices and the MQTT session are kept
+					driver->reload();
 					break;
 				case ID_EXIT:
 					Shell_NotifyIconA(NIM_DELETE, &nid);
@@ -62,16 +80,7 @@ LRESULT CALLBACK WndProc(HWND hWnd, UINT uMsg, WPARAM wParam, LPARAM lParam){
 
 int WINAPI wWinMain(HINSTANCE hInstance, HINSTANCE hPrevInstance, PWSTR pCmdLine, int nCmdShow) {
 	instance = hInstance;
-	std::thread driver_thread([&]() {
-		// Get the windows handle of the driver thread,
-		// this allows the main thread to cancel pending io operations
-		DuplicateHandle(GetCurrentProcess(), GetCurrentThread(), GetCurrentProcess(), &driver_win_thread, NULL, FALSE, DUPLICATE_CLOSE_SOURCE | DUPLICATE_SAME_ACCESS);
-		while (!stop_thread) {
-			driver = new UnifyStatus();
-			driver->run();
-			delete driver;
-		}
-		});
+	driver = new UnifyStatus();
 
 	const std::string tooltip = "Logitech Unify MQTT";
 	WNDCLASSA wc{};
@@ -93,19 +102,25 @@ int WINAPI wWinMain(HINSTANCE hInstance, HINSTANCE hPrevInstance, PWSTR pCmdLine
 	std::memcpy(nid.szTip, tooltip.c_str(), tooltip.length());
 	Shell_NotifyIconA(NIM_ADD, &nid);
 
+	// the window has to exist before the driver can post to it
+	driver->set_state_handler([hWnd]() {
+		PostMessageA(hWnd, WM_USER_STATE_CHANGED, 0, 0);
+		});
+	std::thread driver_thread([&]() {
+		driver->run();
+		});
+
+	// blocks until a message arrives, state changes are posted by the driver thread
 	MSG msg{};
 	while (GetMessage(&msg, NULL, 0, 0)) {
 		TranslateMessage(&msg);
 		DispatchMessage(&msg);
-
-		std::this_thread::sleep_for(std::chrono::milliseconds(100));
 	}
 	
-	stop_thread = true;
-	driver->quit = true;
-	// cancel any pending reads
-	CancelSynchronousIo(driver_win_thread);
+	// wakes the driver out of any pending reads
+	driver->stop();
 	driver_thread.join();
+	delete driver;
 	DestroyIcon(icon);
 	DestroyWindow(hWnd);
 	UnregisterClassA(tooltip.c_str(), hInstance);
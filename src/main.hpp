@@ -4,6 +4,8 @@
 #include "unify_status.hpp"
 
 #define WM_USER_SHELLICON WM_USER + 1
+// posted by the driver thread when a new state snapshot was published
+#define WM_USER_STATE_CHANGED WM_USER + 2
 
 HMENU hPopMenu;
 
@@ -11,7 +13,3 @@ HINSTANCE instance;
 NOTIFYICONDATAA nid{};
 
 UnifyStatus* driver;
-
-bool stop_thread = false;
-
-HANDLE driver_win_thread;
@@ -0,0 +1,142 @@
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <chrono>
+#include <csignal>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <iostream>
+#include <thread>
+#include <pthread.h>
+#include "unify_status.hpp"
+
+static void print_usage(const char* program) {
+	std::cerr << "usage: " << program << " [options]\n"
+		<< "  --capture FILE       record every report to FILE\n"
+		<< "  --replay FILE        read a capture instead of the receivers\n"
+		<< "  --replay-speed X     replay X times as fast, 0 for as fast as possible\n"
+		<< "  --simulate N         read N simulated receivers with 6 devices each\n"
+		<< "  --rate X             status changes per simulated device per second\n"
+		<< "  --malformed X        malformed reports per simulated receiver per second\n"
+		<< "  --seed N             seed of the simulation\n"
+		<< "  --duration SECONDS   exit after SECONDS, with a simulation the exit code\n"
+		<< "                       is 1 if a simulated device ended in the wrong state,\n"
+		<< "                       the run ends once every simulated device settled\n";
+}
+
+// one line per device, read from the snapshot so the driver thread isn't held up
+static void print_state(StateSnapshot const& state) {
+	std::printf("state %llu%s, %u devices\n", state.version, state.ready ? "" : " (starting)", state.count);
+	for (unsigned int i = 0; i < state.count; ++i) {
+		DeviceSnapshot const& device = state.devices[i];
+		std::printf("%08x %u %-14s %.*s", device.receiver_serial, device.slot, device.name, (int)device_status_name(device.status).size(), device_status_name(device.status).data());
+		if (device.battery_level >= 0) {
+			std::printf(" %d%%%s", device.battery_level, device.battery_charging ? " charging" : "");
+		}
+		std::printf("\n");
+	}
+	std::fflush(stdout);
+}
+
+// throughput and where the time went from report to publish, percentiles are bucket upper bounds
+static void print_simulation(SimulationSummary const& summary) {
+	double seconds = std::max<long long>(1, summary.elapsed.count()) / 1000.0;
+	unsigned long long changes = summary.stats.connects + summary.stats.disconnects + summary.stats.powersaves;
+	std::printf("simulation ran for %.1f s: %.1f status changes/s, %.1f reports/s\n", seconds, changes / seconds, summary.stats.reports / seconds);
+	std::printf("%-8s %10s %10s %10s %10s %10s\n", "stage", "n", "p50 us", "p90 us", "p99 us", "max us");
+	for (unsigned int stage = 0; stage < stage_count; ++stage) {
+		LatencyHistogram::Snapshot const& snapshot = summary.stages[stage];
+		std::printf("%-8s %10llu %10llu %10llu %10llu %10llu\n", metrics_stage_names[stage], snapshot.count,
+			snapshot.percentile_us(0.5), snapshot.percentile_us(0.9), snapshot.percentile_us(0.99), snapshot.max_us);
+	}
+	std::printf("checked %u simulated devices, %u didn't match\n", summary.checked, summary.mismatches);
+	std::fflush(stdout);
+}
+
+// Headless daemon for Linux
+// SIGHUP reloads the config, SIGUSR1 prints the devices, SIGINT and SIGTERM exit
+int main(int argc, char** argv) {
+	UnifyOptions options;
+	unsigned long duration = 0;
+	for (int i = 1; i < argc; ++i) {
+		const char* value = i + 1 < argc ? argv[i + 1] : nullptr;
+		if (value == nullptr) {
+			print_usage(argv[0]);
+			return 2;
+		}
+		if (std::strcmp(argv[i], "--capture") == 0) {
+			options.capture_path = value;
+		}
+		else if (std::strcmp(argv[i], "--replay") == 0) {
+			options.simulation.replay_path = value;
+		}
+		else if (std::strcmp(argv[i], "--replay-speed") == 0) {
+			options.simulation.replay_speed = std::strtod(value, nullptr);
+		}
+		else if (std::strcmp(argv[i], "--simulate") == 0) {
+			options.simulation.receivers = std::strtoul(value, nullptr, 10);
+		}
+		else if (std::strcmp(argv[i], "--rate") == 0) {
+			options.simulation.events_per_second = std::strtod(value, nullptr);
+		}
+		else if (std::strcmp(argv[i], "--malformed") == 0) {
+			options.simulation.malformed_per_second = std::strtod(value, nullptr);
+		}
+		else if (std::strcmp(argv[i], "--seed") == 0) {
+			options.simulation.seed = std::strtoul(value, nullptr, 10);
+		}
+		else if (std::strcmp(argv[i], "--duration") == 0) {
+			duration = std::strtoul(value, nullptr, 10);
+		}
+		else {
+			print_usage(argv[0]);
+			return 2;
+		}
+		++i;
+	}
+
+	// block the signals in every thread so only sigwait below receives them
+	sigset_t signals;
+	sigemptyset(&signals);
+	sigaddset(&signals, SIGINT);
+	sigaddset(&signals, SIGTERM);
+	sigaddset(&signals, SIGHUP);
+	sigaddset(&signals, SIGUSR1);
+	pthread_sigmask(SIG_BLOCK, &signals, NULL);
+
+	UnifyStatus driver(options);
+	std::thread driver_thread([&]() {
+		driver.run();
+		});
+
+	std::chrono::steady_clock::time_point end = std::chrono::steady_clock::now() + std::chrono::seconds(duration);
+	int signal = 0;
+	while (signal != SIGINT && signal != SIGTERM) {
+		if (duration > 0) {
+			auto remaining = std::chrono::duration_cast<std::chrono::nanoseconds>(end - std::chrono::steady_clock::now()).count();
+			timespec timeout{ (time_t)(remaining > 0 ? remaining / 1000000000 : 0), (long)(remaining > 0 ? remaining % 1000000000 : 0) };
+			signal = sigtimedwait(&signals, nullptr, &timeout);
+			// the duration passed
+			if (signal < 0 && errno == EAGAIN) {
+				break;
+			}
+		}
+		else {
+			sigwait(&signals, &signal);
+		}
+		if (signal == SIGHUP) {
+			// only what changed in the config is applied, device state is kept
+			driver.reload();
+		}
+		else if (signal == SIGUSR1) {
+			print_state(driver.snapshot());
+		}
+	}
+	driver.stop();
+	driver_thread.join();
+	if (options.simulation.enabled()) {
+		print_simulation(driver.simulation_result());
+	}
+	return driver.mismatched_devices() > 0 ? 1 : 0;
+}
@@ -0,0 +1,110 @@
+#include "mapped_file.hpp"
+#ifndef _WIN32
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+MappedFile::~MappedFile() {
+	close();
+}
+
+#ifdef _WIN32
+bool MappedFile::open(const std::string& path, size_t size, bool& resized) {
+	close();
+	file = CreateFileA(path.c_str(), GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ, NULL, OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (file == INVALID_HANDLE_VALUE) {
+		return false;
+	}
+	LARGE_INTEGER current_size;
+	resized = !GetFileSizeEx(file, &current_size) || (size_t)current_size.QuadPart != size;
+	// the mapping extends the file, but never shrinks it
+	if (resized) {
+		LARGE_INTEGER new_size;
+		new_size.QuadPart = size;
+		if (!SetFilePointerEx(file, new_size, NULL, FILE_BEGIN) || !SetEndOfFile(file)) {
+			close();
+			return false;
+		}
+	}
+	mapping = CreateFileMappingA(file, NULL, PAGE_READWRITE, 0, (DWORD)size, NULL);
+	if (mapping == NULL) {
+		close();
+		return false;
+	}
+	view = (unsigned char*)MapViewOfFile(mapping, FILE_MAP_ALL_ACCESS, 0, 0, size);
+	if (view == nullptr) {
+		close();
+		return false;
+	}
+	view_size = size;
+	return true;
+}
+
+void MappedFile::close() {
+	if (view != nullptr) {
+		UnmapViewOfFile(view);
+		view = nullptr;
+	}
+	if (mapping != NULL) {
+		CloseHandle(mapping);
+		mapping = NULL;
+	}
+	if (file != INVALID_HANDLE_VALUE) {
+		CloseHandle(file);
+		file = INVALID_HANDLE_VALUE;
+	}
+	view_size = 0;
+}
+
+void MappedFile::flush(size_t offset, size_t length) {
+	if (view != nullptr) {
+		FlushViewOfFile(view + offset, length);
+	}
+}
+#else
+bool MappedFile::open(const std::string& path, size_t size, bool& resized) {
+	close();
+	fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+	if (fd < 0) {
+		return false;
+	}
+	struct stat file_stat;
+	resized = fstat(fd, &file_stat) != 0 || (size_t)file_stat.st_size != size;
+	if (resized && ftruncate(fd, size) != 0) {
+		close();
+		return false;
+	}
+	void* mapped = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (mapped == MAP_FAILED) {
+		close();
+		return false;
+	}
+	view = (unsigned char*)mapped;
+	view_size = size;
+	return true;
+}
+
+void MappedFile::close() {
+	if (view != nullptr) {
+		munmap(view, view_size);
+		view = nullptr;
+	}
+	if (fd >= 0) {
+		::close(fd);
+		fd = -1;
+	}
+	view_size = 0;
+}
+
+void MappedFile::flush(size_t offset, size_t length) {
+	if (view == nullptr) {
+		return;
+	}
+	// msync needs a page aligned start
+	size_t page_size = (size_t)sysconf(_SC_PAGESIZE);
+	size_t start = offset - offset % page_size;
+	msync(view + start, length + offset - start, MS_ASYNC);
+}
+#endif
@@ -0,0 +1,45 @@
+#pragma once
+#include <string>
+#include <cstddef>
+#include <cstdint>
+#ifdef _WIN32
+#include <windows.h>
+#endif
+
+// A file mapped read/write into memory, writes reach the file through the page cache
+// so they survive the process crashing without any explicit write calls
+// they aren't safe from a power loss, flush doesn't wait and the kernel writes pages back in any order
+class MappedFile {
+#ifdef _WIN32
+	HANDLE file = INVALID_HANDLE_VALUE;
+	HANDLE mapping = NULL;
+#else
+	int fd = -1;
+#endif
+	unsigned char* view = nullptr;
+	size_t view_size = 0;
+
+public:
+	MappedFile() {}
+	MappedFile(const MappedFile&) = delete;
+	MappedFile& operator=(const MappedFile&) = delete;
+	~MappedFile();
+	// creates the file if needed and resizes it to size, resized is set if its size changed
+	bool open(const std::string& path, size_t size, bool& resized);
+	void close();
+	bool is_open() const { return view != nullptr; }
+	unsigned char* data() { return view; }
+	size_t size() const { return view_size; }
+	// starts writing a range back to disk without waiting for it, so it stays off the event path
+	void flush(size_t offset, size_t length);
+};
+
+// FNV-1a, what the mapped files check their headers and records with
+// pass the previous result as seed to hash several ranges as one
+inline std::uint32_t fnv1a(const void* data, size_t size, std::uint32_t seed = 2166136261u) {
+	const unsigned char* bytes = (const unsigned char*)data;
+	for (size_t i = 0; i < size; ++i) {
+		seed = (seed ^ bytes[i]) * 16777619u;
+	}
+	return seed;
+}
@@ -0,0 +1,62 @@
+#include "metrics.hpp"
+#include <algorithm>
+#include <bit>
+
+void LatencyHistogram::record(std::chrono::steady_clock::duration elapsed) {
+	long long elapsed_us = std::chrono::duration_cast<std::chrono::microseconds>(elapsed).count();
+	unsigned long long us = elapsed_us > 0 ? (unsigned long long)elapsed_us : 0;
+	unsigned int bucket = (unsigned int)std::bit_width(us);
+	if (bucket >= bucket_count) {
+		bucket = bucket_count - 1;
+	}
+	buckets[bucket].fetch_add(1, std::memory_order_relaxed);
+	count.fetch_add(1, std::memory_order_relaxed);
+	sum_us.fetch_add(us, std::memory_order_relaxed);
+	unsigned long long current_max = max_us.load(std::memory_order_relaxed);
+	while (us > current_max && !max_us.compare_exchange_weak(current_max, us, std::memory_order_relaxed)) {
+	}
+}
+
+LatencyHistogram::Snapshot LatencyHistogram::take() {
+	Snapshot snapshot;
+	for (unsigned int i = 0; i < bucket_count; ++i) {
+		snapshot.buckets[i] = buckets[i].exchange(0, std::memory_order_relaxed);
+	}
+	snapshot.count = count.exchange(0, std::memory_order_relaxed);
+	snapshot.sum_us = sum_us.exchange(0, std::memory_order_relaxed);
+	snapshot.max_us = max_us.exchange(0, std::memory_order_relaxed);
+	return snapshot;
+}
+
+unsigned long long LatencyHistogram::Snapshot::percentile_us(double percentile) const {
+	unsigned long long total = 0;
+	for (unsigned int i = 0; i < bucket_count; ++i) {
+		total += buckets[i];
+	}
+	if (total == 0) {
+		return 0;
+	}
+	unsigned long long rank = (unsigned long long)(percentile * total);
+	if (rank >= total) {
+		rank = total - 1;
+	}
+	unsigned long long seen = 0;
+	for (unsigned int i = 0; i < bucket_count; ++i) {
+		seen += buckets[i];
+		if (seen > rank) {
+			// the max is a tighter bound for the highest bucket with samples
+			unsigned long long upper = i == 0 ? 0 : (1ull << i) - 1;
+			return upper < max_us ? upper : max_us;
+		}
+	}
+	return max_us;
+}
+
+void LatencyHistogram::Snapshot::add(Snapshot const& other) {
+	for (unsigned int i = 0; i < bucket_count; ++i) {
+		buckets[i] += other.buckets[i];
+	}
+	count += other.count;
+	sum_us += other.sum_us;
+	max_us = std::max(max_us, other.max_us);
+}
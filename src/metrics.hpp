@@ -0,0 +1,113 @@
+#pragma once
+#include <atomic>
+#include <chrono>
+
+// Counts durations into power of two microsecond buckets,
+// recording is a few relaxed atomic adds so it can sit on the hot path of any thread
+class LatencyHistogram {
+public:
+	// bucket 0 holds 0us, bucket i holds [2^(i-1), 2^i) us, the last one everything longer
+	static const unsigned int bucket_count = 32;
+
+	struct Snapshot {
+		unsigned long long count = 0;
+		unsigned long long sum_us = 0;
+		unsigned long long max_us = 0;
+		unsigned long long buckets[bucket_count] = {};
+		// upper bound of the bucket holding the percentile, 0 without samples
+		unsigned long long percentile_us(double percentile) const;
+		// adds the samples of a later snapshot
+		void add(Snapshot const& other);
+	};
+
+	void record(std::chrono::steady_clock::duration elapsed);
+	// what was recorded since the last take, samples recorded meanwhile land in one of the two
+	Snapshot take();
+
+private:
+	std::atomic<unsigned long long> buckets[bucket_count] = {};
+	std::atomic<unsigned long long> count = 0;
+	std::atomic<unsigned long long> sum_us = 0;
+	std::atomic<unsigned long long> max_us = 0;
+};
+
+// Where an event spends its time between the report being read and the broker accepting it
+enum MetricsStage {
+	// report read to decoded
+	STAGE_DECODE,
+	// a connect decoded to its powersave window running out, only held connects go through it
+	STAGE_HOLD,
+	// decoded, or for a held connect released, to the status being committed
+	STAGE_COMMIT,
+	// committed to queued for the publisher thread
+	STAGE_ENQUEUE,
+	// queued to the broker accepting it
+	STAGE_PUBLISH,
+	// report read to the broker accepting it, includes the hold
+	STAGE_TOTAL,
+	stage_count
+};
+
+constexpr const char* metrics_stage_names[stage_count] = { "decode", "hold", "commit", "enqueue", "publish", "total" };
+
+// Startup is split into stages that don't wait on each other,
+// the broker connects on the publisher thread while the receivers are opened and enumerated
+enum StartupStage {
+	// config.ini, the state cache and the spool are read
+	STARTUP_CONFIG,
+	// first connect to the broker
+	STARTUP_BROKER,
+	// a receiver was opened and its serial is known
+	STARTUP_RECEIVER,
+	// wireless notifications are enabled on every open receiver
+	STARTUP_NOTIFICATIONS,
+	// every paired slot and name was read
+	STARTUP_DEVICES,
+	// every paired device answered the ping or timed out
+	STARTUP_PROBE,
+	startup_stage_count
+};
+
+constexpr const char* startup_stage_names[startup_stage_count] = { "config", "broker", "receiver", "notifications", "devices", "probe" };
+
+// When each stage finished, counted from when the driver was created
+struct StartupTimings {
+	std::chrono::steady_clock::time_point started;
+	// 0 until the stage finished
+	std::chrono::milliseconds finished[startup_stage_count] = {};
+	bool done[startup_stage_count] = {};
+	// the stage ran past its timeout, it is still waited on
+	bool late[startup_stage_count] = {};
+
+	// returns false if the stage was already done
+	bool finish(StartupStage stage, std::chrono::steady_clock::time_point now) {
+		if (done[stage]) {
+			return false;
+		}
+		done[stage] = true;
+		finished[stage] = std::chrono::duration_cast<std::chrono::milliseconds>(now - started);
+		return true;
+	}
+};
+
+struct Metrics {
+	LatencyHistogram stages[stage_count];
+	std::atomic<unsigned long long> reports_read = 0;
+	// reports that weren't a reply or a connection notification of a known receiver
+	std::atomic<unsigned long long> reports_ignored = 0;
+	std::atomic<unsigned long long> reconnects = 0;
+	// status changes of unstable devices that weren't published
+	std::atomic<unsigned long long> status_suppressed = 0;
+	// publishes that waited for the publish budget, only the latest of each device and kind is sent
+	std::atomic<unsigned long long> publishes_deferred = 0;
+
+	void record(MetricsStage stage, std::chrono::steady_clock::time_point from, std::chrono::steady_clock::time_point to) {
+		// events that didn't start with a report have no start time
+		if (from.time_since_epoch().count() != 0) {
+			stages[stage].record(to - from);
+		}
+	}
+	void count(std::atomic<unsigned long long>& counter) {
+		counter.fetch_add(1, std::memory_order_relaxed);
+	}
+};
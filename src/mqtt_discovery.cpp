@@ -0,0 +1,101 @@
+#include "mqtt_discovery.hpp"
+#include <cstdio>
+#include "../external/json.hpp"
+using json = nlohmann::json;
+
+std::string receiver_prefix(const std::string& discovery_prefix, unsigned int serial) {
+	char serial_hex[9];
+	std::snprintf(serial_hex, sizeof(serial_hex), "%08x", serial);
+	return discovery_prefix + "/device/logitech-unify-mqtt-" + serial_hex + "/";
+}
+
+void build_receiver_topics(const std::string& discovery_prefix, unsigned int serial, ReceiverTopics& topics) {
+	topics.prefix = receiver_prefix(discovery_prefix, serial);
+	topics.config = topics.prefix + "config";
+	for (unsigned char slot = 1; slot <= DeviceRegistry::max_slot; ++slot) {
+		topics.state[slot - 1] = topics.prefix + "dev" + std::to_string(slot - 1) + "/power_state";
+		topics.battery[slot - 1] = topics.prefix + "dev" + std::to_string(slot - 1) + "/battery";
+		topics.usage[slot - 1] = topics.prefix + "dev" + std::to_string(slot - 1) + "/usage";
+	}
+}
+
+std::string discovery_header(unsigned int serial) {
+	char serial_hex[9];
+	std::snprintf(serial_hex, sizeof(serial_hex), "%08x", serial);
+	json header;
+	header["dev"] = { {"ids", std::string("logitech-unify-mqtt-") + serial_hex}, {"name", std::string("Logitech Unify Receiver ") + serial_hex}};
+	header["o"] = { {"name", "logitech-unify-mqtt"}, {"url", "https://github.com/bobby3605/logitech-unify-mqtt"}};
+	header["qos"] = 0;
+	// the components are appended after the header, so drop its closing brace
+	std::string text = header.dump();
+	text.pop_back();
+	text += ",\"cmps\":{";
+	return text;
+}
+
+bool update_discovery_component(DiscoveryComponent& component, unsigned int serial, unsigned char slot, const std::string& name, bool battery, bool usage, ReceiverTopics const& topics) {
+	if (component.present && component.name == name && component.battery == battery && component.usage == usage) {
+		return false;
+	}
+	char serial_hex[9];
+	std::snprintf(serial_hex, sizeof(serial_hex), "%08x", serial);
+	std::string dev = "dev" + std::to_string(slot - 1);
+	json entry = {
+		{ "p", "sensor" },
+		{ "state_topic", topics.state[slot - 1] },
+		{ "unique_id", std::string(serial_hex) + "_" + dev},
+		{ "name", name}
+	};
+	component.present = true;
+	component.name = name;
+	component.battery = battery;
+	component.usage = usage;
+	component.json = "\"" + dev + "\":" + entry.dump();
+	if (battery) {
+		json battery_entry = {
+			{ "p", "sensor" },
+			{ "device_class", "battery" },
+			{ "unit_of_measurement", "%" },
+			{ "entity_category", "diagnostic" },
+			{ "state_topic", topics.battery[slot - 1] },
+			{ "unique_id", std::string(serial_hex) + "_" + dev + "_battery"},
+			{ "name", name + " battery"}
+		};
+		component.json += ",\"" + dev + "_battery\":" + battery_entry.dump();
+	}
+	if (usage) {
+		json usage_entry = {
+			{ "p", "sensor" },
+			{ "unit_of_measurement", "h" },
+			{ "entity_category", "diagnostic" },
+			{ "state_topic", topics.usage[slot - 1] },
+			{ "value_template", "{{ value_json.connected_hours }}" },
+			{ "json_attributes_topic", topics.usage[slot - 1] },
+			{ "unique_id", std::string(serial_hex) + "_" + dev + "_usage"},
+			{ "name", name + " connected" }
+		};
+		component.json += ",\"" + dev + "_usage\":" + usage_entry.dump();
+	}
+	return true;
+}
+
+void discovery_config(const std::string& header, const DiscoveryComponent (&components)[DeviceRegistry::max_slot], std::string& payload) {
+	payload.clear();
+	payload += header;
+	bool any = false;
+	for (const DiscoveryComponent& component : components) {
+		if (!component.present) {
+			continue;
+		}
+		if (any) {
+			payload += ',';
+		}
+		payload += component.json;
+		any = true;
+	}
+	if (!any) {
+		payload.clear();
+		return;
+	}
+	payload += "}}";
+}
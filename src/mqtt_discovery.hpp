@@ -0,0 +1,35 @@
+#pragma once
+#include <string>
+#include "device_registry.hpp"
+
+// The MQTT topics of a receiver and its devices, built once per prefix so events don't build strings
+struct ReceiverTopics {
+	// namespaced by the receiver's serial
+	std::string prefix = "";
+	std::string config = "";
+	// indexed by the 0 indexed slot
+	std::string state[DeviceRegistry::max_slot];
+	std::string battery[DeviceRegistry::max_slot];
+	std::string usage[DeviceRegistry::max_slot];
+};
+
+// One device's entry in the discovery config, serialized only when the device changes
+struct DiscoveryComponent {
+	bool present = false;
+	std::string name = "";
+	bool battery = false;
+	bool usage = false;
+	// "devN":{...}
+	std::string json = "";
+};
+
+// the topic prefix of a receiver with serial under discovery_prefix
+std::string receiver_prefix(const std::string& discovery_prefix, unsigned int serial);
+void build_receiver_topics(const std::string& discovery_prefix, unsigned int serial, ReceiverTopics& topics);
+// the discovery config of a receiver up to its components
+std::string discovery_header(unsigned int serial);
+// serializes the device into component if its name or sensors changed, returns false if it was up to date
+bool update_discovery_component(DiscoveryComponent& component, unsigned int serial, unsigned char slot, const std::string& name, bool battery, bool usage, ReceiverTopics const& topics);
+// the header followed by the present components, empty if none is present,
+// home assistant wants at least one component so that removes the receiver
+void discovery_config(const std::string& header, const DiscoveryComponent (&components)[DeviceRegistry::max_slot], std::string& payload);
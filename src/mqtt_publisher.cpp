@@ -0,0 +1,222 @@
+#include "mqtt_publisher.hpp"
+#include <random>
+
+MQTTPublisher::MQTTPublisher(UnifyMQTT* mqtt, MQTTSpool* spool, Metrics* metrics) : mqtt(mqtt), spool(spool), metrics(metrics) {
+	mqtt->set_event_handler([this]() { notify(); });
+	thread = std::thread(&MQTTPublisher::publisher_loop, this);
+}
+
+MQTTPublisher::~MQTTPublisher() {
+	stop();
+}
+
+void MQTTPublisher::stop() {
+	if (!thread.joinable()) {
+		return;
+	}
+	stopping = true;
+	notify();
+	thread.join();
+	// paho doesn't call back after an explicit disconnect, so the handler can go
+	mqtt->disconnect();
+	mqtt->set_event_handler(nullptr);
+}
+
+void MQTTPublisher::notify() {
+	signal.fetch_add(1, std::memory_order_release);
+	// the publisher thread checks signal under the mutex, so taking it here means the notify can't be missed
+	{
+		std::lock_guard<std::mutex> lock(wait_mutex);
+	}
+	wake.notify_one();
+}
+
+bool MQTTPublisher::publish(std::string_view topic, std::string_view payload, bool retained, std::chrono::steady_clock::time_point read_time) {
+	Message* message = queue.write_slot();
+	if (message == nullptr) {
+		dropped.fetch_add(1, std::memory_order_relaxed);
+		return false;
+	}
+	message->topic.assign(topic);
+	message->payload.assign(payload);
+	message->retained = retained;
+	message->read_time = read_time;
+	message->enqueue_time = std::chrono::steady_clock::now();
+	queue.push();
+	queued.fetch_add(1, std::memory_order_relaxed);
+	unsigned int depth = queue.size();
+	if (depth > high_water.load(std::memory_order_relaxed)) {
+		high_water.store(depth, std::memory_order_relaxed);
+	}
+	notify();
+	return true;
+}
+
+void MQTTPublisher::acknowledge_oldest() {
+	Message& message = in_flight[in_flight_head];
+	published.fetch_add(1, std::memory_order_relaxed);
+	std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+	metrics->record(STAGE_PUBLISH, message.enqueue_time, now);
+	metrics->record(STAGE_TOTAL, message.read_time, now);
+	in_flight_head = (in_flight_head + 1) % UnifyMQTT::max_in_flight;
+	--in_flight_count;
+	++acknowledged;
+}
+
+void MQTTPublisher::reap_acknowledged() {
+	// the broker acknowledges in the order messages were published
+	unsigned long long delivered = mqtt->delivered();
+	while (in_flight_count > 0 && acknowledged < delivered) {
+		acknowledge_oldest();
+	}
+}
+
+bool MQTTPublisher::transmit(std::string_view topic, std::string_view payload, bool retained, std::chrono::steady_clock::time_point read_time, std::chrono::steady_clock::time_point enqueue_time) {
+	reap_acknowledged();
+	if (in_flight_count == UnifyMQTT::max_in_flight) {
+		if (mqtt->wait_for_completion(in_flight[in_flight_head].token, ack_timeout_ms) != MQTTCLIENT_SUCCESS) {
+			return false;
+		}
+		acknowledge_oldest();
+	}
+	Message& message = in_flight[(in_flight_head + in_flight_count) % UnifyMQTT::max_in_flight];
+	message.topic.assign(topic);
+	message.payload.assign(payload);
+	message.retained = retained;
+	message.read_time = read_time;
+	message.enqueue_time = enqueue_time;
+	int rc = mqtt->publish(message.topic, message.payload, message.retained, &message.token);
+	if (rc != MQTTCLIENT_SUCCESS) {
+		last_error.store(rc, std::memory_order_relaxed);
+		failed.fetch_add(1, std::memory_order_relaxed);
+		return false;
+	}
+	++in_flight_count;
+	return true;
+}
+
+void MQTTPublisher::spool_message(std::string_view topic, std::string_view payload, bool retained) {
+	if (!spool->append(topic, payload, retained)) {
+		spool_dropped.fetch_add(1, std::memory_order_relaxed);
+	}
+	spooled.store((unsigned int)spool->count(), std::memory_order_relaxed);
+}
+
+void MQTTPublisher::connection_dropped() {
+	mqtt->disconnect();
+	// anything acknowledged before the drop still counts
+	reap_acknowledged();
+	for (; in_flight_count > 0; --in_flight_count) {
+		Message& message = in_flight[in_flight_head];
+		spool_message(message.topic, message.payload, message.retained);
+		in_flight_head = (in_flight_head + 1) % UnifyMQTT::max_in_flight;
+	}
+	acknowledged = mqtt->delivered();
+}
+
+void MQTTPublisher::start_connect() {
+	if (connector.joinable()) {
+		connector.join();
+	}
+	connecting = true;
+	connect_done.store(false, std::memory_order_relaxed);
+	connector = std::thread([this]() {
+		connect_result = mqtt->connect();
+		connect_done.store(true, std::memory_order_release);
+		notify();
+	});
+}
+
+void MQTTPublisher::publisher_loop() {
+	std::minstd_rand random((unsigned int)std::chrono::steady_clock::now().time_since_epoch().count());
+	std::chrono::milliseconds backoff = min_backoff;
+	std::chrono::steady_clock::time_point next_connect = std::chrono::steady_clock::now();
+	// only set once the spool has been sent, so nothing newer overtakes it
+	bool was_connected = false;
+	while (true) {
+		unsigned int seen = signal.load(std::memory_order_acquire);
+		if (was_connected && !mqtt->connected()) {
+			// paho noticed the broker going away
+			connection_dropped();
+			was_connected = false;
+			next_connect = std::chrono::steady_clock::now();
+		}
+		if (!was_connected && !connecting && !stopping && std::chrono::steady_clock::now() >= next_connect) {
+			start_connect();
+		}
+		// stop waits for an attempt that is still running, it may still get to send the spool
+		if (connecting && (stopping || connect_done.load(std::memory_order_acquire))) {
+			connector.join();
+			connecting = false;
+			int rc = connect_result;
+			if (rc == MQTTCLIENT_SUCCESS) {
+				if (ever_connected) {
+					metrics->count(metrics->reconnects);
+				}
+				ever_connected = true;
+				backoff = min_backoff;
+				acknowledged = mqtt->delivered();
+				// what was spooled while offline goes out before anything newer
+				if (!spool->drain([this](std::string_view topic, std::string_view payload, bool retained) {
+					return transmit(topic, payload, retained, {}, {});
+				})) {
+					connection_dropped();
+				}
+				spooled.store((unsigned int)spool->count(), std::memory_order_relaxed);
+				was_connected = mqtt->connected();
+			}
+			else {
+				last_connect_error.store(rc, std::memory_order_relaxed);
+				connect_failures.fetch_add(1, std::memory_order_relaxed);
+				// every client retrying at once after a broker restart would all hit it together
+				std::chrono::milliseconds delay = backoff / 2 + std::chrono::milliseconds(random() % (backoff.count() / 2 + 1));
+				next_connect = std::chrono::steady_clock::now() + delay;
+				backoff = std::min(backoff * 2, max_backoff);
+			}
+		}
+		while (Message* message = queue.read_slot()) {
+			if (!was_connected || !transmit(message->topic, message->payload, message->retained, message->read_time, message->enqueue_time)) {
+				if (was_connected) {
+					connection_dropped();
+					was_connected = false;
+					next_connect = std::chrono::steady_clock::now();
+				}
+				spool_message(message->topic, message->payload, message->retained);
+			}
+			queue.pop();
+		}
+		connected.store(was_connected, std::memory_order_relaxed);
+		reap_acknowledged();
+		// everything queued before stop has been sent, wait for the broker to acknowledge it
+		if (stopping) {
+			while (in_flight_count > 0 && mqtt->connected() && mqtt->wait_for_completion(in_flight[in_flight_head].token, ack_timeout_ms) == MQTTCLIENT_SUCCESS) {
+				acknowledge_oldest();
+			}
+			connection_dropped();
+			return;
+		}
+		std::unique_lock<std::mutex> lock(wait_mutex);
+		if (was_connected || connecting) {
+			wake.wait(lock, [&]() { return signal.load(std::memory_order_acquire) != seen; });
+		}
+		else {
+			wake.wait_until(lock, next_connect, [&]() { return signal.load(std::memory_order_acquire) != seen; });
+		}
+	}
+}
+
+MQTTPublisherStats MQTTPublisher::stats() {
+	return MQTTPublisherStats{
+		queued.load(std::memory_order_relaxed),
+		published.load(std::memory_order_relaxed),
+		dropped.load(std::memory_order_relaxed),
+		failed.load(std::memory_order_relaxed),
+		last_error.load(std::memory_order_relaxed),
+		high_water.load(std::memory_order_relaxed),
+		connected.load(std::memory_order_relaxed),
+		connect_failures.load(std::memory_order_relaxed),
+		last_connect_error.load(std::memory_order_relaxed),
+		spooled.load(std::memory_order_relaxed),
+		spool_dropped.load(std::memory_order_relaxed)
+	};
+}
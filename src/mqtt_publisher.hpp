@@ -0,0 +1,125 @@
+#pragma once
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <thread>
+#include "spsc_queue.hpp"
+#include "unify_mqtt.hpp"
+#include "mqtt_spool.hpp"
+#include "metrics.hpp"
+
+struct MQTTPublisherStats {
+	unsigned long long queued;
+	// acknowledged by the broker
+	unsigned long long published;
+	// the queue was full, the message was never sent
+	unsigned long long dropped;
+	// the broker rejected the message or wasn't reachable, it was spooled
+	unsigned long long failed;
+	int last_error;
+	// most messages that were waiting at once
+	unsigned int high_water;
+	bool connected;
+	// connection attempts that failed, and the paho code of the last one
+	unsigned long long connect_failures;
+	int last_connect_error;
+	// messages waiting in the spool for the broker to come back
+	unsigned int spooled;
+	// the spool was full or isn't open, the message was never sent
+	unsigned long long spool_dropped;
+};
+
+// Publishes on its own thread, so a slow or unreachable broker never holds up HID reads
+// publish only copies into a preallocated ring entry and returns, it doesn't allocate
+// unless a payload is larger than any before it
+// publish must always be called from the same thread
+//
+// The publisher thread owns the session: it connects, reconnects with a jittered backoff
+// when the connection drops, and spools whatever can't be sent until the broker is back,
+// also while a connection attempt is still waiting for the broker
+class MQTTPublisher {
+	struct Message {
+		std::string topic;
+		std::string payload;
+		bool retained = false;
+		// when the report that caused the message was read, 0 if none did
+		std::chrono::steady_clock::time_point read_time;
+		std::chrono::steady_clock::time_point enqueue_time;
+		MQTTClient_deliveryToken token = 0;
+		// reserved up front so publish only copies,
+		// discovery payloads are the largest messages
+		Message() {
+			topic.reserve(128);
+			payload.reserve(4096);
+		}
+	};
+
+	static constexpr std::chrono::milliseconds min_backoff{ 1000 };
+	static constexpr std::chrono::milliseconds max_backoff{ 60000 };
+	// how long a full in flight window waits for the broker before the connection is given up on
+	static const unsigned long ack_timeout_ms = 10000;
+
+	UnifyMQTT* mqtt;
+	MQTTSpool* spool;
+	Metrics* metrics;
+	SPSCQueue<Message, 64> queue;
+	// published but not yet acknowledged, oldest first, only used by the publisher thread
+	Message in_flight[UnifyMQTT::max_in_flight];
+	unsigned int in_flight_head = 0;
+	unsigned int in_flight_count = 0;
+	// acknowledgements already matched to in_flight entries
+	unsigned long long acknowledged = 0;
+	bool ever_connected = false;
+
+	// bumped on every publish, acknowledgement, connection drop and on stop, the publisher thread waits on it
+	std::atomic<unsigned int> signal = 0;
+	std::mutex wait_mutex;
+	std::condition_variable wake;
+	std::atomic<bool> stopping = false;
+
+	std::atomic<unsigned long long> queued = 0;
+	std::atomic<unsigned long long> published = 0;
+	std::atomic<unsigned long long> dropped = 0;
+	std::atomic<unsigned long long> failed = 0;
+	std::atomic<int> last_error = 0;
+	std::atomic<unsigned int> high_water = 0;
+	// as the publisher thread last saw it, stop disconnecting doesn't clear it
+	std::atomic<bool> connected = false;
+	std::atomic<unsigned long long> connect_failures = 0;
+	std::atomic<int> last_connect_error = 0;
+	std::atomic<unsigned int> spooled = 0;
+	std::atomic<unsigned long long> spool_dropped = 0;
+
+	std::thread thread;
+	// connects while the publisher thread keeps spooling, paho blocks for up to the connect timeout
+	std::thread connector;
+	bool connecting = false;
+	std::atomic<bool> connect_done = false;
+	int connect_result = 0;
+	void start_connect();
+	void publisher_loop();
+	void notify();
+	// hands a message to paho once the in flight window has room, false if the connection is gone
+	bool transmit(std::string_view topic, std::string_view payload, bool retained, std::chrono::steady_clock::time_point read_time, std::chrono::steady_clock::time_point enqueue_time);
+	// retires the in flight messages the broker acknowledged
+	void reap_acknowledged();
+	void acknowledge_oldest();
+	// spools what is in flight, it is sent again once the broker is back
+	void connection_dropped();
+	void spool_message(std::string_view topic, std::string_view payload, bool retained);
+
+public:
+	// publish and total latencies are recorded into metrics,
+	// spool keeps messages while the broker is unreachable and may not be open
+	MQTTPublisher(UnifyMQTT* mqtt, MQTTSpool* spool, Metrics* metrics);
+	~MQTTPublisher();
+	// sends everything still queued and stops the publisher thread
+	void stop();
+	// returns false if the queue is full and the message was dropped
+	// read_time is when the report that caused the message was read
+	bool publish(std::string_view topic, std::string_view payload, bool retained, std::chrono::steady_clock::time_point read_time = {});
+	MQTTPublisherStats stats();
+};
@@ -0,0 +1,27 @@
+#pragma once
+#include <cstdio>
+#include "output_sink.hpp"
+#include "mqtt_publisher.hpp"
+
+// Publishes every status to its power_state topic and every battery level to its battery topic
+// the publisher is replaced when the MQTT session is reconnected
+class MQTTSink : public OutputSink {
+	MQTTPublisher* publisher = nullptr;
+
+public:
+	void set_publisher(MQTTPublisher* new_publisher) { publisher = new_publisher; }
+
+	// the status name, or the battery level formatted into buffer
+	static std::string_view payload(DeviceEvent const& event, char (&buffer)[8]) {
+		if (event.kind == EVENT_STATUS) {
+			return device_status_name(event.status);
+		}
+		int length = std::snprintf(buffer, sizeof(buffer), "%d", event.battery_level);
+		return std::string_view(buffer, length);
+	}
+
+	void device_event(DeviceEvent const& event) override {
+		char buffer[8];
+		publisher->publish(event.topic, payload(event, buffer), false, event.read_time);
+	}
+};
@@ -0,0 +1,136 @@
+#include "mqtt_spool.hpp"
+#include <cstring>
+
+static const char spool_magic[8] = { 'L', 'U', 'M', 'Q', 'S', 'P', 'O', 'L' };
+
+std::uint32_t MQTTSpool::record_checksum(const Record& record) {
+	std::uint32_t hash = fnv1a(&record, offsetof(Record, superseded));
+	return fnv1a(&record + 1, (size_t)record.topic_size + record.payload_size, hash);
+}
+
+size_t MQTTSpool::record_size(const Record& record) {
+	size_t size = sizeof(Record) + record.topic_size + record.payload_size;
+	return (size + record_alignment - 1) & ~(record_alignment - 1);
+}
+
+void MQTTSpool::set_tail(std::uint32_t tail) {
+	header->tail = tail;
+	file.flush(0, sizeof(Header));
+}
+
+bool MQTTSpool::open(const std::string& path, Logger& debug_log, size_t size) {
+	bool resized = false;
+	if (!file.open(path, size, resized)) {
+		debug_log.log(LOG_MQTT_SPOOL_MAP_FAILED, path);
+		return false;
+	}
+	header = (Header*)file.data();
+	records = file.data() + records_offset;
+	capacity = size - records_offset;
+	live.clear();
+	Header expected{};
+	std::memcpy(expected.magic, spool_magic, sizeof(spool_magic));
+	expected.version = version;
+	expected.size = (std::uint32_t)size;
+	expected.checksum = fnv1a(&expected, offsetof(Header, checksum));
+	if (resized || std::memcmp(header, &expected, offsetof(Header, tail)) != 0 || header->tail > capacity) {
+		if (!resized) {
+			debug_log.log(LOG_MQTT_SPOOL_RESET);
+		}
+		std::memset(file.data(), 0, size);
+		std::memcpy(header, &expected, sizeof(Header));
+		file.flush(0, size);
+		return true;
+	}
+	// everything up to the first damaged record is kept
+	std::uint32_t offset = 0;
+	while (offset + sizeof(Record) <= header->tail) {
+		Record* record = record_at(offset);
+		if ((size_t)record->topic_size + record->payload_size > header->tail - offset - sizeof(Record) || record->checksum != record_checksum(*record)) {
+			break;
+		}
+		if (!record->superseded) {
+			// a stop between appending a record and superseding the older one leaves both
+			std::uint32_t hash = fnv1a(&record[1], record->topic_size);
+			size_t older = find(hash, topic_of(*record));
+			if (older < live.size()) {
+				supersede(older);
+			}
+			live.push_back(LiveRecord{ hash, offset });
+		}
+		offset += (std::uint32_t)record_size(*record);
+	}
+	if (offset != header->tail) {
+		set_tail(offset);
+	}
+	if (!live.empty()) {
+		debug_log.log(LOG_MQTT_SPOOL_LOADED, live.size());
+	}
+	return true;
+}
+
+size_t MQTTSpool::find(std::uint32_t hash, std::string_view topic) {
+	for (size_t i = 0; i < live.size(); ++i) {
+		if (live[i].hash == hash && topic_of(*record_at(live[i].offset)) == topic) {
+			return i;
+		}
+	}
+	return live.size();
+}
+
+void MQTTSpool::supersede(size_t index) {
+	record_at(live[index].offset)->superseded = 1;
+	file.flush(records_offset + live[index].offset, sizeof(Record));
+	live.erase(live.begin() + index);
+}
+
+std::uint32_t MQTTSpool::compact() {
+	// live records only move towards the start, so copying them in order never overwrites one that is still to be copied
+	std::uint32_t tail = 0;
+	for (LiveRecord& entry : live) {
+		Record* record = record_at(entry.offset);
+		size_t size = record_size(*record);
+		if (entry.offset != tail) {
+			std::memmove(records + tail, record, size);
+		}
+		entry.offset = tail;
+		tail += (std::uint32_t)size;
+	}
+	file.flush(records_offset, tail);
+	set_tail(tail);
+	return tail;
+}
+
+bool MQTTSpool::append(std::string_view topic, std::string_view payload, bool retained) {
+	if (header == nullptr) {
+		return false;
+	}
+	std::uint32_t hash = fnv1a(topic.data(), topic.size());
+	size_t older = find(hash, topic);
+	bool replaces = older < live.size();
+	Record record{};
+	record.topic_size = (std::uint32_t)topic.size();
+	record.payload_size = (std::uint32_t)payload.size();
+	record.retained = retained;
+	size_t size = record_size(record);
+	std::uint32_t tail = header->tail;
+	if (tail + size > capacity) {
+		tail = compact();
+		if (tail + size > capacity) {
+			return false;
+		}
+	}
+	unsigned char* target = records + tail;
+	std::memcpy(target + sizeof(Record), topic.data(), topic.size());
+	std::memcpy(target + sizeof(Record) + topic.size(), payload.data(), payload.size());
+	std::memcpy(target, &record, sizeof(Record));
+	((Record*)target)->checksum = record_checksum(*(Record*)target);
+	file.flush(records_offset + tail, size);
+	live.push_back(LiveRecord{ hash, tail });
+	set_tail(tail + (std::uint32_t)size);
+	// the older record is only given up once the new one is in, a message that doesn't fit keeps it
+	if (replaces) {
+		supersede(older);
+	}
+	return true;
+}
@@ -0,0 +1,101 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <vector>
+#include "mapped_file.hpp"
+#include "logger.hpp"
+
+// Messages that couldn't be sent while the broker was unreachable, kept in a memory mapped file
+// so they are still sent after a restart
+//
+// Records are only ever appended, a message for a topic that is already spooled marks the older
+// record superseded in place, so once the broker is back only the latest value of every topic is sent
+// a record is written before the tail is moved past it, so an append cut short by a crash is dropped when loading
+// after a power loss the tail can be on disk before its record, which then fails its checksum and is dropped too
+class MQTTSpool {
+	static const std::uint32_t version = 1;
+
+	struct Header {
+		char magic[8];
+		std::uint32_t version;
+		std::uint32_t size;
+		std::uint32_t checksum;
+		// end of the last complete record, from the start of the records
+		std::uint32_t tail;
+	};
+
+	struct Record {
+		std::uint32_t topic_size;
+		std::uint32_t payload_size;
+		std::uint8_t retained;
+		// set once a newer record for the topic was appended or the record was sent
+		std::uint8_t superseded;
+		std::uint16_t reserved;
+		// of everything before superseded, and the topic and payload that follow the record
+		std::uint32_t checksum;
+	};
+
+	static const size_t records_offset = 64;
+	static const size_t record_alignment = 8;
+	static_assert(sizeof(Header) <= records_offset, "header doesn't fit");
+	static_assert(sizeof(Record) == 16, "bump version when Record changes");
+
+	// a record that hasn't been superseded, hash is of its topic
+	struct LiveRecord {
+		std::uint32_t hash;
+		std::uint32_t offset;
+	};
+
+	MappedFile file;
+	Header* header = nullptr;
+	unsigned char* records = nullptr;
+	size_t capacity = 0;
+	// in append order, which is the order they are sent in
+	std::vector<LiveRecord> live;
+
+	static std::uint32_t record_checksum(const Record& record);
+	static size_t record_size(const Record& record);
+	Record* record_at(std::uint32_t offset) { return (Record*)(records + offset); }
+	std::string_view topic_of(const Record& record) const { return std::string_view((const char*)(&record + 1), record.topic_size); }
+	std::string_view payload_of(const Record& record) const { return std::string_view((const char*)(&record + 1) + record.topic_size, record.payload_size); }
+	void set_tail(std::uint32_t tail);
+	// index in live of the record for topic, live.size() if there is none
+	size_t find(std::uint32_t hash, std::string_view topic);
+	void supersede(size_t index);
+	// moves the live records to the start, returns the new tail
+	std::uint32_t compact();
+
+public:
+	static const size_t default_size = 256 * 1024;
+
+	MQTTSpool() {}
+	MQTTSpool(const MQTTSpool&) = delete;
+	MQTTSpool& operator=(const MQTTSpool&) = delete;
+	// keeps the records up to the first damaged one, a file of another size or version is emptied
+	bool open(const std::string& path, Logger& debug_log, size_t size = default_size);
+	bool is_open() const { return header != nullptr; }
+	size_t count() const { return live.size(); }
+	// replaces what is spooled for topic, returns false if the message doesn't fit
+	bool append(std::string_view topic, std::string_view payload, bool retained);
+	// sends the spooled messages oldest first until send returns false,
+	// the ones that were sent are removed, returns true once nothing is left
+	template <typename Send>
+	bool drain(Send send) {
+		size_t sent = 0;
+		for (; sent < live.size(); ++sent) {
+			Record* record = record_at(live[sent].offset);
+			if (!send(topic_of(*record), payload_of(*record), record->retained != 0)) {
+				break;
+			}
+			record->superseded = 1;
+			file.flush(records_offset + live[sent].offset, sizeof(Record));
+		}
+		live.erase(live.begin(), live.begin() + sent);
+		if (live.empty() && header != nullptr) {
+			set_tail(0);
+		}
+		return live.empty();
+	}
+};
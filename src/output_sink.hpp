@@ -0,0 +1,39 @@
+#pragma once
+#include <chrono>
+#include <string_view>
+#include "device_registry.hpp"
+
+enum DeviceEventKind {
+	EVENT_STATUS,
+	EVENT_BATTERY
+};
+
+// A status or battery change of one device, only valid during the call it is passed to
+struct DeviceEvent {
+	DeviceEventKind kind;
+	unsigned int receiver_serial;
+	unsigned char slot;
+	std::string_view name;
+	DeviceStatus status;
+	// percent, -1 until it has been read
+	int battery_level;
+	bool battery_charging;
+	// when the status changed, kept across restarts
+	std::chrono::system_clock::time_point last_transition;
+	// status changes not published since the device last became unstable
+	unsigned int suppressed_events;
+	// when the report behind the event was read, 0 if none was
+	std::chrono::steady_clock::time_point read_time;
+	// the MQTT topic of the event, built once per receiver
+	std::string_view topic;
+};
+
+// Somewhere device changes go, UnifyStatus hands every change to each sink in turn
+// sinks are called on the driver thread, so they must only copy the event and return
+class OutputSink {
+public:
+	virtual ~OutputSink() {}
+	virtual void device_event(DeviceEvent const& event) = 0;
+	// a new state snapshot was published, everything before this is in it
+	virtual void state_published() {}
+};
@@ -0,0 +1,52 @@
+#pragma once
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <type_traits>
+
+// One writer publishes a value that any number of readers copy out without locking
+// the value is kept in atomic words so a read that overlaps a write is retried instead of being a data race,
+// the writer never waits on a reader
+template <typename T>
+class SeqLock {
+	static_assert(std::is_trivially_copyable<T>::value, "the value is copied word by word");
+	static const size_t word_count = (sizeof(T) + sizeof(std::uint64_t) - 1) / sizeof(std::uint64_t);
+
+	// odd while a write is in progress
+	std::atomic<std::uint64_t> sequence = 0;
+	std::atomic<std::uint64_t> words[word_count] = {};
+
+public:
+	// writer only
+	void write(T const& value) {
+		std::uint64_t buffer[word_count] = {};
+		std::memcpy(buffer, &value, sizeof(T));
+		std::uint64_t start = sequence.load(std::memory_order_relaxed);
+		sequence.store(start + 1, std::memory_order_relaxed);
+		std::atomic_thread_fence(std::memory_order_release);
+		for (size_t i = 0; i < word_count; ++i) {
+			words[i].store(buffer[i], std::memory_order_relaxed);
+		}
+		sequence.store(start + 2, std::memory_order_release);
+	}
+	// safe from any thread, retries while the writer is in the middle of a write
+	T read() const {
+		std::uint64_t buffer[word_count];
+		while (true) {
+			std::uint64_t start = sequence.load(std::memory_order_acquire);
+			if (start & 1) {
+				continue;
+			}
+			for (size_t i = 0; i < word_count; ++i) {
+				buffer[i] = words[i].load(std::memory_order_relaxed);
+			}
+			std::atomic_thread_fence(std::memory_order_acquire);
+			if (sequence.load(std::memory_order_relaxed) == start) {
+				break;
+			}
+		}
+		T value;
+		std::memcpy(&value, buffer, sizeof(T));
+		return value;
+	}
+};
@@ -0,0 +1,50 @@
+#pragma once
+#include <atomic>
+
+// Bounded single producer single consumer ring
+// entries are constructed once and reused, so entries that keep their buffers (like strings)
+// can be refilled without allocating
+template <typename T, unsigned int Capacity>
+class SPSCQueue {
+	static_assert(Capacity != 0 && (Capacity & (Capacity - 1)) == 0, "capacity must be a power of two");
+	static const unsigned int mask = Capacity - 1;
+
+	T entries[Capacity];
+	// next entry to read, only written by the consumer
+	alignas(64) std::atomic<unsigned int> head = 0;
+	// next entry to write, only written by the producer
+	alignas(64) std::atomic<unsigned int> tail = 0;
+
+public:
+	// producer: the entry to fill next, nullptr if the queue is full
+	T* write_slot() {
+		unsigned int t = tail.load(std::memory_order_relaxed);
+		if (t - head.load(std::memory_order_acquire) == Capacity) {
+			return nullptr;
+		}
+		return &entries[t & mask];
+	}
+	// producer: makes the entry from write_slot visible to the consumer
+	void push() {
+		tail.store(tail.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+	}
+	// consumer: the oldest entry, nullptr if the queue is empty
+	T* read_slot() {
+		unsigned int h = head.load(std::memory_order_relaxed);
+		if (h == tail.load(std::memory_order_acquire)) {
+			return nullptr;
+		}
+		return &entries[h & mask];
+	}
+	// consumer: hands the entry from read_slot back to the producer
+	void pop() {
+		head.store(head.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+	}
+	// safe from either side, but only exact on the calling side
+	unsigned int size() const {
+		return tail.load(std::memory_order_acquire) - head.load(std::memory_order_acquire);
+	}
+	static constexpr unsigned int capacity() {
+		return Capacity;
+	}
+};
@@ -0,0 +1,132 @@
+#include "state_cache.hpp"
+#include <cstring>
+
+static const char state_magic[8] = { 'L', 'U', 'M', 'Q', 'S', 'T', 'A', 'T' };
+
+const StateCache::Record* StateCache::latest(const Entry& entry) {
+	const Record* newest = nullptr;
+	for (const Record& copy : entry.copies) {
+		if (copy.generation == 0 || copy.checksum != fnv1a(&copy, offsetof(Record, checksum))) {
+			continue;
+		}
+		if (newest == nullptr || copy.generation > newest->generation) {
+			newest = &copy;
+		}
+	}
+	return newest;
+}
+
+bool StateCache::open(const std::string& path, Logger& debug_log) {
+	size_t size = entries_offset + sizeof(Entry) * entry_count;
+	bool resized = false;
+	if (!file.open(path, size, resized)) {
+		debug_log.log(LOG_STATE_CACHE_MAP_FAILED, path);
+		return false;
+	}
+	Header* header = (Header*)file.data();
+	Header expected{};
+	std::memcpy(expected.magic, state_magic, sizeof(state_magic));
+	expected.version = version;
+	expected.entry_count = entry_count;
+	expected.record_size = sizeof(Record);
+	expected.checksum = fnv1a(&expected, offsetof(Header, checksum));
+	if (resized || std::memcmp(header, &expected, sizeof(Header)) != 0) {
+		if (!resized) {
+			debug_log.log(LOG_STATE_CACHE_RESET);
+		}
+		std::memset(file.data(), 0, size);
+		std::memcpy(header, &expected, sizeof(Header));
+		file.flush(0, size);
+	}
+	entries = (Entry*)(file.data() + entries_offset);
+	return true;
+}
+
+std::vector<DeviceData> StateCache::load(unsigned int receiver_serial) {
+	std::vector<DeviceData> cached;
+	if (entries == nullptr) {
+		return cached;
+	}
+	for (unsigned int i = 0; i < entry_count; ++i) {
+		const Record* record = latest(entries[i]);
+		if (record == nullptr || record->receiver_serial != receiver_serial || record->slot < 1 || record->slot > DeviceRegistry::max_slot) {
+			continue;
+		}
+		DeviceData device;
+		device.receiver_serial = record->receiver_serial;
+		device.slot = record->slot;
+		device.status = record->status <= POWERSAVE ? (DeviceStatus)record->status : DISCONNECTED;
+		device.name.assign(record->name, record->name_length < sizeof(record->name) ? record->name_length : sizeof(record->name));
+		device.wireless_pid = record->wireless_pid;
+		device.last_transition = std::chrono::system_clock::time_point(std::chrono::seconds(record->last_transition));
+		cached.push_back(device);
+	}
+	return cached;
+}
+
+unsigned int StateCache::find_entry(unsigned int receiver_serial, unsigned char slot, bool& found) {
+	int free_entry = -1;
+	int oldest_entry = 0;
+	std::int64_t oldest_transition = INT64_MAX;
+	for (unsigned int i = 0; i < entry_count; ++i) {
+		const Record* record = latest(entries[i]);
+		if (record == nullptr || record->receiver_serial == 0) {
+			if (free_entry < 0) {
+				free_entry = i;
+			}
+			continue;
+		}
+		if (record->receiver_serial == receiver_serial && record->slot == slot) {
+			found = true;
+			return i;
+		}
+		if (record->last_transition < oldest_transition) {
+			oldest_transition = record->last_transition;
+			oldest_entry = i;
+		}
+	}
+	found = false;
+	return free_entry >= 0 ? free_entry : oldest_entry;
+}
+
+void StateCache::write(unsigned int index, const Record& record) {
+	Entry& entry = entries[index];
+	const Record* newest = latest(entry);
+	// overwrite the copy that isn't the newest valid one
+	unsigned int target = newest == &entry.copies[0] ? 1 : 0;
+	Record copy = record;
+	copy.generation = newest == nullptr ? 1 : newest->generation + 1;
+	copy.reserved = 0;
+	copy.checksum = fnv1a(&copy, offsetof(Record, checksum));
+	std::memcpy(&entry.copies[target], &copy, sizeof(Record));
+	file.flush(entries_offset + index * sizeof(Entry) + target * sizeof(Record), sizeof(Record));
+}
+
+void StateCache::store(DeviceData const& device) {
+	if (entries == nullptr) {
+		return;
+	}
+	bool found;
+	unsigned int index = find_entry(device.receiver_serial, device.slot, found);
+	Record record{};
+	record.receiver_serial = device.receiver_serial;
+	record.slot = device.slot;
+	record.status = (std::uint8_t)device.status;
+	record.wireless_pid = device.wireless_pid;
+	record.name_length = (std::uint8_t)(device.name.size() < sizeof(record.name) ? device.name.size() : sizeof(record.name));
+	std::memcpy(record.name, device.name.data(), record.name_length);
+	record.last_transition = std::chrono::duration_cast<std::chrono::seconds>(device.last_transition.time_since_epoch()).count();
+	write(index, record);
+}
+
+void StateCache::remove(unsigned int receiver_serial, unsigned char slot) {
+	if (entries == nullptr) {
+		return;
+	}
+	bool found;
+	unsigned int index = find_entry(receiver_serial, slot, found);
+	if (found) {
+		// a newer empty record frees the entry
+		write(index, Record{});
+	}
+}
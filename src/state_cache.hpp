@@ -0,0 +1,71 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+#include "mapped_file.hpp"
+#include "device_registry.hpp"
+#include "logger.hpp"
+
+// Last known state of every device, kept in a memory mapped file so a restart
+// can publish discovery and statuses before the receiver has answered anything
+//
+// Every device has two copies of its record, a write goes to the older copy,
+// and the newest copy whose checksum matches wins when loading,
+// so a write cut short by a crash falls back to the previous state,
+// and so does a copy that only partly reached the disk before a power loss
+class StateCache {
+	static const std::uint32_t version = 1;
+	static const unsigned int entry_count = 64;
+
+	struct Header {
+		char magic[8];
+		std::uint32_t version;
+		std::uint32_t entry_count;
+		std::uint32_t record_size;
+		std::uint32_t checksum;
+	};
+
+	struct Record {
+		// 0 for a copy that was never written
+		std::uint32_t generation;
+		// 0 for a free entry
+		std::uint32_t receiver_serial;
+		std::uint8_t slot;
+		std::uint8_t status;
+		std::uint16_t wireless_pid;
+		std::uint8_t name_length;
+		char name[15];
+		std::uint8_t padding[4];
+		// seconds since the unix epoch
+		std::int64_t last_transition;
+		std::uint32_t checksum;
+		std::uint32_t reserved;
+	};
+
+	struct Entry {
+		Record copies[2];
+	};
+
+	// entries start on the second cache line
+	static const size_t entries_offset = 64;
+	static_assert(sizeof(Header) <= entries_offset, "header doesn't fit");
+	static_assert(sizeof(Record) == 48, "a new record layout needs a new version");
+
+	MappedFile file;
+	Entry* entries = nullptr;
+
+	// newest valid copy of an entry, nullptr if neither is valid
+	static const Record* latest(const Entry& entry);
+	void write(unsigned int index, const Record& record);
+	// entry holding the device, otherwise a free one, otherwise the one that changed longest ago
+	unsigned int find_entry(unsigned int receiver_serial, unsigned char slot, bool& found);
+
+public:
+	// a missing, old or damaged file starts out empty
+	bool open(const std::string& path, Logger& debug_log);
+	// every cached device of a receiver
+	std::vector<DeviceData> load(unsigned int receiver_serial);
+	void store(DeviceData const& device);
+	void remove(unsigned int receiver_serial, unsigned char slot);
+};
@@ -0,0 +1,71 @@
+#include "timer_wheel.hpp"
+
+TimerWheel::TimerWheel(std::chrono::milliseconds tick) : tick(tick), start(std::chrono::steady_clock::now()) {
+	// a slot is only reached again after a full rotation, so it would take that long to stop allocating
+	for (std::vector<Timer>& slot : slots) {
+		slot.reserve(reserved_per_slot);
+	}
+}
+
+unsigned long long TimerWheel::tick_of(std::chrono::steady_clock::time_point time) const {
+	if (time <= start) {
+		return 0;
+	}
+	return (unsigned long long)((time - start) / tick);
+}
+
+void TimerWheel::schedule(unsigned long long key, std::chrono::steady_clock::time_point deadline) {
+	unsigned long long deadline_tick = tick_of(deadline);
+	// overdue timers go in the slot that is expired next
+	if (deadline_tick < current_tick) {
+		deadline_tick = current_tick;
+	}
+	slots[deadline_tick % slot_count].push_back(Timer{ key, deadline });
+	++timer_count;
+}
+
+bool TimerWheel::expire(std::chrono::steady_clock::time_point now, unsigned long long& key, std::chrono::steady_clock::time_point& deadline) {
+	unsigned long long now_tick = tick_of(now);
+	while (timer_count > 0) {
+		// timers more than one rotation away share the slot, only the ones that are due are removed
+		std::vector<Timer>& slot = slots[current_tick % slot_count];
+		for (size_t i = 0; i < slot.size(); ++i) {
+			if (slot[i].deadline <= now) {
+				key = slot[i].key;
+				deadline = slot[i].deadline;
+				slot[i] = slot.back();
+				slot.pop_back();
+				--timer_count;
+				return true;
+			}
+		}
+		if (current_tick >= now_tick) {
+			return false;
+		}
+		++current_tick;
+	}
+	current_tick = now_tick;
+	return false;
+}
+
+int TimerWheel::next_timeout_ms(std::chrono::steady_clock::time_point now) const {
+	if (timer_count == 0) {
+		return -1;
+	}
+	// the first slot with a timer in this rotation, otherwise the earliest of all
+	std::chrono::steady_clock::time_point next = std::chrono::steady_clock::time_point::max();
+	for (unsigned int i = 0; i < slot_count; ++i) {
+		for (const Timer& timer : slots[(current_tick + i) % slot_count]) {
+			if (timer.deadline < next) {
+				next = timer.deadline;
+			}
+		}
+		if (next != std::chrono::steady_clock::time_point::max() && tick_of(next) <= current_tick + i) {
+			break;
+		}
+	}
+	if (next <= now) {
+		return 0;
+	}
+	return (int)std::chrono::ceil<std::chrono::milliseconds>(next - now).count();
+}
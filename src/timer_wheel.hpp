@@ -0,0 +1,34 @@
+#pragma once
+#include <chrono>
+#include <vector>
+
+// Hashed timer wheel: timers are bucketed by the tick they expire on,
+// so scheduling is O(1) and expiring only looks at the buckets time has passed
+// timers can't be cancelled, the owner ignores expiries it no longer expects
+class TimerWheel {
+	struct Timer {
+		unsigned long long key;
+		std::chrono::steady_clock::time_point deadline;
+	};
+
+	static const unsigned int slot_count = 128;
+	// every device of 8 receivers connecting within the same tick, as when they all wake up together
+	static const unsigned int reserved_per_slot = 48;
+	const std::chrono::milliseconds tick;
+	// each slot keeps its capacity, so scheduling doesn't allocate
+	std::vector<Timer> slots[slot_count];
+	std::chrono::steady_clock::time_point start;
+	// next tick whose slot hasn't been expired yet
+	unsigned long long current_tick = 0;
+	unsigned int timer_count = 0;
+
+	unsigned long long tick_of(std::chrono::steady_clock::time_point time) const;
+
+public:
+	TimerWheel(std::chrono::milliseconds tick = std::chrono::milliseconds(10));
+	void schedule(unsigned long long key, std::chrono::steady_clock::time_point deadline);
+	// removes one timer that is due, returns false when none are left
+	bool expire(std::chrono::steady_clock::time_point now, unsigned long long& key, std::chrono::steady_clock::time_point& deadline);
+	// milliseconds until the next timer is due, -1 if there are none
+	int next_timeout_ms(std::chrono::steady_clock::time_point now) const;
+};
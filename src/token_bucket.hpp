@@ -0,0 +1,49 @@
+#pragma once
+#include <algorithm>
+#include <chrono>
+
+// Allows rate operations per second on average and bursts of up to burst,
+// tokens refill continuously as time passes
+class TokenBucket {
+	double rate;
+	double burst;
+	double tokens;
+	std::chrono::steady_clock::time_point last;
+
+	void refill(std::chrono::steady_clock::time_point now) {
+		if (now > last) {
+			tokens = std::min(burst, tokens + std::chrono::duration<double>(now - last).count() * rate);
+			last = now;
+		}
+	}
+
+public:
+	TokenBucket(double rate = 1, double burst = 1) : rate(rate), burst(burst), tokens(burst), last(std::chrono::steady_clock::now()) {}
+
+	// keeps the tokens already saved up, up to the new burst
+	void configure(double new_rate, double new_burst) {
+		rate = new_rate;
+		burst = new_burst;
+		tokens = std::min(tokens, burst);
+	}
+	// returns false if the operation has to wait
+	bool take(std::chrono::steady_clock::time_point now) {
+		refill(now);
+		if (tokens < 1) {
+			return false;
+		}
+		tokens -= 1;
+		return true;
+	}
+	// when take will succeed next
+	std::chrono::steady_clock::time_point next_token(std::chrono::steady_clock::time_point now) {
+		refill(now);
+		if (tokens >= 1) {
+			return now;
+		}
+		if (rate <= 0) {
+			return std::chrono::steady_clock::time_point::max();
+		}
+		return now + std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<double>((1 - tokens) / rate));
+	}
+};
@@ -0,0 +1,184 @@
+#include "transition_journal.hpp"
+#include <algorithm>
+#include <cstring>
+
+static const char journal_magic[8] = { 'L', 'U', 'M', 'Q', 'J', 'R', 'N', 'L' };
+static const std::int64_t ms_per_day = 24 * 60 * 60 * 1000;
+
+void TransitionJournal::reset(Segment& segment, std::uint64_t sequence) {
+	// the records past count are never read, so only the header is cleared
+	segment.header->sequence = sequence;
+	segment.header->count = 0;
+	segment.header->day_count = 0;
+	segment.file.flush(0, sizeof(Header));
+}
+
+bool TransitionJournal::open(const std::string& path_prefix, Logger& debug_log) {
+	size_t size = records_offset + sizeof(Record) * records_per_segment;
+	Header expected{};
+	std::memcpy(expected.magic, journal_magic, sizeof(journal_magic));
+	expected.version = version;
+	expected.records_per_segment = records_per_segment;
+	expected.record_size = sizeof(Record);
+	expected.checksum = fnv1a(&expected, offsetof(Header, checksum));
+	std::uint64_t newest = 0;
+	for (unsigned int i = 0; i < segment_count; ++i) {
+		Segment& segment = segments[i];
+		std::string path = path_prefix + "-" + std::to_string(i) + ".bin";
+		bool resized = false;
+		if (!segment.file.open(path, size, resized)) {
+			debug_log.log(LOG_JOURNAL_MAP_FAILED, path);
+			return false;
+		}
+		segment.header = (Header*)segment.file.data();
+		segment.records = (Record*)(segment.file.data() + records_offset);
+		Header& header = *segment.header;
+		bool valid = std::memcmp(&header, &expected, offsetof(Header, sequence)) == 0 && header.count <= records_per_segment && header.day_count <= max_days;
+		if (resized || !valid) {
+			if (!resized) {
+				debug_log.log(LOG_JOURNAL_RESET, path);
+			}
+			std::memset(&header, 0, sizeof(Header));
+			std::memcpy(&header, &expected, offsetof(Header, sequence));
+			segment.file.flush(0, sizeof(Header));
+		}
+		if (header.sequence > newest) {
+			newest = header.sequence;
+			active = i;
+		}
+	}
+	if (newest == 0) {
+		active = 0;
+		reset(segments[0], 1);
+	}
+	opened = true;
+	return true;
+}
+
+void TransitionJournal::append(unsigned int receiver_serial, unsigned char slot, DeviceStatus old_status, DeviceStatus new_status, std::chrono::system_clock::time_point time) {
+	if (!opened) {
+		return;
+	}
+	std::int64_t time_ms = std::chrono::duration_cast<std::chrono::milliseconds>(time.time_since_epoch()).count();
+	std::int32_t day = (std::int32_t)(time_ms / ms_per_day);
+	Header* header = segments[active].header;
+	// a clock set back doesn't get an index entry, its records are found from the day before
+	bool new_day = header->day_count == 0 || day > header->days[header->day_count - 1].day;
+	if (header->count == records_per_segment || (new_day && header->day_count == max_days)) {
+		std::uint64_t sequence = header->sequence + 1;
+		active = (active + 1) % segment_count;
+		reset(segments[active], sequence);
+		header = segments[active].header;
+		new_day = true;
+	}
+	if (new_day) {
+		header->days[header->day_count] = DayIndex{ day, header->count };
+		++header->day_count;
+	}
+	Record& record = segments[active].records[header->count];
+	record.time = time_ms;
+	record.receiver_serial = receiver_serial;
+	record.slot = slot;
+	record.old_status = (std::uint8_t)old_status;
+	record.new_status = (std::uint8_t)new_status;
+	record.reserved = 0;
+	segments[active].file.flush(records_offset + header->count * sizeof(Record), sizeof(Record));
+	++header->count;
+	segments[active].file.flush(0, sizeof(Header));
+}
+
+unsigned int TransitionJournal::first_record(Header const& header, std::int64_t time_ms) {
+	std::int32_t day = (std::int32_t)(time_ms / ms_per_day);
+	unsigned int first = 0;
+	for (unsigned int i = 0; i < header.day_count && header.days[i].day <= day; ++i) {
+		first = header.days[i].first_record;
+	}
+	return std::min(first, header.count);
+}
+
+static void add_time(DeviceUsage& usage, unsigned int status, std::int64_t ms) {
+	if (ms <= 0) {
+		return;
+	}
+	if (status == CONNECTED) {
+		usage.connected_ms += ms;
+	}
+	else if (status == POWERSAVE) {
+		usage.powersave_ms += ms;
+	}
+	else {
+		usage.disconnected_ms += ms;
+	}
+}
+
+void TransitionJournal::usage(std::chrono::system_clock::time_point from, std::chrono::system_clock::time_point to, std::vector<DeviceUsage>& usage) const {
+	if (!opened) {
+		return;
+	}
+	std::int64_t from_ms = std::chrono::duration_cast<std::chrono::milliseconds>(from.time_since_epoch()).count();
+	std::int64_t to_ms = std::chrono::duration_cast<std::chrono::milliseconds>(to.time_since_epoch()).count();
+	// oldest first, the active segment is last
+	const Segment* ordered[segment_count];
+	unsigned int used = 0;
+	for (unsigned int i = 1; i <= segment_count; ++i) {
+		const Segment& segment = segments[(active + i) % segment_count];
+		if (segment.header->sequence != 0 && segment.header->count > 0) {
+			ordered[used++] = &segment;
+		}
+	}
+	if (used == 0) {
+		return;
+	}
+	// nothing is known from before the journal starts
+	from_ms = std::max(from_ms, ordered[0]->records[0].time);
+	// where each device's current status started and what it was
+	struct Progress {
+		bool seen = false;
+		std::int64_t since = 0;
+		unsigned int status = DISCONNECTED;
+	};
+	std::vector<Progress> progress(usage.size());
+	bool done = false;
+	for (unsigned int s = 0; s < used && !done; ++s) {
+		Header const& header = *ordered[s]->header;
+		const Record* records = ordered[s]->records;
+		if (records[header.count - 1].time < from_ms) {
+			continue;
+		}
+		for (unsigned int i = first_record(header, from_ms); i < header.count; ++i) {
+			Record const& record = records[i];
+			if (record.time < from_ms) {
+				continue;
+			}
+			if (record.time >= to_ms) {
+				done = true;
+				break;
+			}
+			for (size_t d = 0; d < usage.size(); ++d) {
+				if (usage[d].receiver_serial != record.receiver_serial || usage[d].slot != record.slot) {
+					continue;
+				}
+				Progress& device = progress[d];
+				if (!device.seen) {
+					// the device had the old status from the start of the span
+					device.seen = true;
+					device.since = from_ms;
+					device.status = record.old_status;
+				}
+				add_time(usage[d], device.status, record.time - device.since);
+				device.since = record.time;
+				device.status = record.new_status;
+				usage[d].connects += record.new_status == CONNECTED;
+				break;
+			}
+		}
+	}
+	for (size_t d = 0; d < usage.size(); ++d) {
+		if (progress[d].seen) {
+			add_time(usage[d], progress[d].status, to_ms - progress[d].since);
+		}
+		else {
+			add_time(usage[d], usage[d].status, to_ms - from_ms);
+		}
+	}
+}
@@ -0,0 +1,93 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+#include "mapped_file.hpp"
+#include "device_registry.hpp"
+#include "logger.hpp"
+
+// How a device spent a span of time, summed from the journal
+struct DeviceUsage {
+	unsigned int receiver_serial;
+	unsigned char slot;
+	// the status now, it holds from the last transition to the end of the span
+	DeviceStatus status;
+	long long connected_ms;
+	long long powersave_ms;
+	long long disconnected_ms;
+	unsigned int connects;
+};
+
+// Every status transition of every device, appended as fixed size records to a ring of memory mapped segments
+// so usage over the last days can be summed without a recorder, the oldest segment is reused once all are full
+//
+// Every segment indexes the first record of each day it holds,
+// so a query skips straight to where its span starts instead of scanning everything before it
+// a record is written before the count is moved past it, so an append cut short by a crash isn't counted
+// a power loss can lose the last records, or leave the count past a record that never reached the disk
+class TransitionJournal {
+	static const std::uint32_t version = 1;
+	static const unsigned int segment_count = 4;
+	static const unsigned int records_per_segment = 16384;
+	// a segment spanning more days than this is closed early
+	static const unsigned int max_days = 64;
+
+	struct DayIndex {
+		// days since the unix epoch
+		std::int32_t day;
+		std::uint32_t first_record;
+	};
+
+	struct Header {
+		char magic[8];
+		std::uint32_t version;
+		std::uint32_t records_per_segment;
+		std::uint32_t record_size;
+		std::uint32_t checksum;
+		// orders the segments, the highest one is appended to, 0 for a segment that was never used
+		std::uint64_t sequence;
+		std::uint32_t count;
+		std::uint32_t day_count;
+		DayIndex days[max_days];
+	};
+
+	struct Record {
+		// unix milliseconds
+		std::int64_t time;
+		std::uint32_t receiver_serial;
+		std::uint8_t slot;
+		std::uint8_t old_status;
+		std::uint8_t new_status;
+		std::uint8_t reserved;
+	};
+
+	static const size_t records_offset = 1024;
+	static_assert(sizeof(Header) <= records_offset, "header doesn't fit");
+	static_assert(sizeof(Record) == 16, "the journal version has to change with the record");
+
+	struct Segment {
+		MappedFile file;
+		Header* header = nullptr;
+		Record* records = nullptr;
+	};
+
+	Segment segments[segment_count];
+	// the segment being appended to
+	unsigned int active = 0;
+	bool opened = false;
+
+	// empties a segment and gives it the next sequence
+	void reset(Segment& segment, std::uint64_t sequence);
+	// the first record that can be at or after time_ms
+	static unsigned int first_record(Header const& header, std::int64_t time_ms);
+
+public:
+	// path_prefix gets -0.bin to -3.bin appended, segments that don't check out are emptied
+	bool open(const std::string& path_prefix, Logger& debug_log);
+	bool is_open() const { return opened; }
+	void append(unsigned int receiver_serial, unsigned char slot, DeviceStatus old_status, DeviceStatus new_status, std::chrono::system_clock::time_point time);
+	// sums [from, to) into the devices in usage, which are filled with the devices and their current status
+	// time before the first record in the journal isn't counted
+	void usage(std::chrono::system_clock::time_point from, std::chrono::system_clock::time_point to, std::vector<DeviceUsage>& usage) const;
+};
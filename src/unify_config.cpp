@@ -0,0 +1,78 @@
+#include "unify_config.hpp"
+#include <cstdlib>
+#include <algorithm>
+#include "common.hpp"
+
+UnifyConfig load_config(const std::string& config_path) {
+	UnifyConfig config;
+	create_default_config(config_path);
+	config.mqtt_address = read_config_value(config_path, "MQTT", "address");
+	config.mqtt_username = read_config_value(config_path, "MQTT", "username");
+	config.mqtt_password = read_config_value(config_path, "MQTT", "password");
+	config.mqtt_discovery_prefix = read_config_value(config_path, "MQTT", "discovery-prefix");
+	for (auto const& [key, value] : read_config_section(config_path, "Powersave")) {
+		if (key == "window") {
+			config.powersave_window = std::chrono::milliseconds(std::strtoul(value.c_str(), nullptr, 10));
+		}
+		else if (key.rfind("window-", 0) == 0) {
+			unsigned short wireless_pid = (unsigned short)std::strtoul(key.c_str() + 7, nullptr, 16);
+			config.powersave_windows.push_back(PowersaveWindow{ wireless_pid, std::chrono::milliseconds(std::strtoul(value.c_str(), nullptr, 10)) });
+		}
+	}
+	std::string log_level = read_config_value(config_path, "Log", "level");
+	if (log_level != "") {
+		config.log_level = parse_log_level(log_level);
+	}
+	std::string log_max_size = read_config_value(config_path, "Log", "max-size-kb");
+	if (log_max_size != "") {
+		config.log_max_size = std::strtoul(log_max_size.c_str(), nullptr, 10) * 1024;
+	}
+	std::string battery_poll_interval = read_config_value(config_path, "Battery", "poll-interval");
+	if (battery_poll_interval != "") {
+		config.battery_poll_interval = std::chrono::seconds(std::strtoul(battery_poll_interval.c_str(), nullptr, 10));
+	}
+	std::string battery_requests_per_second = read_config_value(config_path, "Battery", "requests-per-second");
+	if (battery_requests_per_second != "") {
+		// at least one, otherwise nothing would ever be read
+		config.battery_requests_per_second = std::max(1ul, std::strtoul(battery_requests_per_second.c_str(), nullptr, 10));
+	}
+	std::string diagnostics_interval = read_config_value(config_path, "Diagnostics", "interval");
+	if (diagnostics_interval != "") {
+		config.diagnostics_interval = std::chrono::seconds(std::strtoul(diagnostics_interval.c_str(), nullptr, 10));
+	}
+	std::string mqtt_publishes_per_second = read_config_value(config_path, "MQTT", "publishes-per-second");
+	if (mqtt_publishes_per_second != "") {
+		config.mqtt_publishes_per_second = std::max(1ul, std::strtoul(mqtt_publishes_per_second.c_str(), nullptr, 10));
+	}
+	std::string flap_penalty = read_config_value(config_path, "Flap", "penalty");
+	if (flap_penalty != "") {
+		config.flap_penalty = std::strtoul(flap_penalty.c_str(), nullptr, 10);
+	}
+	std::string flap_suppress_limit = read_config_value(config_path, "Flap", "suppress-limit");
+	if (flap_suppress_limit != "") {
+		config.flap_suppress_limit = std::strtoul(flap_suppress_limit.c_str(), nullptr, 10);
+	}
+	std::string flap_reuse_limit = read_config_value(config_path, "Flap", "reuse-limit");
+	if (flap_reuse_limit != "") {
+		config.flap_reuse_limit = std::strtoul(flap_reuse_limit.c_str(), nullptr, 10);
+	}
+	std::string flap_half_life = read_config_value(config_path, "Flap", "half-life");
+	if (flap_half_life != "") {
+		// at least a second, the penalty has to decay
+		config.flap_half_life = std::chrono::seconds(std::max(1ul, std::strtoul(flap_half_life.c_str(), nullptr, 10)));
+	}
+	// a device is only stable again once its penalty is well below where it became unstable
+	if (config.flap_reuse_limit == 0 || config.flap_reuse_limit >= config.flap_suppress_limit) {
+		config.flap_reuse_limit = config.flap_suppress_limit / 2;
+	}
+	std::string usage_interval = read_config_value(config_path, "Usage", "interval");
+	if (usage_interval != "") {
+		config.usage_interval = std::chrono::seconds(std::strtoul(usage_interval.c_str(), nullptr, 10));
+	}
+	std::string usage_days = read_config_value(config_path, "Usage", "days");
+	if (usage_days != "") {
+		config.usage_days = std::max(1ul, std::strtoul(usage_days.c_str(), nullptr, 10));
+	}
+	config.local_socket = read_config_value(config_path, "Local", "socket");
+	return config;
+}
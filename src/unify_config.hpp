@@ -0,0 +1,57 @@
+#pragma once
+#include <string>
+#include <chrono>
+#include <vector>
+#include "logger.hpp"
+
+// window-<wireless pid> in [Powersave], the window of one model
+struct PowersaveWindow {
+	unsigned short wireless_pid;
+	std::chrono::milliseconds window;
+
+	bool operator==(const PowersaveWindow&) const = default;
+};
+
+// Everything read from config.ini, compared on reload so only what changed is touched
+struct UnifyConfig {
+	std::string mqtt_address;
+	std::string mqtt_username;
+	std::string mqtt_password;
+	std::string mqtt_discovery_prefix;
+	// the default and the models that override it, read here so a connect never reads the file
+	std::chrono::milliseconds powersave_window{ 500 };
+	std::vector<PowersaveWindow> powersave_windows;
+	LogLevel log_level = LOG_INFO;
+	// debug.log is rotated to debug.log.1 past this size
+	size_t log_max_size = 1024 * 1024;
+	// how often battery levels are read, 0 doesn't read them
+	std::chrono::seconds battery_poll_interval{ 600 };
+	// battery requests on all receivers together
+	unsigned int battery_requests_per_second = 2;
+	// how often the latency metrics are published, 0 doesn't publish them
+	std::chrono::seconds diagnostics_interval{ 60 };
+	// status changes add flap_penalty, which halves every flap_half_life,
+	// a device whose penalty passes flap_suppress_limit is published as unstable until it decays to flap_reuse_limit
+	// a penalty of 0 doesn't damp anything
+	unsigned int flap_penalty = 1000;
+	unsigned int flap_suppress_limit = 3000;
+	unsigned int flap_reuse_limit = 1500;
+	std::chrono::seconds flap_half_life{ 30 };
+	// status and battery publishes of all devices together, a storm of changes only publishes the latest
+	unsigned int mqtt_publishes_per_second = 20;
+	// how often each device's usage over the last usage_days is published, 0 doesn't publish it
+	std::chrono::seconds usage_interval{ 3600 };
+	unsigned int usage_days = 7;
+	// local event socket, a path (relative to the config directory) on Linux and a pipe name on Windows,
+	// empty doesn't create one
+	std::string local_socket;
+
+	bool operator==(const UnifyConfig&) const = default;
+	// the MQTT session has to be reconnected
+	bool mqtt_session_changed(const UnifyConfig& other) const {
+		return mqtt_address != other.mqtt_address || mqtt_username != other.mqtt_username || mqtt_password != other.mqtt_password;
+	}
+};
+
+// Writes the default config first if there isn't one
+UnifyConfig load_config(const std::string& config_path);
@@ -1,33 +1,70 @@
 #include "unify_mqtt.hpp"
-#include "common.hpp"
 
-UnifyMQTT::UnifyMQTT(const std::string& address, const std::string& username, const std::string& password, std::ofstream& debug_log) {
-	int rc = MQTTClient_create(&_client, address.c_str(), "logitech-unify-mqtt", MQTTCLIENT_PERSISTENCE_NONE, NULL);
+UnifyMQTT::UnifyMQTT(const std::string& address, const std::string& client_id, const std::string& username, const std::string& password, Logger& debug_log) : _username(username), _password(password) {
+	int rc = MQTTClient_create(&_client, address.c_str(), client_id.c_str(), MQTTCLIENT_PERSISTENCE_NONE, NULL);
 	if (rc != MQTTCLIENT_SUCCESS) {
-		debug_log << curr_time() << "Failed to create MQTT client: " << rc << std::endl;
+		debug_log.log(LOG_MQTT_CREATE_FAILED, rc);
+		_client = nullptr;
+		return;
+	}
+	MQTTClient_setCallbacks(_client, this, &UnifyMQTT::connection_lost, &UnifyMQTT::message_arrived, &UnifyMQTT::delivery_complete);
+}
+UnifyMQTT::~UnifyMQTT() {
+	if (_client != nullptr) {
+		disconnect();
+		MQTTClient_destroy(&_client);
+	}
+}
+void UnifyMQTT::connection_lost(void* context, [[maybe_unused]] char* cause) {
+	UnifyMQTT* mqtt = (UnifyMQTT*)context;
+	mqtt->_connected.store(false, std::memory_order_release);
+	if (mqtt->_on_event) {
+		mqtt->_on_event();
+	}
+}
+int UnifyMQTT::message_arrived([[maybe_unused]] void* context, char* topic, [[maybe_unused]] int topic_length, MQTTClient_message* message) {
+	// nothing is subscribed, but paho needs the callback
+	MQTTClient_freeMessage(&message);
+	MQTTClient_free(topic);
+	return 1;
+}
+void UnifyMQTT::delivery_complete(void* context, [[maybe_unused]] MQTTClient_deliveryToken token) {
+	UnifyMQTT* mqtt = (UnifyMQTT*)context;
+	mqtt->_delivered.fetch_add(1, std::memory_order_release);
+	if (mqtt->_on_event) {
+		mqtt->_on_event();
+	}
+}
+int UnifyMQTT::connect() {
+	if (_client == nullptr) {
+		return MQTTCLIENT_FAILURE;
 	}
 	MQTTClient_connectOptions options = MQTTClient_connectOptions_initializer;
-	options.username = username.c_str();
-	options.password = password.c_str();
-	options.keepAliveInterval = 0;
+	options.username = _username.c_str();
+	options.password = _password.c_str();
+	options.keepAliveInterval = keep_alive_seconds;
+	options.connectTimeout = connect_timeout_seconds;
 	options.cleansession = true;
-	rc = MQTTClient_connect(_client, &options);
-	if (rc != MQTTCLIENT_SUCCESS) {
-		debug_log << curr_time() << "Failed to connect to MQTT server: " << rc << std::endl;
-	}		
+	// more than one message in flight at a time
+	options.reliable = false;
+	options.maxInflightMessages = max_in_flight;
+	int rc = MQTTClient_connect(_client, &options);
+	_connected.store(rc == MQTTCLIENT_SUCCESS, std::memory_order_release);
+	return rc;
 }
-UnifyMQTT::~UnifyMQTT() {
-	MQTTClient_disconnect(_client, 100);
-	MQTTClient_destroy(&_client);
+void UnifyMQTT::disconnect() {
+	if (_connected.exchange(false)) {
+		MQTTClient_disconnect(_client, 100);
+	}
 }
-void UnifyMQTT::publish(const std::string& topic, const std::string& message, bool const& retained, std::ofstream& debug_log) {
+int UnifyMQTT::publish(const std::string& topic, const std::string& message, bool const& retained, MQTTClient_deliveryToken* token) {
 	MQTTClient_message mqtt_msg = MQTTClient_message_initializer;
 	mqtt_msg.payload = (void*)message.c_str();
 	mqtt_msg.payloadlen = message.size();
-	mqtt_msg.qos = 0;
+	mqtt_msg.qos = 1;
 	mqtt_msg.retained = retained;
-	int rc = MQTTClient_publishMessage(_client, topic.c_str(), &mqtt_msg, NULL);
-	if (rc != MQTTCLIENT_SUCCESS) {
-		debug_log << curr_time() << curr_time << "Failed to publish MQTT message: " << rc << " " << topic << " " << message << std::endl;
-	}
+	return MQTTClient_publishMessage(_client, topic.c_str(), &mqtt_msg, token);
+}
+int UnifyMQTT::wait_for_completion(MQTTClient_deliveryToken token, unsigned long timeout_ms) {
+	return MQTTClient_waitForCompletion(_client, token, timeout_ms);
 }
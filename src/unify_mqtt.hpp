@@ -1,12 +1,46 @@
 #pragma once
 #include <MQTTClient.h>
+#include <atomic>
+#include <functional>
 #include <string>
-#include <fstream>
+#include "logger.hpp"
 
+// One MQTT session, connecting and reconnecting is left to the caller
+// messages are published at QoS 1, so the broker acknowledges each of them
 class UnifyMQTT{
-	MQTTClient _client;
+	MQTTClient _client = nullptr;
+	// kept for reconnects, paho only borrows the strings
+	std::string _username;
+	std::string _password;
+	std::atomic<bool> _connected = false;
+	// acknowledgements received, the broker acknowledges in the order messages were published
+	std::atomic<unsigned long long> _delivered = 0;
+	std::function<void()> _on_event;
+
+	static void connection_lost(void* context, char* cause);
+	static int message_arrived(void* context, char* topic, int topic_length, MQTTClient_message* message);
+	static void delivery_complete(void* context, MQTTClient_deliveryToken token);
+
 public:
-	UnifyMQTT(const std::string& address, const std::string& username, const std::string& password, std::ofstream& debug_log);
+	// most messages published but not yet acknowledged
+	static const int max_in_flight = 16;
+	// the broker drops the session if nothing is heard for this long, paho pings in between
+	static const int keep_alive_seconds = 30;
+	// an unresponsive broker holds up the publisher thread for at most this long per attempt
+	static const int connect_timeout_seconds = 10;
+
+	UnifyMQTT(const std::string& address, const std::string& client_id, const std::string& username, const std::string& password, Logger& debug_log);
 	~UnifyMQTT();
-	void publish(const std::string& topic, const std::string& message, bool const& retained, std::ofstream& debug_log);
+	// called on a paho thread when a message is acknowledged or the connection drops
+	void set_event_handler(std::function<void()> handler) { _on_event = std::move(handler); }
+	// returns the paho return code
+	int connect();
+	void disconnect();
+	bool connected() const { return _connected.load(std::memory_order_acquire); }
+	unsigned long long delivered() const { return _delivered.load(std::memory_order_acquire); }
+	// returns the paho return code, MQTTCLIENT_SUCCESS once the message is handed to paho,
+	// delivered counts it once the broker acknowledged it
+	int publish(const std::string& topic, const std::string& message, bool const& retained, MQTTClient_deliveryToken* token);
+	// waits for the broker to acknowledge a message, returns the paho return code
+	int wait_for_completion(MQTTClient_deliveryToken token, unsigned long timeout_ms);
 };
@@ -3,320 +3,1362 @@
 #include <thread>
 #include <vector>
 #include <algorithm>
-#include <optional>
-#include <hidsdi.h>
-#include <setupapi.h>
-#include <lmcons.h>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
 #include "common.hpp"
 #include "../external/json.hpp"
 using json = nlohmann::json;
 
-void UnifyStatus::print_bytes(std::vector<unsigned char> const& bytes) {
-	for (const auto& byte : bytes) {
-		debug_log << curr_time() << std::hex << (int)byte << " ";
+bool UnifyStatus::send_command(unsigned int receiver, HIDPPShortReport const& request, RequestTag tag, unsigned char slot, int timeout_ms) {
+	HIDPPRequestQueue& queue = receivers[receiver].requests;
+	HIDPPRequest tracked{ receiver, tag, slot, hidpp_request_key(request.bytes), {} };
+	if (timeout_ms <= 0) {
+		timeout_ms = response_timeout_ms;
 	}
+	if (!queue.busy()) {
+		return write_command(receiver, request, tracked, timeout_ms);
+	}
+	if (!queue.wait(request, tracked, timeout_ms)) {
+		debug_log.log(LOG_REQUESTS_FULL, receivers[receiver].serial, request_tag_names[tag], slot);
+		return false;
+	}
+	return true;
 }
-bool UnifyStatus::check_response(HANDLE usb, std::vector<unsigned char> const& bytes_to_check, std::vector<unsigned char>& response) {
-		read_usb(usb, response);
-		for (int i = 0; i < bytes_to_check.size(); ++i) {
-			if (response[i] != bytes_to_check[i]) {
-				break;
-			}
-			if (i == bytes_to_check.size() - 1) {
-				return true;
-			}
+
+bool UnifyStatus::write_command(unsigned int receiver, HIDPPShortReport const& report, HIDPPRequest request, int timeout_ms) {
+	HIDPPRequestQueue& queue = receivers[receiver].requests;
+	request.deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeout_ms);
+	// tracked before it is written, so the reply always finds it
+	int slot = queue.reserve(request);
+	if (slot < 0) {
+		return false;
+	}
+	if (!transport->write(receiver, report.bytes, report.size)) {
+		queue.release(slot);
+		debug_log.log(LOG_WRITE_FAILED, receivers[receiver].serial, request_tag_names[request.tag], request.slot);
+		return false;
+	}
+	return true;
+}
+
+void UnifyStatus::send_waiting(unsigned int receiver) {
+	HIDPPRequestQueue::Waiting waiting;
+	while (receiver < receivers.size() && receivers[receiver].requests.next_waiting(waiting)) {
+		if (!write_command(receiver, waiting.report, waiting.request, waiting.timeout_ms)) {
+			// whoever sent it was told it would complete
+			complete_request(waiting.request, nullptr);
+		}
+	}
+}
+
+int UnifyStatus::request_timeout_ms(std::chrono::steady_clock::time_point now) {
+	int timeout_ms = -1;
+	for (const ReceiverData& data : receivers) {
+		int receiver_ms = data.requests.next_timeout_ms(now);
+		if (receiver_ms >= 0 && (timeout_ms < 0 || receiver_ms < timeout_ms)) {
+			timeout_ms = receiver_ms;
 		}
+	}
+	return timeout_ms;
+}
+
+bool UnifyStatus::open_receivers() {
+	std::vector<unsigned int> opened;
+	bool all_opened = transport->open_receivers(unify_hid_primary, unify_hid_responder, opened);
+	for (unsigned int receiver : opened) {
+		if (receiver >= receivers.size()) {
+			receivers.resize(receiver + 1);
+		}
+		receivers[receiver] = ReceiverData();
+		receivers[receiver].open = true;
+		// everything else waits on the serial, the rest happens as replies arrive
+		request_receiver_serial(receiver);
+	}
+	bool any_open = false;
+	for (const auto& receiver : receivers) {
+		any_open |= receiver.open;
+	}
+	if (!any_open) {
+		debug_log.log(LOG_WAITING_ON_RECEIVER);
+	}
+	return all_opened;
+}
+
+void UnifyStatus::close_receiver(unsigned int receiver) {
+	transport->close_receiver(receiver);
+	if (receiver < receivers.size()) {
+		receivers[receiver].open = false;
+		receivers[receiver].ready = false;
+		receivers[receiver].requests.clear();
+	}
+}
+
+void UnifyStatus::request_receiver_serial(unsigned int receiver) {
+	// the receiver info page of the pairing information register holds the serial
+	const HIDPPShortReport get_receiver_info_cmd = hidpp_register_request(hidpp_receiver_index, HIDPP_GET_LONG_REGISTER, HIDPP_REGISTER_PAIRING_INFORMATION, HIDPP_PAIRING_RECEIVER_INFO);
+	if (!send_command(receiver, get_receiver_info_cmd, REQUEST_RECEIVER_SERIAL)) {
+		// still unique between the receivers that are plugged in
+		receiver_ready(receiver, receiver);
+	}
+}
+
+void UnifyStatus::receiver_ready(unsigned int receiver, unsigned int serial) {
+	ReceiverData& data = receivers[receiver];
+	data.serial = serial;
+	data.ready = true;
+	set_receiver_topics(receiver);
+	debug_log.log(LOG_RECEIVER_OPENED, serial);
+	// publish what was known before the restart right away, the receiver only confirms it
+	// a receiver that is plugged back in keeps what this run already knows, the cache can only be older
+	std::vector<DeviceData> cached = state_cache.load(serial);
+	bool seeded = false;
+	for (DeviceData const& cached_device : cached) {
+		if (devices.find(serial, cached_device.slot) != nullptr) {
+			continue;
+		}
+		DeviceData& device = devices.get(serial, cached_device.slot);
+		device = cached_device;
+		process_device_status(receiver, device);
+		device.status_published = true;
+		seeded = true;
+	}
+	if (seeded) {
+		update_mqtt_discovery(receiver);
+	}
+	enable_wireless_notifications(receiver);
+	// ask every slot what is paired in it at once, unpaired slots answer with an error
+	// paired slots don't have to be contiguous, so this also finds devices after an unpaired slot
+	// names are only requested for slots whose pairing changed
+	data.pending_startup = 0;
+	for (unsigned char slot = 1; slot <= DeviceRegistry::max_slot; ++slot) {
+		data.pending_startup += request_device_info(receiver, slot);
+	}
+	if (data.pending_startup == 0) {
+		update_mqtt_discovery(receiver);
+	}
+}
+
+void UnifyStatus::enable_wireless_notifications(unsigned int receiver) {
+	// Ensure wireless notifications are enabled by writing to 0x00 register
+	// the HID driver may read the register back afterwards, that reply isn't tracked and is ignored
+	const HIDPPShortReport enable_notifications_cmd = hidpp_register_request(hidpp_receiver_index, HIDPP_SET_REGISTER, HIDPP_REGISTER_NOTIFICATIONS, 0x00, 0x01, 0x00);
+	receivers[receiver].notifications_pending = send_command(receiver, enable_notifications_cmd, REQUEST_ENABLE_NOTIFICATIONS);
+}
+
+bool UnifyStatus::request_device_name(unsigned int receiver, unsigned char slot) {
+	// the name page of the pairing information register is ored with the 0 indexed slot
+	const HIDPPShortReport get_name_cmd = hidpp_register_request(hidpp_receiver_index, HIDPP_GET_LONG_REGISTER, HIDPP_REGISTER_PAIRING_INFORMATION, HIDPP_PAIRING_DEVICE_NAME | (slot - 1));
+	// a device reconnecting several times before the name arrives only needs one request
+	if (receivers[receiver].requests.pending(hidpp_request_key(get_name_cmd.bytes))) {
 		return false;
 	}
+	return send_command(receiver, get_name_cmd, REQUEST_DEVICE_NAME, slot);
+}
 
-std::string UnifyStatus::find_hid_path(LPGUID hid_guid, HIDDevicePath path_to_find) {
-	HDEVINFO info = SetupDiGetClassDevsW(hid_guid, NULL, NULL, DIGCF_PRESENT | DIGCF_DEVICEINTERFACE);
-	SP_DEVICE_INTERFACE_DATA device_data;
-	device_data.cbSize = sizeof(SP_DEVICE_INTERFACE_DATA);
-	std::string device_path;
-	// SetupDiEnumDeviceInterfaces returns false when i is greater than the number of devices
-	for (int i = 0; SetupDiEnumDeviceInterfaces(info, NULL, hid_guid, i, &device_data); ++i) {
-		// Get required size
-		DWORD required_size;
-		SetupDiGetDeviceInterfaceDetailA(info, &device_data, NULL, 0, &required_size, NULL);
-		// allocate enough space for the device path
-		PSP_DEVICE_INTERFACE_DETAIL_DATA_A device_detail_data = (PSP_DEVICE_INTERFACE_DETAIL_DATA_A)malloc(required_size);
-		// check for null malloc
-		if (device_detail_data == NULL) {
-			debug_log << curr_time() << "null malloc" << std::endl;
-			exit(1);
+bool UnifyStatus::request_device_info(unsigned int receiver, unsigned char slot) {
+	const HIDPPShortReport get_info_cmd = hidpp_register_request(hidpp_receiver_index, HIDPP_GET_LONG_REGISTER, HIDPP_REGISTER_PAIRING_INFORMATION, HIDPP_PAIRING_DEVICE_INFO | (slot - 1));
+	return send_command(receiver, get_info_cmd, REQUEST_DEVICE_INFO, slot);
+}
+
+void UnifyStatus::probe_device(unsigned int receiver, DeviceData& device) {
+	// the receiver doesn't say which devices are connected, but it answers for the ones it can't reach,
+	// so a ping tells them apart without waiting for them to reconnect
+	ReceiverData& data = receivers[receiver];
+	unsigned int bit = 1u << (device.slot - 1);
+	if ((data.probes_waiting & bit) == 0) {
+		data.probes_waiting |= bit;
+		++data.pending_probes;
+	}
+	device.probe_pending = true;
+	send_probes(receiver);
+}
+
+void UnifyStatus::send_probes(unsigned int receiver) {
+	ReceiverData& data = receivers[receiver];
+	while (data.probes_waiting != 0 && data.probes_in_flight < max_probes_in_flight) {
+		unsigned char slot = 1;
+		while ((data.probes_waiting & (1u << (slot - 1))) == 0) {
+			++slot;
+		}
+		data.probes_waiting &= ~(1u << (slot - 1));
+		DeviceData* device = devices.find(data.serial, slot);
+		// a connection notification while it waited already told what the device is doing
+		if (device == nullptr || !device->probe_pending) {
+			--data.pending_probes;
+			continue;
+		}
+		const HIDPPShortReport ping_cmd = hidpp20_ping_request(slot, slot);
+		if (send_command(receiver, ping_cmd, REQUEST_PING, slot, probe_timeout_ms)) {
+			++data.probes_in_flight;
 		}
 		else {
-			device_detail_data->cbSize = sizeof(SP_DEVICE_INTERFACE_DETAIL_DATA);
-			// get the device path
-			SetupDiGetDeviceInterfaceDetailA(info, &device_data, device_detail_data, required_size, NULL, NULL);
-			device_path = device_detail_data->DevicePath;
-			// Check if the device path is correct
-			if (device_path.find(path_to_find.vid) != std::string::npos) {
-				if (device_path.find(path_to_find.pid) != std::string::npos) {
-					if (device_path.find(path_to_find.mi) != std::string::npos) {
-						if (device_path.find(path_to_find.col) != std::string::npos) {
-							free(device_detail_data);
-							return device_path;
-						}
+			device->probe_pending = false;
+			--data.pending_probes;
+		}
+	}
+}
+
+void UnifyStatus::complete_probe(HIDPPRequest const& request, const HIDPPMessage* reply) {
+	unsigned int receiver = request.receiver;
+	if (receivers[receiver].pending_probes > 0) {
+		--receivers[receiver].pending_probes;
+	}
+	if (receivers[receiver].probes_in_flight > 0) {
+		--receivers[receiver].probes_in_flight;
+	}
+	send_probes(receiver);
+	DeviceData* device = devices.find(receivers[receiver].serial, request.slot);
+	// a connection notification since the ping went out already told what the device is doing
+	if (device == nullptr || !device->probe_pending) {
+		return;
+	}
+	device->probe_pending = false;
+	DeviceStatus status;
+	if (reply == nullptr || (reply->kind == HIDPP_ERROR_REPLY && reply->error.error_code == hidpp_error_unreachable)) {
+		// a device in powersave can't be reached either, the cached powersave is kept
+		if (device->status_published && device->status == POWERSAVE) {
+			return;
+		}
+		status = DISCONNECTED;
+	}
+	else if (reply->kind == HIDPP20_MESSAGE && reply->feature.params_size >= 2) {
+		debug_log.log(LOG_DEVICE_PROBED, device->receiver_serial, device->slot, reply->feature.params[0], reply->feature.params[1]);
+		status = CONNECTED;
+	}
+	else if ((reply->kind == HIDPP_ERROR_REPLY && reply->error.error_code == hidpp_error_invalid_sub_id) || reply->kind == HIDPP20_ERROR_REPLY) {
+		// the device itself answered
+		debug_log.log(LOG_DEVICE_PROBED, device->receiver_serial, device->slot, 1, 0);
+		status = CONNECTED;
+	}
+	else {
+		// any other error says nothing about the device, what was known is kept
+		return;
+	}
+	// no report is behind the status, its latency isn't recorded
+	device->event_read_time = {};
+	device->event_decode_time = {};
+	set_device_status(receiver, *device, status);
+}
+
+void UnifyStatus::startup_request_done(unsigned int receiver, bool changed) {
+	ReceiverData& data = receivers[receiver];
+	// discovery is published once for everything found while opening
+	if (data.pending_startup > 0) {
+		if (--data.pending_startup == 0) {
+			update_mqtt_discovery(receiver);
+		}
+	}
+	else if (changed) {
+		update_mqtt_discovery(receiver);
+	}
+}
+
+void UnifyStatus::complete_request(HIDPPRequest const& request, const HIDPPMessage* reply) {
+	unsigned int receiver = request.receiver;
+	switch (request.tag) {
+		case REQUEST_RECEIVER_SERIAL:
+			if (reply && reply->kind == HIDPP_RECEIVER_INFO_REPLY) {
+				receiver_ready(receiver, reply->receiver_info.serial);
+			}
+			else {
+				debug_log.log(LOG_SERIAL_FAILED);
+				// still unique between the receivers that are plugged in
+				receiver_ready(receiver, receiver);
+			}
+			break;
+		case REQUEST_ENABLE_NOTIFICATIONS:
+			receivers[receiver].notifications_pending = false;
+			if (!reply || reply->kind != HIDPP_REGISTER_REPLY) {
+				debug_log.log(LOG_NOTIFICATIONS_FAILED);
+			}
+			break;
+		case REQUEST_DEVICE_INFO: {
+			unsigned int serial = receivers[receiver].serial;
+			bool changed = false;
+			if (reply && reply->kind == HIDPP_DEVICE_INFO_REPLY) {
+				bool added;
+				DeviceData& device = devices.get(serial, request.slot, &added);
+				// a different model in the slot means it was paired again
+				if (added || device.wireless_pid != reply->device_info.wireless_pid || device.name == "") {
+					if (device.wireless_pid != reply->device_info.wireless_pid) {
+						device.forget_pairing();
 					}
+					device.wireless_pid = reply->device_info.wireless_pid;
+					device.name = "";
+					receivers[receiver].pending_startup += request_device_name(receiver, request.slot);
 				}
+				probe_device(receiver, device);
 			}
-			// free the device data so it can be alloced again if needed
-			free(device_detail_data);
+			else if (reply) {
+				// an error means nothing is paired in the slot anymore
+				if (devices.remove(serial, request.slot)) {
+					state_cache.remove(serial, request.slot);
+					changed = true;
+				}
+			}
+			else {
+				debug_log.log(LOG_DEVICE_INFO_FAILED, request.slot);
+			}
+			startup_request_done(receiver, changed);
+			break;
+		}
+		case REQUEST_PING:
+			complete_probe(request, reply);
+			break;
+		case REQUEST_BATTERY_FEATURE:
+		case REQUEST_BATTERY:
+			complete_battery_request(request, reply);
+			break;
+		case REQUEST_DEVICE_NAME: {
+			bool changed = false;
+			if (reply && reply->kind == HIDPP_NAME_REPLY) {
+				bool added;
+				DeviceData& device = devices.get(receivers[receiver].serial, request.slot, &added);
+				std::string name(reply->name.name, reply->name.length);
+				changed = added || device.name != name;
+				device.name = name;
+				if (changed) {
+					state_cache.store(device);
+				}
+			}
+			else if (!reply) {
+				debug_log.log(LOG_DEVICE_NAME_FAILED, request.slot);
+			}
+			startup_request_done(receiver, changed);
+			break;
 		}
 	}
-	return "";
 }
 
-void UnifyStatus::find_and_wait_on_receiver() {
-	GUID hid_guid;
-	HidD_GetHidGuid(&hid_guid);
-	// wait until receiver is found
-	while (!quit) {
-		unify_primary_path = find_hid_path(&hid_guid, unify_hid_primary);
-		unify_responder_path = find_hid_path(&hid_guid, unify_hid_responder);
-		if (unify_primary_path != "" && unify_responder_path != "") {
-			break;
+void UnifyStatus::expire_requests() {
+	HIDPPRequest request;
+	for (unsigned int receiver = 0; receiver < receivers.size(); ++receiver) {
+		while (receivers[receiver].requests.expire(std::chrono::steady_clock::now(), request)) {
+			complete_request(request, nullptr);
+			send_waiting(receiver);
 		}
-		// check for receiver every second
-		// debug log runs if either path check fails
-		std::this_thread::sleep_for(std::chrono::milliseconds(1000));
-		debug_log << curr_time() << "waiting on receiver" << std::endl;
 	}
 }
 
-bool UnifyStatus::read_usb(HANDLE usb, std::vector<unsigned char>& buffer, LPDWORD bytes_read){
-	return ReadFile(usb, buffer.data(), buffer.capacity(), bytes_read, NULL);
-} 
-bool UnifyStatus::write_usb(HANDLE usb, std::vector<unsigned char> const& buffer){
-	return WriteFile(usb, buffer.data(), buffer.capacity(), NULL, NULL);
+void UnifyStatus::log_publisher_stats() {
+	MQTTPublisherStats stats = publisher->stats();
+	if (stats.connected != logged_publisher_stats.connected) {
+		if (stats.connected) {
+			debug_log.log(LOG_MQTT_CONNECTED, stats.spooled);
+		}
+		else if (logged_publisher_stats.connected) {
+			debug_log.log(LOG_MQTT_DISCONNECTED);
+		}
+	}
+	if (stats.connect_failures != logged_publisher_stats.connect_failures) {
+		debug_log.log(LOG_MQTT_CONNECT_FAILED, stats.last_connect_error, stats.connect_failures);
+	}
+	if (stats.dropped != logged_publisher_stats.dropped) {
+		debug_log.log(LOG_MQTT_QUEUE_FULL, stats.dropped - logged_publisher_stats.dropped, stats.high_water);
+	}
+	if (stats.spool_dropped != logged_publisher_stats.spool_dropped) {
+		debug_log.log(LOG_MQTT_SPOOL_FULL, stats.spool_dropped - logged_publisher_stats.spool_dropped);
+	}
+	if (stats.failed != logged_publisher_stats.failed) {
+		debug_log.log(LOG_MQTT_PUBLISH_FAILED, stats.failed - logged_publisher_stats.failed, stats.last_error);
+	}
+	logged_publisher_stats = stats;
 }
 
+void UnifyStatus::finish_startup_stage(StartupStage stage) {
+	if (startup.finish(stage, std::chrono::steady_clock::now())) {
+		debug_log.log(LOG_STARTUP_STAGE, startup_stage_names[stage], (unsigned int)startup.finished[stage].count());
+	}
+}
 
-void UnifyStatus::enable_wireless_notifications() {
-	// Ensure wireless notifications are enabled by writing to 0x00 register
-	// https://lekensteyn.nl/files/logitech/logitech_hidpp10_specification_for_Unifying_Receivers.pdf
-	const std::vector<unsigned char> enable_notifications_cmd = {0x10, 0xff, 0x80, 0x00, 0x00, 0x01, 0x00};
-	write_usb(receiver, enable_notifications_cmd);
-	std::vector<unsigned char> response_buffer(7);	
-	// Read and check success response from receiver
-	const std::vector<unsigned char> enable_notifications_success = {0x10, 0xff, 0x80, 0x00};
-	if (!check_response(receiver, enable_notifications_success, response_buffer)) {
-		debug_log << curr_time() << "warning: failed to confirm enabled notifications: ";
-		print_bytes(response_buffer);
-		debug_log << curr_time() << std::endl;
-	}
-	// For some reason, the HID driver sends a notification read command as well,
-	// and so this driver needs to wait for the notification read response
-	const std::vector<unsigned char> notification_read_success = {0x10, 0xff, 0x81, 0x00};
-	if (!check_response(receiver, notification_read_success, response_buffer)) {
-		debug_log << curr_time() << "warning: failed to confirm notification read after enable: ";
-		print_bytes(response_buffer);
-		debug_log << curr_time() << std::endl;
-	}
-}
-
-void UnifyStatus::get_paired_devices() {
-	const std::vector<unsigned char> get_connected_devices_count_cmd = {0x10, 0xff, 0x81, 0x02, 0x00, 0x00, 0x00};
-	write_usb(receiver, get_connected_devices_count_cmd);
-	const std::vector<unsigned char> connected_devices_response_check = {0x10, 0xff, 0x81, 0x02, 0x00};
-	std::vector<unsigned char> response_buffer(7);
-	if (check_response(receiver, connected_devices_response_check, response_buffer)) {
-		unsigned int paired_devices_count = (int)response_buffer[5];
-		devices_info.resize(paired_devices_count);
-		for (int i = 0; i < paired_devices_count; ++i) {
-			devices_info[i].name = get_device_name(i);
+void UnifyStatus::check_startup() {
+	if (startup_ready && startup.done[STARTUP_BROKER]) {
+		return;
+	}
+	if (logged_publisher_stats.connected) {
+		finish_startup_stage(STARTUP_BROKER);
+	}
+	// with several receivers a stage is done once it is done on all of them
+	bool any_ready = false;
+	bool notifications = true;
+	bool enumerated = true;
+	bool probed = true;
+	for (const ReceiverData& receiver : receivers) {
+		if (!receiver.open) {
+			continue;
 		}
+		if (!receiver.ready) {
+			notifications = enumerated = probed = false;
+			continue;
+		}
+		any_ready = true;
+		notifications &= !receiver.notifications_pending;
+		enumerated &= receiver.pending_startup == 0;
+		probed &= receiver.pending_probes == 0;
 	}
-	else {
-		debug_log << curr_time() << "warning: failed to get paired devices: ";
-		print_bytes(response_buffer);
-		debug_log << curr_time() << std::endl;
-	}
-}
-
-// NOTE:
-// device_id should be zero indexed
-std::string UnifyStatus::get_device_name(unsigned int device_id){
-	// get name command needs the 7th bit set in a 0 indexed device id
-	unsigned char correct_id = device_id | 0x40;
-	const std::vector<unsigned char> get_name_cmd = {0x10, 0xff, 0x83, 0xb5, correct_id, 0x00, 0x00};
-	write_usb(receiver, get_name_cmd);
-	// For some reason, after the device sends a connected message,
-	// the receiver sends an undocumented packet before sending the name
-	if (devices_info[device_id].status == CONNECTED) {
-		const std::vector<unsigned char> undocumented_response_check = { 0x11, 0x01, 0x04 };
-		std::vector<unsigned char> undocumented_response(20);
-		if (!check_response(responder, undocumented_response_check, undocumented_response)) {
-			debug_log << curr_time() << "warning: failed to read undocumented response: ";
-			print_bytes(undocumented_response);
-			debug_log << curr_time() << std::endl;
-		}
-	}
-	std::vector<unsigned char> name_response_buffer(20);
-	const std::vector<unsigned char> name_response_check = { 0x11, 0xff, 0x83, 0xb5 };
-	if(check_response(responder, name_response_check, name_response_buffer)) {
-		unsigned char name_length = name_response_buffer[5];
-		// device name is from the 6th byte to the length in the 5th byte
-		std::string name(name_response_buffer.begin() + 6, name_response_buffer.begin() + 6 + name_length);
-		return name;
+	if (any_ready) {
+		finish_startup_stage(STARTUP_RECEIVER);
+		if (notifications) {
+			finish_startup_stage(STARTUP_NOTIFICATIONS);
+		}
+		// pings are sent as the pairing info arrives, so they are only all in flight once enumeration is done
+		if (enumerated) {
+			finish_startup_stage(STARTUP_DEVICES);
+			if (probed) {
+				finish_startup_stage(STARTUP_PROBE);
+			}
+		}
 	}
-	else {
-		debug_log << curr_time() << "warning: failed to find name for device: " << (unsigned int)device_id << " bytes: ";
-		print_bytes(name_response_buffer);
-		debug_log << curr_time() << std::endl;
-		return "";
+	std::chrono::steady_clock::duration elapsed = std::chrono::steady_clock::now() - startup.started;
+	for (unsigned int stage = 0; stage < startup_stage_count; ++stage) {
+		if (!startup.done[stage] && !startup.late[stage] && startup_timeouts[stage].count() > 0 && elapsed >= startup_timeouts[stage]) {
+			startup.late[stage] = true;
+			debug_log.log(LOG_STARTUP_STAGE_LATE, startup_stage_names[stage], (unsigned int)startup_timeouts[stage].count());
+		}
 	}
+	if (startup_ready) {
+		return;
+	}
+	// the broker isn't waited on, messages are spooled until it is there
+	unsigned int slowest = STARTUP_RECEIVER;
+	for (unsigned int stage = STARTUP_RECEIVER; stage < startup_stage_count; ++stage) {
+		if (!startup.done[stage]) {
+			return;
+		}
+		if (startup.finished[stage] >= startup.finished[slowest]) {
+			slowest = stage;
+		}
+	}
+	startup_ready = true;
+	state_changed = true;
+	// every device has its status now
+	if (usage_enabled()) {
+		next_usage = std::chrono::steady_clock::now();
+	}
+	debug_log.log(LOG_STARTUP_READY, (unsigned int)startup.finished[slowest].count(), startup_stage_names[slowest]);
+}
+
+int UnifyStatus::startup_timeout_ms(std::chrono::steady_clock::time_point now) {
+	int timeout_ms = -1;
+	for (unsigned int stage = 0; stage < startup_stage_count; ++stage) {
+		if (startup.done[stage] || startup.late[stage] || startup_timeouts[stage].count() == 0) {
+			continue;
+		}
+		int stage_ms = (int)std::max<long long>(0, std::chrono::ceil<std::chrono::milliseconds>(startup.started + startup_timeouts[stage] - now).count());
+		if (timeout_ms < 0 || stage_ms < timeout_ms) {
+			timeout_ms = stage_ms;
+		}
+	}
+	return timeout_ms;
+}
+
+void UnifyStatus::set_receiver_topics(unsigned int receiver) {
+	ReceiverData& data = receivers[receiver];
+	build_receiver_topics(config.mqtt_discovery_prefix, data.serial, data.topics);
+	for (DiscoveryComponent& component : data.components) {
+		component = DiscoveryComponent();
+	}
+	data.discovery_header = discovery_header(data.serial);
+	// a new prefix or broker has no config yet
+	data.published_config = "";
+}
+
+void UnifyStatus::update_mqtt_discovery(unsigned int receiver) {
+	// called whenever devices are added, removed or renamed
+	state_changed = true;
+	ReceiverData& data = receivers[receiver];
+	bool present[DeviceRegistry::max_slot] = {};
+	for (const DeviceData* device : devices.receiver_devices(data.serial)) {
+		present[device->slot - 1] = true;
+		update_discovery_component(data.components[device->slot - 1], data.serial, device->slot, device->name, device->battery_feature != 0, usage_enabled(), data.topics);
+	}
+	for (unsigned char slot = 0; slot < DeviceRegistry::max_slot; ++slot) {
+		data.components[slot].present = present[slot];
+	}
+	std::string payload;
+	payload.reserve(data.published_config.size() + 256);
+	discovery_config(data.discovery_header, data.components, payload);
+	if (payload == data.published_config) {
+		return;
+	}
+	publisher->publish(data.topics.config, payload, true);
+	data.published_config = std::move(payload);
+}
+
+std::string UnifyStatus::diagnostics_topic() {
+	return config.mqtt_discovery_prefix + "/device/logitech-unify-mqtt/diagnostics";
+}
+
+std::string UnifyStatus::diagnostics_config_topic() {
+	return config.mqtt_discovery_prefix + "/device/logitech-unify-mqtt/config";
 }
 
-void UnifyStatus::update_mqtt_discovery() {
+void UnifyStatus::update_diagnostics_discovery() {
+	if (config.diagnostics_interval.count() == 0) {
+		publisher->publish(diagnostics_config_topic(), "", true);
+		return;
+	}
 	json payload;
-	payload["dev"] = { {"ids", "logitech-unify-mqtt"}, {"name", "Logitech Unify Receiver"}};
-	payload["o"] = { {"name", "logitech-unify-mqtt"}, {"url", "https://github.com/bobby3605/logitech-unify-mqtt"}};
+	payload["dev"] = { {"ids", "logitech-unify-mqtt"}, {"name", "Logitech Unify MQTT"} };
+	payload["o"] = { {"name", "logitech-unify-mqtt"}, {"url", "https://github.com/bobby3605/logitech-unify-mqtt"} };
 	payload["qos"] = 0;
-	payload["cmps"] = json::object();
-	for (int i = 0; i < devices_info.size(); ++i) {
-		std::string dev = "dev" + std::to_string(i);
-		payload["cmps"][dev] = {
-			{ "p", "sensor" },
-			{ "state_topic", mqtt_prefix + dev + "/power_state" },
-			{ "unique_id", dev},
-			{ "name", devices_info[i].name}
+	payload["cmps"]["diagnostics"] = {
+		{ "p", "sensor" },
+		{ "state_topic", diagnostics_topic() },
+		{ "value_template", "{{ value_json.stages.total.p99 }}" },
+		{ "json_attributes_topic", diagnostics_topic() },
+		{ "unit_of_measurement", "\xc2\xb5s" },
+		{ "entity_category", "diagnostic" },
+		{ "unique_id", "logitech-unify-mqtt_diagnostics" },
+		{ "name", "Latency p99" }
+	};
+	publisher->publish(diagnostics_config_topic(), payload.dump(), true);
+}
+
+void UnifyStatus::publish_usage() {
+	std::vector<DeviceUsage> usage;
+	for (const DeviceData& device : devices.all()) {
+		usage.push_back(DeviceUsage{ device.receiver_serial, device.slot, device.status, 0, 0, 0, 0 });
+	}
+	std::chrono::system_clock::time_point now = std::chrono::system_clock::now();
+	journal.usage(now - std::chrono::hours(24) * config.usage_days, now, usage);
+	for (const DeviceUsage& device : usage) {
+		int receiver = find_receiver(device.receiver_serial);
+		if (receiver < 0) {
+			continue;
+		}
+		// how much of the time the device was awake it spent in power save
+		long long awake_ms = device.connected_ms + device.powersave_ms;
+		json payload = {
+			{ "connected_hours", std::round(device.connected_ms / 36000.0) / 100 },
+			{ "powersave_hours", std::round(device.powersave_ms / 36000.0) / 100 },
+			{ "powersave_ratio", awake_ms > 0 ? std::round(1000.0 * device.powersave_ms / awake_ms) / 1000 : 0.0 },
+			{ "connects", device.connects },
+			{ "days", config.usage_days }
 		};
+		publisher->publish(receivers[receiver].topics.usage[device.slot - 1], payload.dump(), false);
 	}
-	std::string topic = mqtt_prefix + "config";
-	_mqtt->publish(topic, payload.dump(), true, debug_log);
-}
-
-void UnifyStatus::process_device_status(unsigned int device_id){
-	std::string topic = mqtt_prefix + "dev" + std::to_string(device_id) + "/power_state";
-	_mqtt->publish(topic, status_to_string.at(devices_info[device_id].status), false, debug_log);
-}
-
-void UnifyStatus::read_notifications() {
-	receiver = CreateFileA(unify_primary_path.c_str(), GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
-	responder = CreateFileA(unify_responder_path.c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
-	enable_wireless_notifications();
-	std::vector<unsigned char> tmp(1);
-	get_paired_devices();
-	update_mqtt_discovery();
-	std::vector<unsigned char> read_buffer(notification_byte_size);
-	DWORD bytes_read;
-	// set the start time to 0 to ensure that a first connection isn't an erroneous powersave
-	std::chrono::steady_clock::time_point start_time = std::chrono::steady_clock::now();
-	start_time -= start_time.time_since_epoch();
-	for (auto& device : devices_info) {
-		device.last_connected_packet_time = start_time;
-	}
-	while (!quit) {
-		// keep reading the device until it has an error
-		if (read_usb(receiver, read_buffer, &bytes_read)) {
-			// get the time the packet was received
-			std::chrono::steady_clock::time_point current_packet_time = std::chrono::steady_clock::now();
-			// only process if notification_byte_size bytes were read
-			if (bytes_read == read_buffer.capacity()) {
-				// check if the data is a device connection status notification
-				if (read_buffer[0] == 0x10 && read_buffer[2] == 0x41) {
-					// devices are 1 indexed on the receiver,
-					if (read_buffer[1] > devices_info.size()) {
-						devices_info.resize(read_buffer[1]);
-						update_mqtt_discovery();
-					}
-					// convert the device id to be 0 indexed
-					unsigned int device_id = read_buffer[1] - 1;
-					DeviceData* device_info = &devices_info[device_id];
-					// 0xa1 is device connection
-					if (read_buffer[4] == 0xa1) {
-						device_info->last_connected_packet_time = std::chrono::steady_clock::now();
-						device_info->status = CONNECTED;
-						if (device_info->name == "") {
-							device_info->name = get_device_name(device_id);
-						}
-					}
-					// 0x61 is device disconnection
-					else if (read_buffer[4] == 0x61) {
-						auto packet_time_ms = std::chrono::duration_cast<std::chrono::milliseconds>(current_packet_time - device_info->last_connected_packet_time).count();
-						// when the device goes into power saving mode,
-						// it will send a connection message,
-						// then 400ms later it will send a disconnection message
-						// so if the time between two packets is less than 500ms,
-						// the keyboard should be in power saving mode
-						if (packet_time_ms < 500) {
-							device_info->status = POWERSAVE;
-						}
-						else {
-							device_info->status = DISCONNECTED;
-						}
-					}	
-					// NOTE:
-					// process_device_status will run twice in the case of a power save
-					// first for the connected status,
-					// then again for the powersave status
-					process_device_status(device_id);
-				}
+}
+
+void UnifyStatus::publish_diagnostics() {
+	MQTTPublisherStats stats = publisher->stats();
+	json payload;
+	payload["reports"] = metrics.reports_read.load(std::memory_order_relaxed);
+	payload["ignored"] = metrics.reports_ignored.load(std::memory_order_relaxed);
+	payload["published"] = stats.published;
+	payload["failed"] = stats.failed;
+	payload["dropped"] = stats.dropped;
+	payload["reconnects"] = metrics.reconnects.load(std::memory_order_relaxed);
+	payload["suppressed"] = metrics.status_suppressed.load(std::memory_order_relaxed);
+	payload["deferred"] = metrics.publishes_deferred.load(std::memory_order_relaxed);
+	payload["ready"] = startup_ready;
+	// milliseconds from start, null for stages that haven't finished
+	payload["startup"] = json::object();
+	for (unsigned int stage = 0; stage < startup_stage_count; ++stage) {
+		payload["startup"][startup_stage_names[stage]] = startup.done[stage] ? json(startup.finished[stage].count()) : json(nullptr);
+	}
+	// percentiles are bucket upper bounds, enough to tell where the time goes
+	payload["stages"] = json::object();
+	for (unsigned int stage = 0; stage < stage_count; ++stage) {
+		LatencyHistogram::Snapshot snapshot = metrics.stages[stage].take();
+		// a simulated run reports its latency over the whole run
+		simulation_summary.stages[stage].add(snapshot);
+		payload["stages"][metrics_stage_names[stage]] = {
+			{ "n", snapshot.count },
+			{ "p50", snapshot.percentile_us(0.5) },
+			{ "p99", snapshot.percentile_us(0.99) },
+			{ "max", snapshot.max_us }
+		};
+	}
+	publisher->publish(diagnostics_topic(), payload.dump(), false);
+}
+
+DeviceEvent UnifyStatus::device_event(unsigned int receiver, DeviceData const& device, DeviceEventKind kind, std::chrono::steady_clock::time_point read_time) {
+	DeviceEvent event;
+	event.kind = kind;
+	event.receiver_serial = device.receiver_serial;
+	event.slot = device.slot;
+	event.name = device.name;
+	event.status = device.published_status();
+	event.battery_level = device.battery_level;
+	event.battery_charging = device.battery_charging;
+	event.last_transition = device.last_transition;
+	event.suppressed_events = device.suppressed_events;
+	event.read_time = read_time;
+	event.topic = kind == EVENT_STATUS ? receivers[receiver].topics.state[device.slot - 1] : receivers[receiver].topics.battery[device.slot - 1];
+	return event;
+}
+
+void UnifyStatus::emit(DeviceData& device, DeviceEvent const& event) {
+	for (OutputSink* sink : sinks) {
+		sink->device_event(event);
+	}
+	publish_limited(device, event);
+}
+
+void UnifyStatus::publish_limited(DeviceData& device, DeviceEvent const& event) {
+	std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+	bool& pending = event.kind == EVENT_STATUS ? device.status_publish_pending : device.battery_publish_pending;
+	if (mqtt_publishes.take(now)) {
+		// anything older that was waiting is replaced by this
+		pending = false;
+		mqtt_sink.device_event(event);
+		return;
+	}
+	// only counted once however many changes it stands for
+	if (!pending) {
+		metrics.count(metrics.publishes_deferred);
+	}
+	pending = true;
+	next_deferred_publish = std::min(next_deferred_publish, mqtt_publishes.next_token(now));
+}
+
+void UnifyStatus::publish_deferred() {
+	std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+	if (now < next_deferred_publish) {
+		return;
+	}
+	next_deferred_publish = std::chrono::steady_clock::time_point::max();
+	for (DeviceData& device : devices.all()) {
+		if (!device.status_publish_pending && !device.battery_publish_pending) {
+			continue;
+		}
+		int receiver = find_receiver(device.receiver_serial);
+		if (receiver < 0) {
+			// the receiver is gone, it is published again when it is back
+			device.status_publish_pending = false;
+			device.battery_publish_pending = false;
+			continue;
+		}
+		for (DeviceEventKind kind : { EVENT_STATUS, EVENT_BATTERY }) {
+			bool& pending = kind == EVENT_STATUS ? device.status_publish_pending : device.battery_publish_pending;
+			if (!pending) {
+				continue;
+			}
+			if (!mqtt_publishes.take(now)) {
+				next_deferred_publish = mqtt_publishes.next_token(now);
+				return;
 			}
+			pending = false;
+			mqtt_sink.device_event(device_event(receiver, device, kind));
 		}
-		else {
-			// break out of the loop if there's an error
-			DWORD error = GetLastError();
-			// not connected and aborted are handled error cases
-			if (!(error == ERROR_DEVICE_NOT_CONNECTED || error == ERROR_OPERATION_ABORTED)) {
-				debug_log << curr_time() << "failed to read receiver with error: " << GetLastError() << std::endl;
+	}
+}
+
+void UnifyStatus::process_device_status(unsigned int receiver, DeviceData& device, std::chrono::steady_clock::time_point read_time){
+	debug_log.log(LOG_DEVICE_STATUS, device.receiver_serial, device.slot, device_status_name(device.published_status()));
+	emit(device, device_event(receiver, device, EVENT_STATUS, read_time));
+}
+
+void UnifyStatus::process_report(HIDReport const& report, std::chrono::steady_clock::time_point read_time) {
+	metrics.count(metrics.reports_read);
+	HIDPPMessage message = hidpp_decode(report.data, report.size);
+	std::chrono::steady_clock::time_point current_packet_time = std::chrono::steady_clock::now();
+	metrics.record(STAGE_DECODE, read_time, current_packet_time);
+	// replies complete their request, everything else is a notification
+	HIDPPRequest request;
+	if (report.receiver < receivers.size() && receivers[report.receiver].requests.match(message, request)) {
+		complete_request(request, &message);
+		send_waiting(report.receiver);
+		return;
+	}
+	if (message.kind == HIDPP20_MESSAGE && process_battery_event(report.receiver, message)) {
+		return;
+	}
+	// check if the data is a device connection status notification
+	if (report.channel != RECEIVER_CHANNEL || message.kind != HIDPP_CONNECTION) {
+		metrics.count(metrics.reports_ignored);
+		return;
+	}
+	// devices can't be told apart from other receivers' devices before the serial is known
+	if (!receivers[report.receiver].ready) {
+		metrics.count(metrics.reports_ignored);
+		return;
+	}
+	// devices are 1 indexed on the receiver
+	unsigned char slot = message.device_index;
+	if (slot < 1 || slot > DeviceRegistry::max_slot) {
+		metrics.count(metrics.reports_ignored);
+		return;
+	}
+	bool added;
+	DeviceData& device_info = devices.get(receivers[report.receiver].serial, slot, &added);
+	if (added) {
+		update_mqtt_discovery(report.receiver);
+	}
+	// a different model in the slot means it was paired again, its name and features have to be read again
+	if (device_info.wireless_pid != message.connection.wireless_pid) {
+		device_info.wireless_pid = message.connection.wireless_pid;
+		device_info.forget_pairing();
+	}
+	device_info.probe_pending = false;
+	device_info.event_read_time = read_time;
+	device_info.event_decode_time = current_packet_time;
+	if (message.connection.link_established) {
+		// held until the powersave window passes, a disconnect before then collapses it into powersave
+		device_info.connect_pending = true;
+		device_info.connect_deadline = current_packet_time + powersave_window(device_info.wireless_pid);
+		timers.schedule(((unsigned long long)report.receiver << 8) | slot, device_info.connect_deadline);
+		// the name arrives later and updates discovery, a flapping device isn't asked on every connect
+		if (device_info.name == "" && !device_info.unstable) {
+			request_device_name(report.receiver, slot);
+		}
+	}
+	else if (device_info.connect_pending) {
+		device_info.connect_pending = false;
+		set_device_status(report.receiver, device_info, POWERSAVE);
+	}
+	else {
+		set_device_status(report.receiver, device_info, DISCONNECTED);
+	}
+}
+
+void UnifyStatus::set_device_status(unsigned int receiver, DeviceData& device, DeviceStatus status) {
+	if (device.status_published && device.status == status) {
+		return;
+	}
+	// the first status after startup isn't a change
+	bool changed = device.status_published;
+	DeviceStatus old_status = device.status;
+	device.status = status;
+	device.status_published = true;
+	state_changed = true;
+	device.last_transition = std::chrono::system_clock::now();
+	if (changed) {
+		journal.append(device.receiver_serial, device.slot, old_status, status, device.last_transition);
+	}
+	// a device that just connected is awake, its battery can be read right away
+	if (status == CONNECTED) {
+		device.battery_backoff = std::chrono::seconds(0);
+		device.next_battery_poll = std::chrono::steady_clock::now();
+	}
+	state_cache.store(device);
+	if (changed && damp_flapping(receiver, device, old_status)) {
+		metrics.count(metrics.status_suppressed);
+		return;
+	}
+	std::chrono::steady_clock::time_point commit_time = std::chrono::steady_clock::now();
+	metrics.record(STAGE_COMMIT, device.event_decode_time, commit_time);
+	process_device_status(receiver, device, device.event_read_time);
+	metrics.record(STAGE_ENQUEUE, commit_time, std::chrono::steady_clock::now());
+}
+
+bool UnifyStatus::damp_flapping(unsigned int receiver, DeviceData& device, DeviceStatus old_status) {
+	if (config.flap_penalty == 0) {
+		return false;
+	}
+	// going to sleep and waking up is what an idle device does all day, only losing the link counts,
+	// an unstable device still holds back every change until it settles
+	if (old_status != DISCONNECTED && device.status != DISCONNECTED) {
+		if (device.unstable) {
+			++device.suppressed_events;
+		}
+		return device.unstable;
+	}
+	std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+	double half_lives = std::chrono::duration<double>(now - device.flap_updated) / config.flap_half_life;
+	device.flap_penalty = device.flap_penalty * std::exp2(-half_lives) + config.flap_penalty;
+	// capped so a device that flapped for hours settles as quickly as one that flapped for a minute
+	device.flap_penalty = std::min(device.flap_penalty, 2.0 * config.flap_suppress_limit);
+	device.flap_updated = now;
+	bool suppressed = device.unstable;
+	if (suppressed) {
+		++device.suppressed_events;
+	}
+	else if (device.flap_penalty >= config.flap_suppress_limit) {
+		// this change is published as unstable, the ones after it aren't
+		device.unstable = true;
+		device.suppressed_events = 0;
+		debug_log.log(LOG_DEVICE_UNSTABLE, device.receiver_serial, device.slot);
+	}
+	else {
+		return false;
+	}
+	// every change pushes the reuse time out
+	auto settle = std::chrono::duration<double>(config.flap_half_life) * std::log2(device.flap_penalty / config.flap_reuse_limit);
+	device.flap_reuse_time = now + std::chrono::duration_cast<std::chrono::steady_clock::duration>(settle);
+	timers.schedule(flap_timer | ((unsigned long long)receiver << 8) | device.slot, device.flap_reuse_time);
+	return suppressed;
+}
+
+void UnifyStatus::device_settled(unsigned int receiver, DeviceData& device) {
+	device.unstable = false;
+	state_changed = true;
+	debug_log.log(LOG_DEVICE_STABLE, device.receiver_serial, device.slot, device.suppressed_events);
+	// the status it ended up with, it may not have changed since it became unstable
+	device.event_read_time = {};
+	device.event_decode_time = {};
+	process_device_status(receiver, device);
+}
+
+std::chrono::milliseconds UnifyStatus::powersave_window(unsigned short wireless_pid) {
+	for (const PowersaveWindow& model : config.powersave_windows) {
+		if (model.wireless_pid == wireless_pid) {
+			return model.window;
+		}
+	}
+	return config.powersave_window;
+}
+
+void UnifyStatus::log_powersave_windows() {
+	for (const PowersaveWindow& model : config.powersave_windows) {
+		debug_log.log(LOG_POWERSAVE_WINDOW, model.wireless_pid, model.window.count());
+	}
+}
+
+void UnifyStatus::expire_timers() {
+	unsigned long long key;
+	std::chrono::steady_clock::time_point deadline;
+	while (timers.expire(std::chrono::steady_clock::now(), key, deadline)) {
+		unsigned int receiver = (unsigned int)((key & (flap_timer - 1)) >> 8);
+		unsigned char slot = key & 0xff;
+		if (receiver >= receivers.size() || !receivers[receiver].ready) {
+			continue;
+		}
+		DeviceData* device = devices.find(receivers[receiver].serial, slot);
+		if (key & flap_timer) {
+			// a later change pushed the reuse time out
+			if (device != nullptr && device->unstable && device->flap_reuse_time == deadline) {
+				device_settled(receiver, *device);
 			}
+			continue;
+		}
+		// a disconnect or a newer connect replaced this timer
+		if (device == nullptr || !device->connect_pending || device->connect_deadline != deadline) {
+			continue;
+		}
+		device->connect_pending = false;
+		// the window is the hold stage, so commit only measures the work once it ran out
+		std::chrono::steady_clock::time_point released = std::chrono::steady_clock::now();
+		metrics.record(STAGE_HOLD, device->event_decode_time, released);
+		device->event_decode_time = released;
+		set_device_status(receiver, *device, CONNECTED);
+	}
+}
+
+int UnifyStatus::find_receiver(unsigned int serial) {
+	for (unsigned int receiver = 0; receiver < receivers.size(); ++receiver) {
+		if (receivers[receiver].ready && receivers[receiver].serial == serial) {
+			return receiver;
+		}
+	}
+	return -1;
+}
+
+void UnifyStatus::poll_batteries() {
+	next_battery_poll = std::chrono::steady_clock::time_point::max();
+	if (config.battery_poll_interval.count() == 0) {
+		return;
+	}
+	std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+	for (DeviceData& device : devices.all()) {
+		// sleeping devices don't answer, they are polled again once they connect
+		if (device.status != CONNECTED || device.battery_query_pending || (device.features_resolved && device.battery_feature == 0)) {
+			continue;
+		}
+		if (device.next_battery_poll > now) {
+			next_battery_poll = std::min(next_battery_poll, device.next_battery_poll);
+			continue;
+		}
+		int receiver = find_receiver(device.receiver_serial);
+		if (receiver < 0) {
+			continue;
+		}
+		// the rest waits for the budget, whichever device comes first then goes first
+		if (!battery_requests.take(now)) {
+			next_battery_poll = std::min(next_battery_poll, battery_requests.next_token(now));
 			break;
 		}
+		HIDPPShortReport request;
+		RequestTag tag;
+		if (!device.features_resolved) {
+			// newer devices only have unified battery, older ones only battery status
+			if (device.battery_probe == 0) {
+				device.battery_probe = HIDPP_FEATURE_UNIFIED_BATTERY;
+			}
+			request = hidpp20_get_feature_request(device.slot, (HIDPPFeature)device.battery_probe);
+			tag = REQUEST_BATTERY_FEATURE;
+		}
+		else {
+			unsigned char function = device.battery_feature == HIDPP_FEATURE_UNIFIED_BATTERY ? hidpp20_unified_battery_function : hidpp20_battery_status_function;
+			request = hidpp20_request(device.slot, device.battery_index, function, hidpp20_software_id);
+			tag = REQUEST_BATTERY;
+		}
+		if (send_command(receiver, request, tag, device.slot)) {
+			device.battery_query_pending = true;
+		}
+		else {
+			device.next_battery_poll = now + config.battery_poll_interval;
+		}
+	}
+}
+
+void UnifyStatus::complete_battery_request(HIDPPRequest const& request, const HIDPPMessage* reply) {
+	unsigned int receiver = request.receiver;
+	DeviceData* device = devices.find(receivers[receiver].serial, request.slot);
+	if (device == nullptr) {
+		return;
+	}
+	device->battery_query_pending = false;
+	std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+	if (reply == nullptr || (reply->kind == HIDPP_ERROR_REPLY && reply->error.error_code == hidpp_error_unreachable)) {
+		// asleep or out of range, it is left alone for longer every time
+		device->battery_backoff = std::min<std::chrono::seconds>(device->battery_backoff.count() == 0 ? std::chrono::seconds(30) : device->battery_backoff * 2, max_battery_backoff);
+		device->next_battery_poll = now + device->battery_backoff;
+		debug_log.log(LOG_BATTERY_UNREACHABLE, device->receiver_serial, device->slot, device->battery_backoff.count());
+		return;
+	}
+	device->battery_backoff = std::chrono::seconds(0);
+	if (reply->kind != HIDPP20_MESSAGE) {
+		// HID++ 1.0 devices don't have features, that only changes when the slot is paired again
+		device->features_resolved = true;
+		device->battery_feature = 0;
+		debug_log.log(LOG_BATTERY_UNSUPPORTED, device->receiver_serial, device->slot);
+		return;
+	}
+	if (request.tag == REQUEST_BATTERY_FEATURE) {
+		unsigned char index = reply->feature.params[0];
+		if (index != 0) {
+			device->features_resolved = true;
+			device->battery_feature = device->battery_probe;
+			device->battery_index = index;
+			device->next_battery_poll = now;
+			debug_log.log(LOG_BATTERY_FEATURE, device->receiver_serial, device->slot, device->battery_feature, index);
+			update_mqtt_discovery(receiver);
+		}
+		else if (device->battery_probe == HIDPP_FEATURE_UNIFIED_BATTERY) {
+			device->battery_probe = HIDPP_FEATURE_BATTERY_STATUS;
+			device->next_battery_poll = now;
+		}
+		else {
+			device->features_resolved = true;
+			device->battery_feature = 0;
+			debug_log.log(LOG_BATTERY_UNSUPPORTED, device->receiver_serial, device->slot);
+		}
+		return;
+	}
+	HIDPPBattery battery;
+	if (hidpp20_decode_battery((HIDPPFeature)device->battery_feature, reply->feature, battery)) {
+		set_device_battery(receiver, *device, battery);
 	}
-	CloseHandle(receiver);
-	CloseHandle(responder);
+	device->next_battery_poll = now + config.battery_poll_interval;
+}
+
+bool UnifyStatus::process_battery_event(unsigned int receiver, HIDPPMessage const& message) {
+	// replies were matched to their request already, only notifications are left
+	if (message.feature.software_id != 0 || receiver >= receivers.size() || !receivers[receiver].ready) {
+		return false;
+	}
+	DeviceData* device = devices.find(receivers[receiver].serial, message.device_index);
+	if (device == nullptr || device->battery_feature == 0 || message.feature.feature_index != device->battery_index) {
+		return false;
+	}
+	HIDPPBattery battery;
+	if (hidpp20_decode_battery((HIDPPFeature)device->battery_feature, message.feature, battery)) {
+		set_device_battery(receiver, *device, battery);
+		// the device just said everything a poll would have
+		device->next_battery_poll = std::chrono::steady_clock::now() + config.battery_poll_interval;
+	}
+	return true;
+}
+
+void UnifyStatus::set_device_battery(unsigned int receiver, DeviceData& device, HIDPPBattery const& battery) {
+	if (device.battery_level == battery.level && device.battery_charging == battery.charging) {
+		return;
+	}
+	device.battery_level = battery.level;
+	device.battery_charging = battery.charging;
+	state_changed = true;
+	process_device_battery(receiver, device);
+}
+
+void UnifyStatus::process_device_battery(unsigned int receiver, DeviceData& device) {
+	debug_log.log(LOG_DEVICE_BATTERY, device.receiver_serial, device.slot, device.battery_level, device.battery_charging ? ", charging" : "");
+	emit(device, device_event(receiver, device, EVENT_BATTERY));
 }
 
 void UnifyStatus::run() {
 	// Run the driver
-	// Keep looping indefinitely,
-	// handles the case of the receiver being unplugged and plugged back in
-	while (!quit) {
-		find_and_wait_on_receiver();
-		read_notifications();
-	}	
+	// A single loop services every receiver,
+	// hotplug events handle receivers being unplugged and plugged back in
+	// requests are never waited on, their replies and timeouts are handled as they come
+	bool open_failed = !open_receivers();
+	std::chrono::steady_clock::time_point retry_open = std::chrono::steady_clock::now() + std::chrono::seconds(1);
+	std::chrono::steady_clock::time_point next_diagnostics = std::chrono::steady_clock::now() + config.diagnostics_interval;
+	// a simulation stops generating events when stop is called and runs until every virtual device settled,
+	// so every device is checked and not only the ones that happened to be quiet at the end
+	std::chrono::steady_clock::time_point simulation_settled = std::chrono::steady_clock::time_point::max();
+	while (true) {
+		// sleeps until a report arrives, a request times out, a hid interface is added or removed, or stop is called
+		// a receiver node can show up before its permissions are set, so opening is retried every second
+		std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+		if (quit) {
+			if (simulation == nullptr) {
+				break;
+			}
+			if (simulation_settled == std::chrono::steady_clock::time_point::max()) {
+				simulation_settled = simulation->quiesce();
+			}
+			if (now >= simulation_settled) {
+				break;
+			}
+		}
+		int timeout_ms = request_timeout_ms(now);
+		int timer_ms = timers.next_timeout_ms(now);
+		if (timer_ms >= 0 && (timeout_ms < 0 || timer_ms < timeout_ms)) {
+			timeout_ms = timer_ms;
+		}
+		if (open_failed) {
+			int retry_ms = (int)std::max<long long>(0, std::chrono::ceil<std::chrono::milliseconds>(retry_open - now).count());
+			if (timeout_ms < 0 || retry_ms < timeout_ms) {
+				timeout_ms = retry_ms;
+			}
+		}
+		if (next_deferred_publish != std::chrono::steady_clock::time_point::max()) {
+			int publish_ms = (int)std::max<long long>(0, std::chrono::ceil<std::chrono::milliseconds>(next_deferred_publish - now).count());
+			if (timeout_ms < 0 || publish_ms < timeout_ms) {
+				timeout_ms = publish_ms;
+			}
+		}
+		if (next_battery_poll != std::chrono::steady_clock::time_point::max()) {
+			int battery_ms = (int)std::max<long long>(0, std::chrono::ceil<std::chrono::milliseconds>(next_battery_poll - now).count());
+			if (timeout_ms < 0 || battery_ms < timeout_ms) {
+				timeout_ms = battery_ms;
+			}
+		}
+		int startup_ms = startup_timeout_ms(now);
+		if (startup_ms >= 0 && (timeout_ms < 0 || startup_ms < timeout_ms)) {
+			timeout_ms = startup_ms;
+		}
+		if (next_usage != std::chrono::steady_clock::time_point::max()) {
+			int usage_ms = (int)std::max<long long>(0, std::chrono::ceil<std::chrono::milliseconds>(next_usage - now).count());
+			if (timeout_ms < 0 || usage_ms < timeout_ms) {
+				timeout_ms = usage_ms;
+			}
+		}
+		if (config.diagnostics_interval.count() > 0) {
+			int diagnostics_ms = (int)std::max<long long>(0, std::chrono::ceil<std::chrono::milliseconds>(next_diagnostics - now).count());
+			if (timeout_ms < 0 || diagnostics_ms < timeout_ms) {
+				timeout_ms = diagnostics_ms;
+			}
+		}
+		if (simulation_settled != std::chrono::steady_clock::time_point::max()) {
+			int settled_ms = (int)std::max<long long>(0, std::chrono::ceil<std::chrono::milliseconds>(simulation_settled - now).count());
+			if (timeout_ms < 0 || settled_ms < timeout_ms) {
+				timeout_ms = settled_ms;
+			}
+		}
+		HIDReport report;
+		switch (transport->read(report, timeout_ms)) {
+			case HID_REPORT:
+				process_report(report, std::chrono::steady_clock::now());
+				break;
+			case HID_DEVICE_LOST:
+				close_receiver(report.receiver);
+				break;
+			case HID_HOTPLUG:
+				open_failed = !open_receivers();
+				retry_open = std::chrono::steady_clock::now() + std::chrono::seconds(1);
+				break;
+			case HID_WOKEN:
+				if (reload_requested.exchange(false)) {
+					apply_config();
+				}
+				break;
+			case HID_TIMEOUT:
+				if (open_failed && std::chrono::steady_clock::now() >= retry_open) {
+					open_failed = !open_receivers();
+					retry_open = std::chrono::steady_clock::now() + std::chrono::seconds(1);
+				}
+				break;
+			default:
+				break;
+		}
+		// a steady stream of reports can't hold back the timeouts
+		expire_requests();
+		expire_timers();
+		publish_deferred();
+		poll_batteries();
+		log_publisher_stats();
+		check_startup();
+		if (state_changed) {
+			publish_state();
+		}
+		if (config.diagnostics_interval.count() > 0 && std::chrono::steady_clock::now() >= next_diagnostics) {
+			publish_diagnostics();
+			next_diagnostics = std::chrono::steady_clock::now() + config.diagnostics_interval;
+		}
+		if (std::chrono::steady_clock::now() >= next_usage) {
+			publish_usage();
+			next_usage = std::chrono::steady_clock::now() + config.usage_interval;
+		}
+	}
+	if (simulation != nullptr) {
+		check_simulation();
+	}
+	transport->close_all();
+}
+
+void UnifyStatus::publish_state() {
+	state_changed = false;
+	++state.version;
+	state.ready = startup_ready;
+	state.count = 0;
+	for (const DeviceData& device : devices.all()) {
+		if (state.count == StateSnapshot::max_devices) {
+			break;
+		}
+		DeviceSnapshot& entry = state.devices[state.count++];
+		entry.receiver_serial = device.receiver_serial;
+		entry.slot = device.slot;
+		entry.status = device.published_status();
+		entry.battery_level = device.battery_level;
+		entry.battery_charging = device.battery_charging;
+		size_t length = std::min(device.name.size(), sizeof(entry.name) - 1);
+		std::memcpy(entry.name, device.name.data(), length);
+		entry.name[length] = 0;
+		entry.last_transition = device.last_transition.time_since_epoch().count();
+		entry.suppressed_events = device.suppressed_events;
+	}
+	published_state.write(state);
+	for (OutputSink* sink : sinks) {
+		sink->state_published();
+	}
+	if (state_handler) {
+		state_handler();
+	}
+}
+
+void UnifyStatus::check_simulation() {
+	SimulationStats stats = simulation->stats();
+	debug_log.log(LOG_SIMULATION_EVENTS, stats.reports, stats.connects, stats.disconnects, stats.powersaves);
+	if (stats.malformed > 0) {
+		debug_log.log(LOG_SIMULATION_MALFORMED, stats.malformed);
+	}
+	debug_log.log(LOG_SIMULATION_INPUT, stats.dropped, stats.waits, stats.reports);
+	simulation_summary.stats = stats;
+	simulation_summary.elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - startup.started);
+	unsigned long long elapsed_ms = std::max<long long>(1, simulation_summary.elapsed.count());
+	unsigned long long changes = stats.connects + stats.disconnects + stats.powersaves;
+	debug_log.log(LOG_SIMULATION_RATE, elapsed_ms, changes * 1000 / elapsed_ms, stats.reports * 1000 / elapsed_ms);
+	for (unsigned int stage = 0; stage < stage_count; ++stage) {
+		LatencyHistogram::Snapshot& snapshot = simulation_summary.stages[stage];
+		snapshot.add(metrics.stages[stage].take());
+		debug_log.log(LOG_SIMULATION_LATENCY, metrics_stage_names[stage], snapshot.percentile_us(0.5), snapshot.percentile_us(0.9), snapshot.percentile_us(0.99));
+	}
+	unsigned int checked = 0;
+	unsigned int simulation_mismatches = 0;
+	for (const DeviceData& device : devices.all()) {
+		DeviceStatus expected;
+		// a connect still waiting out its window hasn't been decided yet
+		if (device.connect_pending || !simulation->expected_status(device.receiver_serial, device.slot, expected)) {
+			continue;
+		}
+		++checked;
+		if (device.status != expected) {
+			++simulation_mismatches;
+			debug_log.log(LOG_SIMULATION_MISMATCH, device.receiver_serial, device.slot, device_status_name(device.status), device_status_name(expected));
+		}
+		int expected_level;
+		if (device.battery_level >= 0 && (!simulation->expected_battery(device.receiver_serial, device.slot, expected_level) || device.battery_level != expected_level)) {
+			++simulation_mismatches;
+			debug_log.log(LOG_SIMULATION_BATTERY_MISMATCH, device.receiver_serial, device.slot, device.battery_level);
+		}
+	}
+	debug_log.log(LOG_SIMULATION_CHECKED, checked, simulation_mismatches);
+	// every virtual device settled before this, one that can't be checked is lost
+	if (checked < simulation->device_count()) {
+		debug_log.log(LOG_SIMULATION_UNCHECKED, checked, simulation->device_count());
+		simulation_mismatches += simulation->device_count() - checked;
+	}
+	simulation_summary.checked = checked;
+	simulation_summary.mismatches = simulation_mismatches;
+}
+
+void UnifyStatus::stop() {
+	quit = true;
+	transport->wake();
+}
+
+void UnifyStatus::reload() {
+	reload_requested = true;
+	transport->wake();
+}
+
+void UnifyStatus::connect_mqtt() {
+	// brokers drop the older of two sessions with the same client id, so every host needs its own
+	std::string client_id = "logitech-unify-mqtt";
+	std::string host = host_name();
+	if (host != "") {
+		client_id += "-" + host;
+	}
+	_mqtt = new UnifyMQTT(config.mqtt_address, client_id, config.mqtt_username, config.mqtt_password, debug_log);
+	publisher = new MQTTPublisher(_mqtt, &spool, &metrics);
+	mqtt_sink.set_publisher(publisher);
+	logged_publisher_stats = MQTTPublisherStats{};
+	update_diagnostics_discovery();
+}
+
+void UnifyStatus::open_local_sink() {
+	sinks.clear();
+	if (config.local_socket == "" || appdata_path == "") {
+		return;
+	}
+#ifdef _WIN32
+	std::string path = "\\\\.\\pipe\\" + config.local_socket;
+#else
+	std::string path = config.local_socket[0] == '/' ? config.local_socket : appdata_path + path_separator + config.local_socket;
+#endif
+	local_sink = new LocalSocketSink(path, published_state, debug_log);
+	if (!local_sink->start()) {
+		delete local_sink;
+		local_sink = nullptr;
+		return;
+	}
+	sinks.push_back(local_sink);
+}
+
+void UnifyStatus::close_local_sink() {
+	sinks.clear();
+	delete local_sink;
+	local_sink = nullptr;
+}
+
+void UnifyStatus::apply_config() {
+	if (config_path == "") {
+		return;
+	}
+	UnifyConfig new_config = load_config(config_path);
+	debug_log.set_level(new_config.log_level);
+	debug_log.set_max_size(new_config.log_max_size);
+	battery_requests.configure(new_config.battery_requests_per_second, new_config.battery_requests_per_second);
+	mqtt_publishes.configure(new_config.mqtt_publishes_per_second, new_config.mqtt_publishes_per_second);
+	if (new_config == config) {
+		debug_log.log(LOG_RELOAD_UNCHANGED);
+		return;
+	}
+	bool reconnect = new_config.mqtt_session_changed(config);
+	bool prefix_changed = new_config.mqtt_discovery_prefix != config.mqtt_discovery_prefix;
+	if (prefix_changed) {
+		// an empty retained config removes the device from home assistant under the old prefix,
+		// it is queued on the current connection, stopping the publisher below still sends it to the old broker
+		for (const ReceiverData& receiver : receivers) {
+			if (receiver.ready) {
+				publisher->publish(receiver.topics.config, "", true);
+			}
+		}
+		publisher->publish(diagnostics_config_topic(), "", true);
+	}
+	if (reconnect) {
+		// sends what is still queued to the old broker
+		publisher->stop();
+		log_publisher_stats();
+		delete publisher;
+		delete _mqtt;
+		metrics.count(metrics.reconnects);
+	}
+	bool local_socket_changed = new_config.local_socket != config.local_socket;
+	bool usage_was_enabled = usage_enabled();
+	bool diagnostics_were_enabled = config.diagnostics_interval.count() > 0;
+	bool windows_changed = new_config.powersave_windows != config.powersave_windows;
+	config = new_config;
+	// connects already held keep the window they started with
+	if (windows_changed) {
+		log_powersave_windows();
+	}
+	if (reconnect) {
+		connect_mqtt();
+	}
+	if (local_socket_changed) {
+		close_local_sink();
+		open_local_sink();
+	}
+	// the usage sensors come and go with the usage interval
+	if (usage_enabled() != usage_was_enabled) {
+		next_usage = usage_enabled() && startup_ready ? std::chrono::steady_clock::now() : std::chrono::steady_clock::time_point::max();
+		if (!reconnect && !prefix_changed) {
+			for (unsigned int receiver = 0; receiver < receivers.size(); ++receiver) {
+				if (receivers[receiver].ready) {
+					update_mqtt_discovery(receiver);
+				}
+			}
+		}
+	}
+	// a reconnect already published it
+	if (!reconnect && (prefix_changed || (config.diagnostics_interval.count() > 0) != diagnostics_were_enabled)) {
+		update_diagnostics_discovery();
+	}
+	debug_log.log(LOG_RELOAD, reconnect ? ", reconnected to MQTT" : "", prefix_changed ? ", new discovery prefix" : "");
+	if (!reconnect && !prefix_changed) {
+		return;
+	}
+	// a new broker or prefix doesn't know anything yet
+	for (unsigned int receiver = 0; receiver < receivers.size(); ++receiver) {
+		if (!receivers[receiver].ready) {
+			continue;
+		}
+		set_receiver_topics(receiver);
+		update_mqtt_discovery(receiver);
+		// local subscribers already have all of this
+		for (DeviceData* device : devices.receiver_devices(receivers[receiver].serial)) {
+			if (device->status_published) {
+				publish_limited(*device, device_event(receiver, *device, EVENT_STATUS));
+			}
+			if (device->battery_level >= 0) {
+				publish_limited(*device, device_event(receiver, *device, EVENT_BATTERY));
+			}
+		}
+	}
 }
 
-UnifyStatus::UnifyStatus() {
+UnifyStatus::UnifyStatus(UnifyOptions const& options) {
+	startup.started = std::chrono::steady_clock::now();
 	// Setup config.ini and debug.log in appdata
-	DWORD username_length = UNLEN + 1;
-	char username[UNLEN + 1];
-	GetUserNameA(username, &username_length);
-	std::string appdata_path("C:\\Users\\" + std::string(username) + "\\AppData\\Local\\logitech-unify-mqtt");
-	if (CreateDirectoryA(appdata_path.c_str(), NULL) || ERROR_ALREADY_EXISTS == GetLastError()) {
-		std::string config_path = appdata_path + "\\config.ini";
-		std::string log_path = appdata_path + "\\debug.log";
-		HANDLE config_file = CreateFileA(config_path.c_str(), GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL, OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
-		if (GetLastError() != ERROR_ALREADY_EXISTS) {
-			WritePrivateProfileStringA("MQTT", "address", "", config_path.c_str());
-			WritePrivateProfileStringA("MQTT", "username", "", config_path.c_str());
-			WritePrivateProfileStringA("MQTT", "password", "", config_path.c_str());
-			WritePrivateProfileStringA("MQTT", "discovery-prefix","homeassistant", config_path.c_str());
-		}
-		CloseHandle(config_file);
-		std::vector<char> config_buffer(64);
-		GetPrivateProfileStringA("MQTT","address",NULL,config_buffer.data(), config_buffer.capacity(), config_path.c_str());
-		mqtt_address = std::string(reinterpret_cast<char*>(config_buffer.data()));
-		GetPrivateProfileStringA("MQTT","username",NULL,config_buffer.data(), config_buffer.capacity(), config_path.c_str());
-		mqtt_username = std::string(reinterpret_cast<char*>(config_buffer.data()));
-		GetPrivateProfileStringA("MQTT","password",NULL,config_buffer.data(), config_buffer.capacity(), config_path.c_str());
-		mqtt_password = std::string(reinterpret_cast<char*>(config_buffer.data()));
-		GetPrivateProfileStringA("MQTT","discovery-prefix",NULL,config_buffer.data(), config_buffer.capacity(), config_path.c_str());
-		mqtt_prefix = std::string(reinterpret_cast<char*>(config_buffer.data()));
-		mqtt_prefix += "/device/logitech-unify-mqtt/";
-		debug_log.open(log_path, std::ios::app);
+	appdata_path = app_data_path();
+	if (appdata_path != "") {
+		config_path = appdata_path + path_separator + "config.ini";
+		std::string log_path = appdata_path + path_separator + "debug.log";
+		config = load_config(config_path);
+		debug_log.open(log_path, config.log_level, config.log_max_size);
+		log_powersave_windows();
+		battery_requests.configure(config.battery_requests_per_second, config.battery_requests_per_second);
+		mqtt_publishes.configure(config.mqtt_publishes_per_second, config.mqtt_publishes_per_second);
+		// virtual devices don't belong in the cache of the real ones
+		if (!options.simulation.enabled()) {
+			state_cache.open(appdata_path + path_separator + "state.bin", debug_log);
+		}
+		// nor in their history
+		journal.open(appdata_path + path_separator + (options.simulation.enabled() ? "journal-simulation" : "journal"), debug_log);
+		// nor do their messages, the real daemon would send them after a restart
+		spool.open(appdata_path + path_separator + (options.simulation.enabled() ? "spool-simulation.bin" : "spool.bin"), debug_log);
 	}
 	else {
 		std::cout << "failed to create appdata path" << std::endl;
 	}
-	_mqtt = new UnifyMQTT(mqtt_address, mqtt_username, mqtt_password, debug_log);
+	finish_startup_stage(STARTUP_CONFIG);
+	if (options.simulation.enabled()) {
+		simulation = new SimulatedHIDTransport(options.simulation, debug_log);
+		transport = simulation;
+	}
+	else {
+		transport = create_hid_transport(debug_log);
+	}
+	if (options.capture_path != "") {
+		transport = new CaptureTransport(transport, options.capture_path, debug_log);
+	}
+	connect_mqtt();
+	open_local_sink();
 }
 
 UnifyStatus::~UnifyStatus() {
+	close_local_sink();
+	delete transport;
+	// flushes what is still queued
+	publisher->stop();
+	log_publisher_stats();
+	delete publisher;
 	debug_log.close();
 	delete _mqtt;
 }
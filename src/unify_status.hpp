@@ -1,77 +1,279 @@
 #pragma once
-#include <map>
+#include <atomic>
 #include <string>
 #include <vector>
 #include <chrono>
-#include <fstream>
-#include <windows.h>
+#include <functional>
 #include "unify_mqtt.hpp"
+#include "mqtt_publisher.hpp"
+#include "hid_transport.hpp"
+#include "device_registry.hpp"
+#include "hidpp.hpp"
+#include "hidpp_requests.hpp"
+#include "timer_wheel.hpp"
+#include "unify_config.hpp"
+#include "state_cache.hpp"
+#include "transition_journal.hpp"
+#include "hid_transport_sim.hpp"
+#include "metrics.hpp"
+#include "token_bucket.hpp"
+#include "seqlock.hpp"
+#include "output_sink.hpp"
+#include "mqtt_sink.hpp"
+#include "mqtt_discovery.hpp"
+#include "local_socket_sink.hpp"
 
-enum DeviceStatus {
-	CONNECTED,
-	DISCONNECTED,
-	POWERSAVE
+// Set from the command line, the tray application always uses the defaults
+struct UnifyOptions {
+	// records every report read from and written to the receivers
+	std::string capture_path = "";
+	// reads simulated receivers instead of real ones
+	SimulationOptions simulation;
 };
 
-
-struct DeviceData {
-	DeviceStatus status = DISCONNECTED;
-	std::string name = "";
-	std::chrono::steady_clock::time_point last_connected_packet_time;
+// What a simulated run measured, the latencies cover the whole run
+struct SimulationSummary {
+	SimulationStats stats{};
+	std::chrono::milliseconds elapsed{ 0 };
+	// virtual devices compared once they all settled
+	unsigned int checked = 0;
+	unsigned int mismatches = 0;
+	LatencyHistogram::Snapshot stages[stage_count];
 };
 
 class UnifyStatus {
-	struct HIDDevicePath {
-		char vid[9];
-		char pid[9];
-		char mi[6];
-		char col[6];
+	// what a request in flight was sent for
+	enum RequestTag {
+		REQUEST_RECEIVER_SERIAL,
+		REQUEST_ENABLE_NOTIFICATIONS,
+		REQUEST_DEVICE_INFO,
+		REQUEST_DEVICE_NAME,
+		// IRoot ping sent to every paired device when the receiver is opened
+		REQUEST_PING,
+		// IRoot getFeature for the battery feature being probed
+		REQUEST_BATTERY_FEATURE,
+		REQUEST_BATTERY
+	};
+	static constexpr const char* request_tag_names[] = { "serial", "notifications", "pairing info", "name", "ping", "battery feature", "battery" };
+
+	struct ReceiverData {
+		bool open = false;
+		// the serial is known, devices can be tracked
+		bool ready = false;
+		unsigned int serial = 0;
+		// pairing info and name requests sent when the receiver was opened that haven't completed yet,
+		// discovery is published once they have
+		unsigned int pending_startup = 0;
+		// the enable notifications write hasn't completed yet
+		bool notifications_pending = false;
+		// startup pings that haven't completed yet
+		unsigned int pending_probes = 0;
+		// slots whose ping waits for an earlier one to complete, bit slot - 1
+		unsigned int probes_waiting = 0;
+		unsigned int probes_in_flight = 0;
+		// requests sent to the receiver that haven't been answered yet, and the ones waiting to be sent
+		HIDPPRequestQueue requests;
+		ReceiverTopics topics;
+		// the discovery config up to the components
+		std::string discovery_header = "";
+		// indexed by the 0 indexed slot
+		DiscoveryComponent components[DeviceRegistry::max_slot];
+		// the retained config the broker has, an identical config isn't published again
+		std::string published_config = "";
 	};
 
 	const HIDDevicePath unify_hid_primary{
-		"vid_046d", "pid_c52b", "mi_02", "col01"
+		0x046d, 0xc52b, 0x02, 0x01
 	};
 
 	const HIDDevicePath unify_hid_responder{
-		"vid_046d", "pid_c52b", "mi_02", "col02"
+		0x046d, 0xc52b, 0x02, 0x02
 	};
 
-	std::string unify_primary_path = "";
-	std::string unify_responder_path = "";
+	HIDTransport* transport;
+	// set when transport is simulated, owned by transport
+	SimulatedHIDTransport* simulation = nullptr;
+	SimulationSummary simulation_summary;
+	// indexed by the transport's receiver id
+	std::vector<ReceiverData> receivers;
+
+	// How long to wait for a response to a command
+	const int response_timeout_ms = 1000;
+	// the receiver answers for devices it can't reach, a device that answers does so within a radio round trip
+	const int probe_timeout_ms = 500;
+	// pings go out a few at a time per receiver, so they don't crowd out the pairing info and name requests
+	static const unsigned int max_probes_in_flight = 2;
 
-	HANDLE receiver;
-	HANDLE responder;
+	// pending connects keyed by receiver << 8 | slot, flap reuse times by the same ored with flap_timer
+	TimerWheel timers;
+	static const unsigned long long flap_timer = 1ull << 32;
+	// when the device goes into power saving mode,
+	// it will send a connection message,
+	// then 400ms later it will send a disconnection message
+	// so a connect is held for the powersave window before it is published
 
-	// Size of wireless device connection status notification
-	const unsigned int notification_byte_size = 7;
+	// every battery request on every receiver shares it, so the radio load doesn't grow with the devices
+	TokenBucket battery_requests;
+	// when poll_batteries has something to send next
+	std::chrono::steady_clock::time_point next_battery_poll = std::chrono::steady_clock::time_point::max();
+	// how long a sleeping device is left alone at most
+	static constexpr std::chrono::seconds max_battery_backoff{ 3600 };
+	// status and battery publishes to the broker, what doesn't fit waits on the device's pending flags
+	TokenBucket mqtt_publishes;
+	// when the deferred publishes can go out, max if none are waiting
+	std::chrono::steady_clock::time_point next_deferred_publish = std::chrono::steady_clock::time_point::max();
+	std::string appdata_path;
+	std::string config_path;
 
-	std::string mqtt_address;
-	std::string mqtt_username;
-	std::string mqtt_password;
-	std::string mqtt_prefix;
+	UnifyConfig config;
+	std::atomic<bool> reload_requested = false;
 
-	std::ofstream debug_log;
+	Logger debug_log;
+	// last known device state, survives restarts
+	StateCache state_cache;
+	// every status change, usage is summed from it
+	TransitionJournal journal;
+	// when usage is published next, max until startup is done
+	std::chrono::steady_clock::time_point next_usage = std::chrono::steady_clock::time_point::max();
+	bool usage_enabled() const { return journal.is_open() && config.usage_interval.count() > 0; }
+	// publishes how every device was used over the last usage_days
+	void publish_usage();
 
-	std::string find_hid_path(LPGUID hid_guid, HIDDevicePath path_to_find);
-	void find_and_wait_on_receiver();
-	void get_paired_devices();
-	bool read_usb(HANDLE handle, std::vector<unsigned char>& buffer, LPDWORD bytes_read = NULL);
-	bool write_usb(HANDLE handle, std::vector<unsigned char> const& buffer);
-	void enable_wireless_notifications();
-	std::string get_device_name(unsigned int device_id);
-	void read_notifications();
-	void process_device_status(unsigned int device_id);
-	void print_bytes(std::vector<unsigned char> const& bytes);
-	bool check_response(HANDLE usb, std::vector<unsigned char> const& bytes_to_check, std::vector<unsigned char>& response);
-	void update_mqtt_discovery();
+	std::atomic<bool> quit = false;
+
+	// returns false if a receiver was found but couldn't be opened
+	bool open_receivers();
+	void close_receiver(unsigned int receiver);
+	void request_receiver_serial(unsigned int receiver);
+	void receiver_ready(unsigned int receiver, unsigned int serial);
+	void enable_wireless_notifications(unsigned int receiver);
+	bool request_device_info(unsigned int receiver, unsigned char slot);
+	bool request_device_name(unsigned int receiver, unsigned char slot);
+	// pings a paired device to learn whether it is connected right now
+	void probe_device(unsigned int receiver, DeviceData& device);
+	// sends waiting pings while fewer than max_probes_in_flight are outstanding
+	void send_probes(unsigned int receiver);
+	void complete_probe(HIDPPRequest const& request, const HIDPPMessage* reply);
+	void startup_request_done(unsigned int receiver, bool changed);
+	void process_report(HIDReport const& report, std::chrono::steady_clock::time_point read_time);
+	DeviceEvent device_event(unsigned int receiver, DeviceData const& device, DeviceEventKind kind, std::chrono::steady_clock::time_point read_time = {});
+	// hands the event to every sink, MQTT only if the publish budget allows
+	void emit(DeviceData& device, DeviceEvent const& event);
+	// publishes now if there is a token, otherwise marks the device so its latest state is published later
+	void publish_limited(DeviceData& device, DeviceEvent const& event);
+	void publish_deferred();
+	// read_time is when the report that caused the status was read, 0 for republishes
+	void process_device_status(unsigned int receiver, DeviceData& device, std::chrono::steady_clock::time_point read_time = {});
+	// publishes the status if it changed
+	void set_device_status(unsigned int receiver, DeviceData& device, DeviceStatus status);
+	// adds a status change to the flap penalty, returns true if the change must not be published
+	// changes between connected and powersave don't add to it
+	bool damp_flapping(unsigned int receiver, DeviceData& device, DeviceStatus old_status);
+	// publishes the status of an unstable device whose penalty has decayed
+	void device_settled(unsigned int receiver, DeviceData& device);
+	std::chrono::milliseconds powersave_window(unsigned short wireless_pid);
+	void log_powersave_windows();
+	// commits connects that weren't followed by a disconnect within the powersave window
+	void expire_timers();
+	// the ready receiver with serial, -1 if there is none
+	int find_receiver(unsigned int serial);
+	// sends the battery lookups and queries that are due, as many as the request budget allows
+	void poll_batteries();
+	void complete_battery_request(HIDPPRequest const& request, const HIDPPMessage* reply);
+	// returns false if message isn't a battery event of a known device
+	bool process_battery_event(unsigned int receiver, HIDPPMessage const& message);
+	void set_device_battery(unsigned int receiver, DeviceData& device, HIDPPBattery const& battery);
+	void process_device_battery(unsigned int receiver, DeviceData& device);
+	// sends request and tracks it until its reply arrives or the timeout passes, response_timeout_ms if timeout_ms is 0
+	// a request the receiver has no room for is sent once an earlier one completes,
+	// returns false if it couldn't be sent or queued, otherwise complete_request is called for it
+	bool send_command(unsigned int receiver, HIDPPShortReport const& request, RequestTag tag, unsigned char slot = 0, int timeout_ms = 0);
+	bool write_command(unsigned int receiver, HIDPPShortReport const& report, HIDPPRequest request, int timeout_ms);
+	// sends waiting requests while the receiver has room, one that can't be written completes as timed out
+	void send_waiting(unsigned int receiver);
+	// reply is nullptr if the request timed out
+	void complete_request(HIDPPRequest const& request, const HIDPPMessage* reply);
+	void expire_requests();
+	// until the next request of any receiver times out, -1 if none is in flight
+	int request_timeout_ms(std::chrono::steady_clock::time_point now);
+	// the publisher thread doesn't write to the log, its failures and drops are logged from here
+	void log_publisher_stats();
+	void finish_startup_stage(StartupStage stage);
+	// finishes the stages whose work is done and logs the ones running late
+	void check_startup();
+	// until the next startup stage runs late, -1 if none can anymore
+	int startup_timeout_ms(std::chrono::steady_clock::time_point now);
+	// compares the devices with what the simulation generated
+	void check_simulation();
+	void connect_mqtt();
+	// rereads config.ini and applies only what changed, receivers and device state are kept
+	void apply_config();
+	// builds the topics and cached discovery parts of a receiver for the current prefix,
+	// the next update_mqtt_discovery publishes the whole config again
+	void set_receiver_topics(unsigned int receiver);
+	// publishes the discovery config if it differs from the one last published
+	void update_mqtt_discovery(unsigned int receiver);
+	// the daemon only has one set of metrics, so the diagnostics sensor is on a device of its own
+	std::string diagnostics_topic();
+	std::string diagnostics_config_topic();
+	// publishes the diagnostics device's discovery config, or removes it if diagnostics are off
+	void update_diagnostics_discovery();
+	// publishes what was recorded since the last call and starts over
+	void publish_diagnostics();
+
+	// stage latencies from report read to the broker accepting the status
+	Metrics metrics;
+	StartupTimings startup;
+	// a stage that takes longer is logged, 0 for stages that can't run late
+	const std::chrono::milliseconds startup_timeouts[startup_stage_count] = {
+		std::chrono::milliseconds(0),
+		std::chrono::seconds(UnifyMQTT::connect_timeout_seconds),
+		std::chrono::seconds(5),
+		std::chrono::seconds(2),
+		std::chrono::seconds(5),
+		std::chrono::seconds(3)
+	};
+	// every receiver stage is done, devices have their state
+	bool startup_ready = false;
 
 	UnifyMQTT* _mqtt;
+	// what couldn't be sent while the broker was unreachable, kept across reconnects and restarts
+	MQTTSpool spool;
+	MQTTPublisher* publisher;
+	MQTTSink mqtt_sink;
+	// nullptr unless a local socket is configured and could be created
+	LocalSocketSink* local_sink = nullptr;
+	// where status and battery changes go besides mqtt_sink, which is rate limited
+	std::vector<OutputSink*> sinks;
+	void open_local_sink();
+	void close_local_sink();
+	// what log_publisher_stats has already reported
+	MQTTPublisherStats logged_publisher_stats{};
+
+	DeviceRegistry devices;
+	// the devices as other threads see them, rebuilt once per loop when something they show changed
+	SeqLock<StateSnapshot> published_state;
+	StateSnapshot state{};
+	bool state_changed = false;
+	std::function<void()> state_handler;
+	void publish_state();
 
 public:
-	UnifyStatus();
+	UnifyStatus(UnifyOptions const& options = UnifyOptions());
 	~UnifyStatus();
-	bool quit = false;
 	void run();
-	std::vector<DeviceData> devices_info;
-	const std::map<DeviceStatus, std::string> status_to_string{ {CONNECTED, "connected"}, {DISCONNECTED, "disconnected"}, {POWERSAVE, "powersave"} };
+	// simulated devices whose status didn't match or that couldn't be checked, valid once run returns
+	unsigned int mismatched_devices() const { return simulation_summary.mismatches; }
+	// what a simulated run measured, valid once run returns
+	SimulationSummary const& simulation_result() const { return simulation_summary; }
+	// nullptr unless the receivers are simulated, tests inject reports and device changes through it
+	SimulatedHIDTransport* simulated_transport() const { return simulation; }
+	// makes run return, safe to call from any thread
+	void stop();
+	// makes run reload the config, safe to call from any thread
+	void reload();
+	// the latest devices and their state, safe to call from any thread
+	StateSnapshot snapshot() const { return published_state.read(); }
+	// called on the driver thread after a new snapshot was published, set before run is called
+	void set_state_handler(std::function<void()> handler) { state_handler = std::move(handler); }
 };
@@ -0,0 +1,151 @@
+// Runs the driver against simulated receivers, injects a fixed number of device changes
+// and counts the heap allocations on its thread once it has warmed up, the steady event path has to get by without any
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <new>
+#include <string>
+#include <thread>
+#include <unistd.h>
+#include "../src/unify_status.hpp"
+
+static thread_local bool driver_thread = false;
+static std::atomic<bool> counting = false;
+static std::atomic<unsigned long long> allocations = 0;
+
+static void* allocate(std::size_t size, std::size_t alignment) {
+	if (driver_thread && counting.load(std::memory_order_relaxed)) {
+		allocations.fetch_add(1, std::memory_order_relaxed);
+	}
+	void* pointer = alignment > alignof(std::max_align_t) ? std::aligned_alloc(alignment, (size + alignment - 1) / alignment * alignment) : std::malloc(size ? size : 1);
+	if (pointer == nullptr) {
+		throw std::bad_alloc();
+	}
+	return pointer;
+}
+
+void* operator new(std::size_t size) { return allocate(size, 0); }
+void* operator new[](std::size_t size) { return allocate(size, 0); }
+void* operator new(std::size_t size, std::align_val_t alignment) { return allocate(size, (std::size_t)alignment); }
+void* operator new[](std::size_t size, std::align_val_t alignment) { return allocate(size, (std::size_t)alignment); }
+void operator delete(void* pointer) noexcept { std::free(pointer); }
+void operator delete[](void* pointer) noexcept { std::free(pointer); }
+void operator delete(void* pointer, std::size_t) noexcept { std::free(pointer); }
+void operator delete[](void* pointer, std::size_t) noexcept { std::free(pointer); }
+void operator delete(void* pointer, std::align_val_t) noexcept { std::free(pointer); }
+void operator delete[](void* pointer, std::align_val_t) noexcept { std::free(pointer); }
+void operator delete(void* pointer, std::size_t, std::align_val_t) noexcept { std::free(pointer); }
+void operator delete[](void* pointer, std::size_t, std::align_val_t) noexcept { std::free(pointer); }
+
+static const unsigned int receivers = 3;
+static const unsigned int devices = receivers * DeviceRegistry::max_slot;
+
+// every simulated device reaches status, or the test fails after a while
+static bool wait_for(UnifyStatus& driver, DeviceStatus status) {
+	std::chrono::steady_clock::time_point deadline = std::chrono::steady_clock::now() + std::chrono::seconds(5);
+	while (std::chrono::steady_clock::now() < deadline) {
+		StateSnapshot snapshot = driver.snapshot();
+		unsigned int reached = 0;
+		for (unsigned int i = 0; i < snapshot.count; ++i) {
+			reached += snapshot.devices[i].status == status;
+		}
+		if (snapshot.ready && reached == devices) {
+			return true;
+		}
+		std::this_thread::sleep_for(std::chrono::milliseconds(1));
+	}
+	return false;
+}
+
+// the simulated devices in slots 3 and 6 have no battery, the others are read while they are connected
+static bool wait_for_batteries(UnifyStatus& driver) {
+	std::chrono::steady_clock::time_point deadline = std::chrono::steady_clock::now() + std::chrono::seconds(10);
+	while (std::chrono::steady_clock::now() < deadline) {
+		StateSnapshot snapshot = driver.snapshot();
+		unsigned int read = 0;
+		for (unsigned int i = 0; i < snapshot.count; ++i) {
+			read += snapshot.devices[i].battery_level >= 0;
+		}
+		if (read == devices - 2 * receivers) {
+			return true;
+		}
+		std::this_thread::sleep_for(std::chrono::milliseconds(1));
+	}
+	return false;
+}
+
+// every device connects, disconnects and goes into powersave, 4 notifications each
+// with read_batteries the devices stay connected until their batteries have been read
+static bool run_round(UnifyStatus& driver, SimulatedHIDTransport& simulation, bool read_batteries) {
+	for (DeviceStatus status : { CONNECTED, DISCONNECTED, POWERSAVE }) {
+		unsigned long long idle = 0;
+		for (unsigned int receiver = 0; receiver < receivers; ++receiver) {
+			for (unsigned char slot = 1; slot <= DeviceRegistry::max_slot; ++slot) {
+				idle = simulation.inject_status(receiver, slot, status);
+			}
+		}
+		if (!simulation.wait_idle(idle, std::chrono::seconds(5)) || !wait_for(driver, status)) {
+			return false;
+		}
+		if (status == CONNECTED && read_batteries && !wait_for_batteries(driver)) {
+			return false;
+		}
+	}
+	return true;
+}
+
+int main() {
+	char directory[] = "/tmp/logitech-unify-mqtt-test-XXXXXX";
+	if (mkdtemp(directory) == nullptr) {
+		std::printf("couldn't create a config directory\n");
+		return 1;
+	}
+	setenv("LOGITECH_UNIFY_MQTT_DIR", directory, 1);
+	// no broker, everything goes to the spool on the publisher thread
+	// debug logs every status change, diagnostics and usage are periodic and allowed to allocate
+	// no flap penalty, an unstable device would stop changing state
+	// a powersave window just past the simulated devices' powersave delay, so connects are committed soon after
+	std::ofstream(std::string(directory) + "/config.ini")
+		<< "[MQTT]\naddress=\n[Log]\nlevel=debug\n[Battery]\npoll-interval=2\nrequests-per-second=10\n"
+		<< "[Diagnostics]\ninterval=0\n[Usage]\ninterval=0\n[Flap]\npenalty=0\n[Powersave]\nwindow=450\n";
+
+	UnifyOptions options;
+	options.simulation.receivers = receivers;
+	// the devices only change when the test says so
+	options.simulation.events_per_second = 0;
+	UnifyStatus driver(options);
+	SimulatedHIDTransport& simulation = *driver.simulated_transport();
+	std::thread thread([&]() {
+		driver_thread = true;
+		driver.run();
+	});
+	// opening the receivers, discovery, the first time every device connects and finding its battery feature allocate
+	const unsigned int warm_up_rounds = 3;
+	const unsigned int rounds = 8;
+	bool passed = true;
+	for (unsigned int round = 0; round < warm_up_rounds && passed; ++round) {
+		passed = run_round(driver, simulation, round == 0);
+	}
+	counting = true;
+	for (unsigned int round = 0; round < rounds && passed; ++round) {
+		passed = run_round(driver, simulation, false);
+	}
+	counting = false;
+	driver.stop();
+	thread.join();
+	std::string command = std::string("rm -rf ") + directory;
+	std::system(command.c_str());
+
+	if (!passed) {
+		std::printf("FAILED: the devices didn't reach the injected status or their batteries weren't read\n");
+		return 1;
+	}
+	std::printf("%u notifications, %llu allocations on the driver thread\n", rounds * devices * 4, allocations.load());
+	if (allocations.load() > 0) {
+		std::printf("FAILED: the steady event path allocated\n");
+		return 1;
+	}
+	return 0;
+}
@@ -0,0 +1,186 @@
+// Times the pieces every report and publish goes through and counts their heap allocations,
+// prints ns/op and allocs/op for each
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <new>
+#include <string>
+#include <unistd.h>
+#include "../src/hidpp.hpp"
+#include "../src/hidpp_requests.hpp"
+#include "../src/device_registry.hpp"
+#include "../src/timer_wheel.hpp"
+#include "../src/logger.hpp"
+#include "../src/mqtt_discovery.hpp"
+#include "../src/mqtt_sink.hpp"
+
+// only the benchmarked code is counted, not the logger's writer thread
+static thread_local bool bench_thread = false;
+static std::atomic<unsigned long long> allocations = 0;
+// results go here so the work isn't optimized away
+static volatile unsigned long long sink = 0;
+
+static void* allocate(std::size_t size, std::size_t alignment) {
+	if (bench_thread) {
+		allocations.fetch_add(1, std::memory_order_relaxed);
+	}
+	void* pointer = alignment > alignof(std::max_align_t) ? std::aligned_alloc(alignment, (size + alignment - 1) / alignment * alignment) : std::malloc(size ? size : 1);
+	if (pointer == nullptr) {
+		throw std::bad_alloc();
+	}
+	return pointer;
+}
+
+void* operator new(std::size_t size) { return allocate(size, 0); }
+void* operator new[](std::size_t size) { return allocate(size, 0); }
+void* operator new(std::size_t size, std::align_val_t alignment) { return allocate(size, (std::size_t)alignment); }
+void* operator new[](std::size_t size, std::align_val_t alignment) { return allocate(size, (std::size_t)alignment); }
+void operator delete(void* pointer) noexcept { std::free(pointer); }
+void operator delete[](void* pointer) noexcept { std::free(pointer); }
+void operator delete(void* pointer, std::size_t) noexcept { std::free(pointer); }
+void operator delete[](void* pointer, std::size_t) noexcept { std::free(pointer); }
+void operator delete(void* pointer, std::align_val_t) noexcept { std::free(pointer); }
+void operator delete[](void* pointer, std::align_val_t) noexcept { std::free(pointer); }
+void operator delete(void* pointer, std::size_t, std::align_val_t) noexcept { std::free(pointer); }
+void operator delete[](void* pointer, std::size_t, std::align_val_t) noexcept { std::free(pointer); }
+
+template <typename Function>
+static void bench(const char* name, unsigned int iterations, Function function) {
+	// once untimed, so first use setup isn't counted
+	function(0);
+	bench_thread = true;
+	unsigned long long first_allocations = allocations.load(std::memory_order_relaxed);
+	auto start = std::chrono::steady_clock::now();
+	for (unsigned int i = 0; i < iterations; ++i) {
+		function(i);
+	}
+	auto elapsed = std::chrono::steady_clock::now() - start;
+	unsigned long long counted = allocations.load(std::memory_order_relaxed) - first_allocations;
+	bench_thread = false;
+	double ns = (double)std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count() / iterations;
+	std::printf("%-28s %10.1f ns/op %8.3f allocs/op\n", name, ns, (double)counted / iterations);
+}
+
+// reports as a receiver sends them, see hidpp_test.cpp
+static const unsigned char connected[] = { 0x10, 0x02, 0x41, 0x04, 0x22, 0x5e, 0x40 };
+static const unsigned char name_reply[20] = { 0x11, 0xff, 0x83, 0xb5, 0x41, 0x04, 'M', '7', '2', '0' };
+static const unsigned char error_reply[] = { 0x10, 0xff, 0x8f, 0x83, 0xb5, 0x03, 0x00 };
+static const unsigned char battery_event[20] = { 0x11, 0x03, 0x04, 0x00, 0x1e, 0x00, 0x01 };
+
+int main(int argc, char** argv) {
+	// more iterations for steadier numbers
+	unsigned int iterations = argc > 1 ? (unsigned int)std::strtoul(argv[1], nullptr, 10) : 1000000;
+	if (iterations == 0) {
+		iterations = 1;
+	}
+
+	bench("decode connection", iterations, [](unsigned int) {
+		sink = sink + hidpp_decode(connected, sizeof(connected)).connection.wireless_pid;
+	});
+	bench("decode name reply", iterations, [](unsigned int) {
+		sink = sink + hidpp_decode(name_reply, sizeof(name_reply)).name.length;
+	});
+	bench("decode error", iterations, [](unsigned int) {
+		sink = sink + hidpp_decode(error_reply, sizeof(error_reply)).key;
+	});
+	bench("decode battery event", iterations, [](unsigned int) {
+		HIDPPMessage message = hidpp_decode(battery_event, sizeof(battery_event));
+		HIDPPBattery battery;
+		if (hidpp20_decode_battery(HIDPP_FEATURE_BATTERY_STATUS, message.feature, battery)) {
+			sink = sink + battery.level;
+		}
+	});
+
+	// a request for every slot and their replies, as when a receiver is opened
+	HIDPPRequestQueue requests;
+	bench("request and match reply", iterations, [&requests](unsigned int i) {
+		unsigned char slot = (unsigned char)(i % DeviceRegistry::max_slot);
+		HIDPPShortReport report = hidpp_register_request(hidpp_receiver_index, HIDPP_GET_LONG_REGISTER, HIDPP_REGISTER_PAIRING_INFORMATION, HIDPP_PAIRING_DEVICE_NAME | slot);
+		HIDPPRequest request{ 0, 0, (unsigned char)(slot + 1), hidpp_request_key(report.bytes), std::chrono::steady_clock::now() };
+		requests.reserve(request);
+		unsigned char reply_bytes[20] = { 0x11, 0xff, 0x83, 0xb5, (unsigned char)(HIDPP_PAIRING_DEVICE_NAME | slot), 0x04, 'M', '7', '2', '0' };
+		HIDPPRequest matched;
+		if (requests.match(hidpp_decode(reply_bytes, sizeof(reply_bytes)), matched)) {
+			sink = sink + matched.slot;
+		}
+	});
+
+	// the lookup behind every notification, 4 receivers with every slot paired
+	DeviceRegistry devices;
+	for (unsigned int receiver = 0; receiver < 4; ++receiver) {
+		for (unsigned char slot = 1; slot <= DeviceRegistry::max_slot; ++slot) {
+			devices.get(0x51500000 + receiver, slot);
+		}
+	}
+	bench("find device", iterations, [&devices](unsigned int i) {
+		DeviceData* device = devices.find(0x51500000 + i % 4, (unsigned char)(i % DeviceRegistry::max_slot + 1));
+		sink = sink + (device != nullptr ? device->slot : 0);
+	});
+
+	// a powersave window armed and expired for every connect
+	TimerWheel timers;
+	bench("schedule and expire timer", iterations, [&timers](unsigned int i) {
+		auto now = std::chrono::steady_clock::now();
+		timers.schedule(i, now);
+		unsigned long long key;
+		std::chrono::steady_clock::time_point deadline;
+		while (timers.expire(now + std::chrono::milliseconds(10), key, deadline)) {
+			sink = sink + key;
+		}
+	});
+
+	// the payload of every status and battery publish, the topic is looked up from the receiver's topics
+	ReceiverTopics topics;
+	build_receiver_topics("homeassistant", 0x51500000, topics);
+	bench("format status payload", iterations, [&topics](unsigned int i) {
+		DeviceEvent event{};
+		event.kind = i % 2 ? EVENT_STATUS : EVENT_BATTERY;
+		event.slot = (unsigned char)(i % DeviceRegistry::max_slot + 1);
+		event.status = i % 4 < 2 ? CONNECTED : POWERSAVE;
+		event.battery_level = (int)(i % 101);
+		event.topic = i % 2 ? topics.state[event.slot - 1] : topics.battery[event.slot - 1];
+		char buffer[8];
+		sink = sink + MQTTSink::payload(event, buffer).size() + event.topic.size();
+	});
+	// once per receiver and discovery prefix
+	bench("build receiver topics", iterations / 100 + 1, [&topics](unsigned int i) {
+		build_receiver_topics("homeassistant", 0x51500000 + i % 4, topics);
+		sink = sink + topics.config.size();
+	});
+
+	// a device that was renamed, and the config of a receiver with every slot paired
+	DiscoveryComponent components[DeviceRegistry::max_slot];
+	for (unsigned char slot = 1; slot <= DeviceRegistry::max_slot; ++slot) {
+		update_discovery_component(components[slot - 1], 0x51500000, slot, "M720 Triathlon", slot % 2 == 0, true, topics);
+	}
+	bench("build discovery component", iterations / 100 + 1, [&components, &topics](unsigned int i) {
+		const char* names[] = { "M720 Triathlon", "K400 Plus" };
+		sink = sink + update_discovery_component(components[0], 0x51500000, 1, names[i % 2], true, true, topics);
+	});
+	std::string header = discovery_header(0x51500000);
+	std::string config;
+	bench("build discovery config", iterations / 100 + 1, [&header, &components, &config](unsigned int) {
+		discovery_config(header, components, config);
+		sink = sink + config.size();
+	});
+
+	// what a status change costs the driver thread, formatting and writing happen on the writer thread
+	Logger debug_log;
+	char log_path[] = "/tmp/logitech-unify-mqtt-bench-XXXXXX";
+	int log_file = mkstemp(log_path);
+	if (log_file >= 0) {
+		close(log_file);
+		debug_log.open(log_path, LOG_DEBUG, 64 * 1024 * 1024);
+	}
+	bench("log status change", iterations, [&debug_log](unsigned int i) {
+		debug_log.log(LOG_DEVICE_STATUS, 0x51500000u, i % DeviceRegistry::max_slot + 1, i % 2 ? "connected" : "disconnected");
+	});
+	debug_log.close();
+	if (log_file >= 0) {
+		unlink(log_path);
+		std::string rotated = std::string(log_path) + ".1";
+		unlink(rotated.c_str());
+	}
+	return 0;
+}
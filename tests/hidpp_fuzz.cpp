@@ -0,0 +1,85 @@
+// libFuzzer target for hidpp_decode, every input is one report as read from a receiver
+// anything the decoder hands back has to stay inside the report, names have to be clamped and printable
+// without libFuzzer (HIDPP_FUZZ_STANDALONE) it runs the files given as arguments,
+// or random reports if there are none
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include "../src/hidpp.hpp"
+
+static void check(bool condition) {
+	if (!condition) {
+		std::abort();
+	}
+}
+
+extern "C" int LLVMFuzzerTestOneInput(const std::uint8_t* data, std::size_t size) {
+	HIDPPMessage message = hidpp_decode(data, (unsigned int)size);
+	const unsigned char* end = data + size;
+	switch (message.kind) {
+		case HIDPP_REGISTER_REPLY:
+			check(message.register_reply.value + message.register_reply.value_size <= end);
+			break;
+		case HIDPP_NAME_REPLY:
+			check(message.name.length <= 14);
+			check(std::strlen(message.name.name) == message.name.length);
+			for (unsigned int i = 0; i < message.name.length; ++i) {
+				check(message.name.name[i] >= 0x20 && message.name.name[i] < 0x7f);
+			}
+			break;
+		case HIDPP20_MESSAGE: {
+			check(message.feature.params + message.feature.params_size <= end);
+			HIDPPBattery battery;
+			if (hidpp20_decode_battery(HIDPP_FEATURE_UNIFIED_BATTERY, message.feature, battery)) {
+				check(battery.level <= 100);
+			}
+			if (hidpp20_decode_battery(HIDPP_FEATURE_BATTERY_STATUS, message.feature, battery)) {
+				check(battery.level <= 100);
+			}
+			break;
+		}
+		default:
+			break;
+	}
+	return 0;
+}
+
+#ifdef HIDPP_FUZZ_STANDALONE
+#include <cstdio>
+#include <fstream>
+#include <iterator>
+#include <random>
+#include <vector>
+
+int main(int argc, char** argv) {
+	if (argc > 1) {
+		for (int i = 1; i < argc; ++i) {
+			std::ifstream file(argv[i], std::ios::binary);
+			std::vector<std::uint8_t> input((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+			LLVMFuzzerTestOneInput(input.data(), input.size());
+		}
+		std::printf("ran %d inputs\n", argc - 1);
+		return 0;
+	}
+	// mostly HID++ report ids and sub ids, so the inputs get past the first checks
+	std::mt19937 random(1);
+	std::uniform_int_distribution<int> byte(0, 0xff);
+	const std::uint8_t report_ids[] = { HIDPP_SHORT, HIDPP_LONG };
+	const std::uint8_t sub_ids[] = { HIDPP_DEVICE_CONNECTION, HIDPP_ERROR_MESSAGE, hidpp20_error_feature_index, HIDPP_GET_REGISTER, HIDPP_GET_LONG_REGISTER };
+	const unsigned int runs = 1000000;
+	for (unsigned int run = 0; run < runs; ++run) {
+		std::uint8_t input[24];
+		for (std::uint8_t& value : input) {
+			value = (std::uint8_t)byte(random);
+		}
+		input[0] = byte(random) < 0xf0 ? report_ids[byte(random) % 2] : input[0];
+		input[2] = byte(random) < 0x80 ? sub_ids[byte(random) % 5] : input[2];
+		// exactly as long as the report, so reading past it is caught
+		std::size_t size = (std::size_t)std::uniform_int_distribution<int>(0, sizeof(input))(random);
+		std::vector<std::uint8_t> report(input, input + size);
+		LLVMFuzzerTestOneInput(report.data(), report.size());
+	}
+	std::printf("ran %u random reports\n", runs);
+	return 0;
+}
+#endif
@@ -0,0 +1,168 @@
+// Decodes reports as a Unifying receiver sends them and checks every field the driver relies on
+#include <cstdio>
+#include <cstring>
+#include "../src/hidpp.hpp"
+
+static unsigned int failures = 0;
+
+static void check(bool condition, const char* what) {
+	if (!condition) {
+		std::printf("FAILED: %s\n", what);
+		++failures;
+	}
+}
+
+// the key a reply or error has to share with its request once the parameter is left out
+static bool same_request(unsigned long long request_key, unsigned long long reply_key) {
+	const unsigned long long param_mask = 0x1ff;
+	return (request_key & ~param_mask) == (reply_key & ~param_mask);
+}
+
+static void connection_notifications() {
+	// M720 in slot 2 connecting, then going out of range
+	const unsigned char connected[] = { 0x10, 0x02, 0x41, 0x04, 0x22, 0x5e, 0x40 };
+	HIDPPMessage message = hidpp_decode(connected, sizeof(connected));
+	check(message.kind == HIDPP_CONNECTION, "connection notification kind");
+	check(message.device_index == 2, "connection notification slot");
+	check(message.key == 0, "notifications don't match a request");
+	check(message.connection.protocol == 0x04, "unifying protocol");
+	check(message.connection.device_type == 0x02, "mouse device type");
+	check(message.connection.link_established, "link established");
+	check(message.connection.encrypted, "link encrypted");
+	check(message.connection.wireless_pid == 0x405e, "little endian wireless pid");
+
+	const unsigned char lost[] = { 0x10, 0x02, 0x41, 0x04, 0x62, 0x5e, 0x40 };
+	message = hidpp_decode(lost, sizeof(lost));
+	check(message.kind == HIDPP_CONNECTION && !message.connection.link_established, "link lost");
+
+	// only short reports carry connection notifications
+	const unsigned char long_connection[20] = { 0x11, 0x02, 0x41, 0x04, 0x22, 0x5e, 0x40 };
+	check(hidpp_decode(long_connection, sizeof(long_connection)).kind == HIDPP_UNKNOWN, "long connection notification");
+}
+
+static void register_replies() {
+	const HIDPPShortReport serial_request = hidpp_register_request(hidpp_receiver_index, HIDPP_GET_LONG_REGISTER, HIDPP_REGISTER_PAIRING_INFORMATION, HIDPP_PAIRING_RECEIVER_INFO);
+	const unsigned char receiver_info[20] = { 0x11, 0xff, 0x83, 0xb5, 0x03, 0x4a, 0x3b, 0x2c, 0x1d, 0x04, 0x06, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00 };
+	HIDPPMessage message = hidpp_decode(receiver_info, sizeof(receiver_info));
+	check(message.kind == HIDPP_RECEIVER_INFO_REPLY, "receiver info kind");
+	check(message.receiver_info.serial == 0x4a3b2c1d, "big endian receiver serial");
+	check(message.key == hidpp_request_key(serial_request.bytes), "receiver info matches its request");
+
+	// slot 2, report interval 8 ms, wireless pid 405e, mouse
+	const HIDPPShortReport info_request = hidpp_register_request(hidpp_receiver_index, HIDPP_GET_LONG_REGISTER, HIDPP_REGISTER_PAIRING_INFORMATION, HIDPP_PAIRING_DEVICE_INFO | 1);
+	const unsigned char device_info[20] = { 0x11, 0xff, 0x83, 0xb5, 0x21, 0x08, 0x08, 0x40, 0x5e, 0x00, 0x00, 0x02, 0x07, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00 };
+	message = hidpp_decode(device_info, sizeof(device_info));
+	check(message.kind == HIDPP_DEVICE_INFO_REPLY, "device info kind");
+	check(message.device_info.slot == 2, "device info slot");
+	check(message.device_info.wireless_pid == 0x405e, "big endian device info wireless pid");
+	check(message.device_info.device_type == 0x02, "device info type");
+	check(message.key == hidpp_request_key(info_request.bytes), "device info matches its request");
+	check(message.key != hidpp_request_key(serial_request.bytes), "device info doesn't match the serial request");
+
+	// the notifications register echoed back on a short report
+	const unsigned char notifications[] = { 0x10, 0xff, 0x80, 0x00, 0x00, 0x00, 0x00 };
+	message = hidpp_decode(notifications, sizeof(notifications));
+	check(message.kind == HIDPP_REGISTER_REPLY, "register reply kind");
+	check(message.register_reply.value_size == 3, "short register value size");
+}
+
+static void name_replies() {
+	const unsigned char m720[20] = { 0x11, 0xff, 0x83, 0xb5, 0x41, 0x04, 'M', '7', '2', '0', 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00 };
+	HIDPPMessage message = hidpp_decode(m720, sizeof(m720));
+	check(message.kind == HIDPP_NAME_REPLY, "name reply kind");
+	check(message.name.slot == 2, "name reply slot");
+	check(message.name.length == 4 && std::strcmp(message.name.name, "M720") == 0, "name");
+
+	// a length past the end of the report is clamped to the 14 characters that fit
+	const unsigned char too_long[20] = { 0x11, 0xff, 0x83, 0xb5, 0x40, 0x20, 'W', 'i', 'r', 'e', 'l', 'e', 's', 's', ' ', 'M', 'o', 'u', 's', 'e' };
+	message = hidpp_decode(too_long, sizeof(too_long));
+	check(message.kind == HIDPP_NAME_REPLY && message.name.slot == 1, "clamped name reply");
+	check(message.name.length == 14 && std::strcmp(message.name.name, "Wireless Mouse") == 0, "name clamped to 14 characters");
+
+	// the name ends at a nul even if the length says otherwise
+	const unsigned char nul[20] = { 0x11, 0xff, 0x83, 0xb5, 0x42, 0x08, 'K', '2', '7', '0', 0x00, 'x', 'x', 'x', 0x00, 0x00, 0x00, 0x00, 0x00, 0x00 };
+	message = hidpp_decode(nul, sizeof(nul));
+	check(message.name.length == 4 && std::strcmp(message.name.name, "K270") == 0, "name ends at a nul");
+
+	// bytes outside printable ascii can't go into JSON as they are
+	const unsigned char high[20] = { 0x11, 0xff, 0x83, 0xb5, 0x43, 0x05, 'M', 0xc3, 0xa9, 0x1b, 'X', 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00 };
+	message = hidpp_decode(high, sizeof(high));
+	check(message.name.length == 5 && std::strcmp(message.name.name, "M???X") == 0, "non printable name bytes replaced");
+}
+
+static void error_replies() {
+	// nothing paired in slot 4
+	const HIDPPShortReport info_request = hidpp_register_request(hidpp_receiver_index, HIDPP_GET_LONG_REGISTER, HIDPP_REGISTER_PAIRING_INFORMATION, HIDPP_PAIRING_DEVICE_INFO | 3);
+	const unsigned char empty_slot[] = { 0x10, 0xff, 0x8f, 0x83, 0xb5, 0x03, 0x00 };
+	HIDPPMessage message = hidpp_decode(empty_slot, sizeof(empty_slot));
+	check(message.kind == HIDPP_ERROR_REPLY, "error kind");
+	check(message.error.sub_id == HIDPP_GET_LONG_REGISTER && message.error.address == HIDPP_REGISTER_PAIRING_INFORMATION, "error echoes the request");
+	check(message.error.error_code == 0x03, "error code");
+	check((message.key & 0x1ff) == hidpp_any_param, "errors match any parameter");
+	check(same_request(hidpp_request_key(info_request.bytes), message.key), "error matches its request");
+
+	// the receiver answering a ping for a device that is out of range
+	const HIDPPShortReport ping = hidpp20_ping_request(1, 1);
+	const unsigned char unreachable[] = { 0x10, 0x01, 0x8f, 0x00, 0x1a, 0x09, 0x00 };
+	message = hidpp_decode(unreachable, sizeof(unreachable));
+	check(message.kind == HIDPP_ERROR_REPLY && message.error.error_code == hidpp_error_unreachable, "unreachable error");
+	check(same_request(hidpp_request_key(ping.bytes), message.key), "unreachable error matches the ping");
+
+	// a HID++ 2.0 device rejecting a function
+	const unsigned char feature_error[20] = { 0x11, 0x01, 0xff, 0x00, 0x1a, 0x05 };
+	message = hidpp_decode(feature_error, sizeof(feature_error));
+	check(message.kind == HIDPP20_ERROR_REPLY && message.error.error_code == 0x05, "HID++ 2.0 error");
+	check(same_request(hidpp_request_key(ping.bytes), message.key), "HID++ 2.0 error matches the ping");
+}
+
+static void feature_messages() {
+	// ping reply from a HID++ 4.5 device, echoing the data byte
+	const HIDPPShortReport ping = hidpp20_ping_request(1, 1);
+	const unsigned char pong[20] = { 0x11, 0x01, 0x00, 0x1a, 0x04, 0x05, 0x01 };
+	HIDPPMessage message = hidpp_decode(pong, sizeof(pong));
+	check(message.kind == HIDPP20_MESSAGE, "ping reply kind");
+	check(message.feature.function == HIDPP_ROOT_PING && message.feature.software_id == hidpp20_software_id, "ping reply function");
+	check(message.feature.params_size == 16 && message.feature.params[0] == 4 && message.feature.params[1] == 5, "protocol version");
+	check(message.key == hidpp_request_key(ping.bytes), "ping reply matches the ping");
+
+	// unified battery get status reply: 80 percent, discharging
+	const unsigned char status[20] = { 0x11, 0x02, 0x05, 0x1a, 0x50, 0x08, 0x00 };
+	message = hidpp_decode(status, sizeof(status));
+	HIDPPBattery battery;
+	check(message.kind == HIDPP20_MESSAGE && hidpp20_decode_battery(HIDPP_FEATURE_UNIFIED_BATTERY, message.feature, battery), "unified battery reply");
+	check(battery.level == 80 && !battery.charging, "unified battery level");
+
+	// battery status event: 30 percent, recharging
+	const unsigned char event[20] = { 0x11, 0x03, 0x04, 0x00, 0x1e, 0x00, 0x01 };
+	message = hidpp_decode(event, sizeof(event));
+	check(message.kind == HIDPP20_MESSAGE && message.key == 0, "events don't match a request");
+	check(hidpp20_decode_battery(HIDPP_FEATURE_BATTERY_STATUS, message.feature, battery) && battery.level == 30 && battery.charging, "battery status event");
+}
+
+static void malformed_reports() {
+	const unsigned char connected[] = { 0x10, 0x02, 0x41, 0x04, 0x22, 0x5e, 0x40 };
+	check(hidpp_decode(connected, 0).kind == HIDPP_UNKNOWN, "empty report");
+	check(hidpp_decode(connected, 5).kind == HIDPP_UNKNOWN, "truncated short report");
+	const unsigned char name[20] = { 0x11, 0xff, 0x83, 0xb5, 0x41, 0x04, 'M', '7', '2', '0' };
+	check(hidpp_decode(name, 7).kind == HIDPP_UNKNOWN, "long report cut to a short one");
+	const unsigned char unknown_id[] = { 0x20, 0x02, 0x41, 0x04, 0x22, 0x5e, 0x40 };
+	check(hidpp_decode(unknown_id, sizeof(unknown_id)).kind == HIDPP_UNKNOWN, "unknown report id");
+	// a HID++ 1.0 notification nothing here handles
+	const unsigned char disconnection[] = { 0x10, 0x02, 0x40, 0x02, 0x00, 0x00, 0x00 };
+	check(hidpp_decode(disconnection, sizeof(disconnection)).kind == HIDPP_UNKNOWN, "unhandled sub id");
+}
+
+int main() {
+	connection_notifications();
+	register_replies();
+	name_replies();
+	error_replies();
+	feature_messages();
+	malformed_reports();
+	if (failures > 0) {
+		std::printf("%u checks failed\n", failures);
+		return 1;
+	}
+	std::printf("all checks passed\n");
+	return 0;
+}
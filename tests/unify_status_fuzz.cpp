@@ -0,0 +1,171 @@
+// libFuzzer target for the driver, every input is a run of reports and device changes
+// fed through the simulated receivers, so the registry, discovery and the request queues
+// see whatever indices and lengths the input holds, next to devices that really connect
+// an input is records of a tag byte followed by what it needs:
+//   tag & 0x80 set: the virtual device (tag >> 3) & 0x0f connects, or disconnects if tag & 1,
+//   a connect and a disconnect in one input go into powersave
+//   otherwise: a report for receiver tag & 1 on channel (tag >> 1) & 1, whose size is the next byte,
+//   followed by that many bytes, which may be fewer than the report is long
+// every device in the snapshot afterwards has to be one the receivers can have
+// without libFuzzer (HIDPP_FUZZ_STANDALONE) it runs the files given as arguments,
+// or random inputs if there are none
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <string>
+#include <thread>
+#include <unistd.h>
+#include "../src/unify_status.hpp"
+
+static const unsigned int receivers = 2;
+
+static char directory[] = "/tmp/logitech-unify-mqtt-fuzz-XXXXXX";
+static UnifyStatus* driver = nullptr;
+static std::thread driver_thread;
+
+static void check(bool condition) {
+	if (!condition) {
+		std::abort();
+	}
+}
+
+static void start_driver() {
+	check(mkdtemp(directory) != nullptr);
+	setenv("LOGITECH_UNIFY_MQTT_DIR", directory, 1);
+	// no broker, a short powersave window so held connects are committed between inputs
+	std::ofstream(std::string(directory) + "/config.ini")
+		<< "[MQTT]\naddress=\n[Log]\nlevel=debug\n[Powersave]\nwindow=5\n";
+	UnifyOptions options;
+	options.simulation.receivers = receivers;
+	// only what the input says happens
+	options.simulation.events_per_second = 0;
+	driver = new UnifyStatus(options);
+	driver_thread = std::thread([]() { driver->run(); });
+	std::chrono::steady_clock::time_point deadline = std::chrono::steady_clock::now() + std::chrono::seconds(10);
+	while (!driver->snapshot().ready) {
+		check(std::chrono::steady_clock::now() < deadline);
+		std::this_thread::sleep_for(std::chrono::milliseconds(1));
+	}
+}
+
+static void check_snapshot() {
+	StateSnapshot snapshot = driver->snapshot();
+	check(snapshot.count <= StateSnapshot::max_devices);
+	unsigned int serials[receivers] = {};
+	unsigned int serial_count = 0;
+	for (unsigned int i = 0; i < snapshot.count; ++i) {
+		DeviceSnapshot const& device = snapshot.devices[i];
+		check(device.slot >= 1 && device.slot <= DeviceRegistry::max_slot);
+		check(device.status <= UNSTABLE);
+		check(device.battery_level >= -1 && device.battery_level <= 100);
+		check(std::memchr(device.name, 0, sizeof(device.name)) != nullptr);
+		for (unsigned int j = 0; j < i; ++j) {
+			check(snapshot.devices[j].receiver_serial != device.receiver_serial || snapshot.devices[j].slot != device.slot);
+		}
+		// nothing the input sends can make up another receiver
+		bool known = false;
+		for (unsigned int j = 0; j < serial_count; ++j) {
+			known = known || serials[j] == device.receiver_serial;
+		}
+		if (!known) {
+			check(serial_count < receivers);
+			serials[serial_count++] = device.receiver_serial;
+		}
+	}
+}
+
+extern "C" int LLVMFuzzerTestOneInput(const std::uint8_t* data, std::size_t size) {
+	if (driver == nullptr) {
+		start_driver();
+	}
+	SimulatedHIDTransport* simulation = driver->simulated_transport();
+	unsigned long long idle = 0;
+	std::size_t offset = 0;
+	while (offset < size) {
+		std::uint8_t tag = data[offset++];
+		if (tag & 0x80) {
+			unsigned int device = (tag >> 3) & 0x0f;
+			idle = simulation->inject_status(device / DeviceRegistry::max_slot, (unsigned char)(device % DeviceRegistry::max_slot + 1), tag & 1 ? DISCONNECTED : CONNECTED);
+			continue;
+		}
+		HIDReport report;
+		report.receiver = tag & 1;
+		report.channel = (tag >> 1) & 1 ? RESPONDER_CHANNEL : RECEIVER_CHANNEL;
+		unsigned int wanted = offset < size ? data[offset++] % (max_report_size + 1) : 0;
+		report.size = (unsigned int)std::min<std::size_t>(wanted, size - offset);
+		std::memcpy(report.data, data + offset, report.size);
+		offset += report.size;
+		idle = simulation->inject_report(report);
+	}
+	// a driver that stops reading is as much a bug as a crash
+	check(simulation->wait_idle(idle, std::chrono::seconds(5)));
+	check_snapshot();
+	return 0;
+}
+
+#ifdef HIDPP_FUZZ_STANDALONE
+#include <cstdio>
+#include <iterator>
+#include <random>
+#include <vector>
+
+int main(int argc, char** argv) {
+	unsigned int runs = 0;
+	if (argc > 1) {
+		for (int i = 1; i < argc; ++i) {
+			std::ifstream file(argv[i], std::ios::binary);
+			std::vector<std::uint8_t> input((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+			LLVMFuzzerTestOneInput(input.data(), input.size());
+		}
+		runs = argc - 1;
+	}
+	else {
+		// mostly connection notifications and replies with a HID++ report id, so the inputs get past the first checks
+		std::mt19937 random(1);
+		std::uniform_int_distribution<int> byte(0, 0xff);
+		const std::uint8_t report_ids[] = { HIDPP_SHORT, HIDPP_LONG };
+		const std::uint8_t sub_ids[] = { HIDPP_DEVICE_CONNECTION, HIDPP_ERROR_MESSAGE, hidpp20_error_feature_index, HIDPP_GET_REGISTER, HIDPP_GET_LONG_REGISTER };
+		runs = 3000;
+		for (unsigned int run = 0; run < runs; ++run) {
+			std::vector<std::uint8_t> input;
+			unsigned int records = std::uniform_int_distribution<unsigned int>(1, 8)(random);
+			for (unsigned int record = 0; record < records; ++record) {
+				if (byte(random) < 0x40) {
+					input.push_back((std::uint8_t)(0x80 | byte(random)));
+					continue;
+				}
+				input.push_back((std::uint8_t)(byte(random) & 0x7f));
+				unsigned int length = (unsigned int)std::uniform_int_distribution<int>(0, max_report_size)(random);
+				input.push_back((std::uint8_t)length);
+				for (unsigned int i = 0; i < length; ++i) {
+					std::uint8_t value = (std::uint8_t)byte(random);
+					if (i == 0 && byte(random) < 0xf0) {
+						value = report_ids[byte(random) % 2];
+					}
+					else if (i == 1 && byte(random) < 0xc0) {
+						// slots, the receiver and the indices just past them
+						value = (std::uint8_t)std::uniform_int_distribution<int>(0, DeviceRegistry::max_slot + 2)(random);
+						value = value == DeviceRegistry::max_slot + 2 ? hidpp_receiver_index : value;
+					}
+					else if (i == 2 && byte(random) < 0x80) {
+						value = sub_ids[byte(random) % 5];
+					}
+					input.push_back(value);
+				}
+			}
+			LLVMFuzzerTestOneInput(input.data(), input.size());
+		}
+	}
+	if (driver != nullptr) {
+		driver->stop();
+		driver_thread.join();
+		delete driver;
+		std::string command = std::string("rm -rf ") + directory;
+		std::system(command.c_str());
+	}
+	std::printf("ran %u inputs\n", runs);
+	return 0;
+}
+#endif